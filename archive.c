@@ -0,0 +1,468 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Backup and restore of a whole brick as a ustar archive. The archive
+ * holds nxtctl/brick with the device info, then every file of the brick
+ * and last nxtctl/sums with the FNV-1a hash of each file, in the format
+ * of the sync manifest. Backups are streamed one file after the other.
+ * Restores read the archive into memory, it is no larger than the flash
+ * of a brick, and check all of it before the brick is touched.
+ */
+
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "cache.h"
+#include "fio.h"
+
+#define ARCHIVE_BLOCK 512
+#define ARCHIVE_SIZE_MAX 077777777777UL	/* largest member size in the header */
+#define ARCHIVE_INFO  "nxtctl/brick"
+#define ARCHIVE_SUMS  "nxtctl/sums"
+
+/* ustar header, numbers are octal strings */
+typedef struct {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} TarHeader;
+
+typedef struct {
+	char name[20];
+	unsigned int size;
+	uint64_t hash;
+	const unsigned char *data;	/* content in the archive when restoring */
+	int summed;		/* hash is in nxtctl/sums */
+	int linear;		/* uploaded with OPEN_WRITE_LINEAR */
+	int replaced;	/* exists on the brick */
+	unsigned int remotesize;
+} ArchiveFile;
+
+typedef struct {
+	ArchiveFile *files;
+	int count;
+} ArchiveList;
+
+static const unsigned char archive_zero[ARCHIVE_BLOCK];
+
+static ArchiveFile* archive_find(ArchiveList *list, const char *name) {
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		if (strcmp(list->files[i].name, name) == 0)
+			return &list->files[i];
+	}
+	return NULL;
+}
+
+static ArchiveFile* archive_add(ArchiveList *list, const char *name) {
+	ArchiveFile *file;
+
+	list->files = realloc(list->files, (list->count + 1) * sizeof(ArchiveFile));
+	if (list->files == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	file = &list->files[list->count++];
+	memset(file, 0, sizeof(*file));
+	strncpy(file->name, name, sizeof(file->name) - 1);
+	return file;
+}
+
+static int archive_list_cb(const char *name, unsigned int size, void *arg) {
+	archive_add(arg, name)->size = size;
+	return 0;
+}
+
+static int archive_replaced_cb(const char *name, unsigned int size, void *arg) {
+	ArchiveFile *file;
+
+	if ((file = archive_find(arg, name)) != NULL) {
+		file->replaced = 1;
+		file->remotesize = size;
+	}
+	return 0;
+}
+
+/***********************************************************************/
+/* ustar format                                                        */
+/***********************************************************************/
+
+static unsigned long archive_sum(const TarHeader *h) {
+	const unsigned char *p = (const unsigned char *) h;
+	unsigned long sum = 0;
+	size_t i;
+
+	/* the checksum field itself counts as spaces */
+	for (i = 0; i < sizeof(*h); i++) {
+		if (i >= offsetof(TarHeader, chksum) &&
+			i < offsetof(TarHeader, chksum) + sizeof(h->chksum))
+			sum += ' ';
+		else
+			sum += p[i];
+	}
+	return sum;
+}
+
+static int archive_octal(const char *field, size_t len, unsigned long *value) {
+	char s[16], *end;
+
+	memcpy(s, field, len);
+	s[len] = 0;
+	*value = strtoul(s, &end, 8);
+	return (end == s || (*end != 0 && *end != ' ')) ? -1 : 0;
+}
+
+static int archive_header(FileSink *sink, const char *name, unsigned long size, time_t mtime) {
+	TarHeader h;
+
+	if (size > ARCHIVE_SIZE_MAX) {
+		fprintf(stderr, "error: %s is too large for the archive\n", name);
+		return -1;
+	}
+	memset(&h, 0, sizeof(h));
+	strncpy(h.name, name, sizeof(h.name) - 1);
+	strcpy(h.mode, "0000644");
+	strcpy(h.uid, "0000000");
+	strcpy(h.gid, "0000000");
+	snprintf(h.size, sizeof(h.size), "%011lo", size);
+	snprintf(h.mtime, sizeof(h.mtime), "%011lo", (unsigned long) mtime);
+	h.typeflag = '0';
+	memcpy(h.magic, "ustar", 6);
+	memcpy(h.version, "00", 2);
+	snprintf(h.chksum, sizeof(h.chksum), "%06lo", archive_sum(&h));
+	h.chksum[7] = ' ';
+	return fio_sink_write(sink, &h, sizeof(h));
+}
+
+/* members are padded to full blocks */
+static int archive_pad(FileSink *sink, unsigned long size) {
+	size %= ARCHIVE_BLOCK;
+	return size ? fio_sink_write(sink, archive_zero, ARCHIVE_BLOCK - size) : 0;
+}
+
+static int archive_member(FileSink *sink, const char *name, const char *text, time_t mtime) {
+	size_t len = strlen(text);
+
+	if (archive_header(sink, name, len, mtime) != 0 ||
+		fio_sink_write(sink, text, len) != 0)
+		return -1;
+	return archive_pad(sink, len);
+}
+
+/***********************************************************************/
+/* backup                                                              */
+/***********************************************************************/
+
+/*
+ * Write all files of the brick to the archive at path, "-" writes to
+ * stdout. Only one block of the archive is kept in memory.
+ */
+int archive_backup(NXT *nxt, const char *path) {
+	char text[256], addr[32];
+	ArchiveList list;
+	ArchiveFile *file;
+	NXTInfo info;
+	FileSink sink;
+	unsigned long bytes = 0;
+	char *sums, *p;
+	time_t now;
+	int i, res = -1;
+	double start;
+
+	if (strcmp(path, "-") == 0 && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "error: not writing an archive to a terminal\n");
+		return -1;
+	}
+	start = nxt_clock();
+	now = time(NULL);
+	memset(&list, 0, sizeof(list));
+	if (nxt_get_device_info(nxt, &info) != 0 ||
+		nxt_list_files(nxt, "*.*", archive_list_cb, &list) != 0 ||
+		fio_sink_open(&sink, path, nxt->sync, 0666) != 0) {
+		free(list.files);
+		return -1;
+	}
+
+	nxt_format_btaddr(&info, addr, sizeof(addr));
+	snprintf(text, sizeof(text), "name %s\naddress %s\nfree %u\nfiles %d\ndate %lu\n",
+			 info.name, addr, info.free_space, list.count, (unsigned long) now);
+	if (archive_member(&sink, ARCHIVE_INFO, text, now) != 0)
+		goto out;
+
+	for (i = 0; i < list.count; i++) {
+		file = &list.files[i];
+		if (archive_header(&sink, file->name, file->size, now) != 0)
+			goto out;
+		/* the header is out already, the file must not change size */
+		file->hash = FIO_HASH_INIT;
+		sink.hash = &file->hash;
+		if (nxt_get_file_sink(nxt, file->name, &sink, file->size) != 0)
+			goto out;
+		sink.hash = NULL;
+		if (archive_pad(&sink, file->size) != 0)
+			goto out;
+		bytes += file->size;
+	}
+
+	/* hash, blank, name of at most 19 characters and newline per file */
+	if ((sums = malloc(list.count * 38 + 1)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	p = sums;
+	*p = 0;
+	for (i = 0; i < list.count; i++)
+		p += sprintf(p, "%016" PRIx64 " %s\n", list.files[i].hash, list.files[i].name);
+	res = archive_member(&sink, ARCHIVE_SUMS, sums, now);
+	free(sums);
+
+	/* end of archive */
+	if (res == 0 &&
+		(fio_sink_write(&sink, archive_zero, ARCHIVE_BLOCK) != 0 ||
+		 fio_sink_write(&sink, archive_zero, ARCHIVE_BLOCK) != 0))
+		res = -1;
+out:
+	sink.hash = NULL;
+	if (fio_sink_close(&sink) != 0)
+		res = -1;
+	if (res != 0) {
+		fprintf(stderr, "error: backup of %s failed\n", info.name);
+		if (strcmp(path, "-") != 0)
+			unlink(path);
+	} else {
+		/* keep stdout clean when the archive goes there */
+		fprintf(strcmp(path, "-") == 0 ? stderr : stdout,
+				"backup: %d files (%lu bytes) of %s, %.2f s\n",
+				list.count, bytes, info.name, nxt_clock() - start);
+	}
+	free(list.files);
+	return res;
+}
+
+/***********************************************************************/
+/* restore                                                             */
+/***********************************************************************/
+
+/*
+ * Check the hashes in nxtctl/sums against the files in the archive
+ */
+static int archive_verify(ArchiveList *list, const char *path,
+						  const char *sums, unsigned long len) {
+	char line[64], name[20];
+	ArchiveFile *file;
+	uint64_t hash;
+	const char *end;
+	size_t n;
+	int i;
+
+	while (len > 0) {
+		end = memchr(sums, '\n', len);
+		n = end ? (size_t) (end - sums + 1) : len;
+		if (n < sizeof(line)) {
+			memcpy(line, sums, n);
+			line[n] = 0;
+			if (sscanf(line, "%" SCNx64 " %19s", &hash, name) == 2 &&
+				(file = archive_find(list, name)) != NULL) {
+				if (file->hash != hash) {
+					fprintf(stderr, "error: %s is damaged, %s does not match its checksum\n",
+							path, name);
+					return -1;
+				}
+				file->summed = 1;
+			}
+		}
+		sums += n;
+		len -= n;
+	}
+	for (i = 0; i < list->count; i++) {
+		if (!list->files[i].summed) {
+			fprintf(stderr, "error: %s has no checksum for %s\n", path, list->files[i].name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Parse the archive in src into list, every member is checked
+ */
+static int archive_parse(ArchiveList *list, FileSource *src, const char *path) {
+	const TarHeader *h;
+	const unsigned char *data;
+	const char *sums = NULL;
+	char name[sizeof(h->name) + 1];
+	unsigned long size, sumslen = 0;
+	ArchiveFile *file;
+	size_t off;
+
+	for (off = 0; ; off += ARCHIVE_BLOCK + (size + ARCHIVE_BLOCK - 1) / ARCHIVE_BLOCK * ARCHIVE_BLOCK) {
+		if (off + ARCHIVE_BLOCK > src->size) {
+			fprintf(stderr, "error: %s is truncated\n", path);
+			return -1;
+		}
+		h = (const TarHeader *) (src->data + off);
+		if (h->name[0] == 0)
+			break;
+		if (memcmp(h->magic, "ustar", 5) != 0 ||
+			archive_octal(h->chksum, sizeof(h->chksum), &size) != 0 ||
+			size != archive_sum(h) ||
+			archive_octal(h->size, sizeof(h->size), &size) != 0) {
+			fprintf(stderr, "error: %s is not a backup archive\n", path);
+			return -1;
+		}
+		if (size > src->size - off - ARCHIVE_BLOCK) {
+			fprintf(stderr, "error: %s is truncated\n", path);
+			return -1;
+		}
+		/* directories and the like from a repacked archive */
+		if (h->typeflag != '0' && h->typeflag != 0)
+			continue;
+		data = src->data + off + ARCHIVE_BLOCK;
+		memcpy(name, h->name, sizeof(h->name));
+		name[sizeof(h->name)] = 0;
+
+		if (strcmp(name, ARCHIVE_SUMS) == 0) {
+			sums = (const char *) data;
+			sumslen = size;
+		} else if (strncmp(name, "nxtctl/", 7) == 0) {
+			continue;
+		} else if (strchr(name, '/') || strlen(name) >= sizeof(file->name)) {
+			fprintf(stderr, "error: %s is not a file of a brick\n", name);
+			return -1;
+		} else if (archive_find(list, name)) {
+			fprintf(stderr, "error: %s is in %s twice\n", name, path);
+			return -1;
+		} else {
+			file = archive_add(list, name);
+			file->size = size;
+			file->data = data;
+			file->hash = fio_hash(FIO_HASH_INIT, data, size);
+		}
+	}
+	if (!sums) {
+		fprintf(stderr, "error: %s has no checksums\n", path);
+		return -1;
+	}
+	return archive_verify(list, path, sums, sumslen);
+}
+
+/*
+ * Linear files first while the flash is least fragmented, the largest
+ * of each kind first
+ */
+static int archive_order(const void *a, const void *b) {
+	const ArchiveFile *fa = a, *fb = b;
+
+	if (fa->linear != fb->linear)
+		return fb->linear - fa->linear;
+	if (fa->size != fb->size)
+		return fa->size < fb->size ? 1 : -1;
+	return strcmp(fa->name, fb->name);
+}
+
+/*
+ * Upload the files of the archive at path, "-" reads from stdin. Files
+ * of the same name are deleted first, other files on the brick are
+ * kept.
+ */
+int archive_restore(NXT *nxt, const char *path) {
+	FileSource src, member;
+	ArchiveList list;
+	ArchiveFile *file;
+	NXTInfo info;
+	unsigned long need = 0, avail;
+	int restored = 0, failed = 0;
+	int i, res = -1;
+	double start;
+
+	start = nxt_clock();
+	memset(&list, 0, sizeof(list));
+	if (fio_source_open(&src, path) != 0)
+		return -1;
+	if (archive_parse(&list, &src, path) != 0)
+		goto out;
+
+	for (i = 0; i < list.count; i++) {
+		list.files[i].linear = nxt_is_linear(nxt, list.files[i].name);
+		need += list.files[i].size;
+	}
+	if (nxt_get_device_info(nxt, &info) != 0 ||
+		(nxt->cache ? cache_list(nxt->cache, "*.*", archive_replaced_cb, &list) :
+		 nxt_list_files(nxt, "*.*", archive_replaced_cb, &list)) != 0)
+		goto out;
+	avail = info.free_space;
+	for (i = 0; i < list.count; i++)
+		if (list.files[i].replaced)
+			avail += list.files[i].remotesize;
+	if (need > avail) {
+		fprintf(stderr, "error: %lu bytes do not fit into %lu bytes of free flash\n",
+				need, avail);
+		goto out;
+	}
+
+	/* free all space up front so linear files find contiguous flash */
+	for (i = 0; i < list.count; i++) {
+		if (list.files[i].replaced && nxt_delete_file(nxt, list.files[i].name) != 0)
+			goto out;
+	}
+
+	qsort(list.files, list.count, sizeof(ArchiveFile), archive_order);
+	for (i = 0; i < list.count; i++) {
+		file = &list.files[i];
+		memset(&member, 0, sizeof(member));
+		member.name = file->name;
+		member.data = (unsigned char *) file->data;
+		member.size = file->size;
+		if (nxt_put_file_source(nxt, file->name, &member) != 0) {
+			failed++;
+			continue;
+		}
+		restored++;
+	}
+	res = failed ? -1 : 0;
+	printf("restore: %d files (%lu bytes), %d failed, %.2f s\n",
+		   restored, need, failed, nxt_clock() - start);
+out:
+	fio_source_close(&src);
+	free(list.files);
+	return res;
+}
@@ -0,0 +1,240 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Batch mode runs a script of commands over a single NXT session:
+ *
+ *   # deploy
+ *   delete prog.rxe
+ *   put prog.rxe
+ *   start prog.rxe
+ *   battery
+ */
+
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+enum {
+	ARG_NONE,
+	ARG_OPTIONAL,
+	ARG_REQUIRED
+};
+
+struct batch_cmd {
+	const char *name;
+	int arg;
+	int (*fn)(NXT *nxt, const char *arg, const char *id);
+};
+
+static int batch_battery(NXT *nxt, const char *arg, const char *id) {
+	return nxt_print_battery_level(nxt);
+}
+
+static int batch_delete(NXT *nxt, const char *arg, const char *id) {
+	return nxt_delete_file(nxt, arg);
+}
+
+static int batch_firmware(NXT *nxt, const char *arg, const char *id) {
+	return nxt_print_firmware_version(nxt);
+}
+
+/* in fleet mode every brick downloads into the directory named by id */
+static int batch_get(NXT *nxt, const char *arg, const char *id) {
+	char localname[PATH_MAX];
+
+	if (!id)
+		return nxt_get_file(nxt, arg);
+	if (mkdir(id, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "error: could not create directory %s\n", id);
+		return -1;
+	}
+	snprintf(localname, sizeof(localname), "%s/%s", id, arg);
+	return nxt_get_file_as(nxt, arg, localname);
+}
+
+static int batch_info(NXT *nxt, const char *arg, const char *id) {
+	return nxt_print_device_info(nxt);
+}
+
+static int batch_list(NXT *nxt, const char *arg, const char *id) {
+	return nxt_print_files(nxt, arg ? arg : "*.rxe");
+}
+
+static int batch_put(NXT *nxt, const char *arg, const char *id) {
+	return nxt_put_file(nxt, arg);
+}
+
+static int batch_start(NXT *nxt, const char *arg, const char *id) {
+	return nxt_start_program(nxt, arg);
+}
+
+static int batch_stop(NXT *nxt, const char *arg, const char *id) {
+	return nxt_stop_program(nxt);
+}
+
+static const struct batch_cmd batch_cmds[] = {
+	{ "battery",	ARG_NONE,		batch_battery },
+	{ "delete",		ARG_REQUIRED,	batch_delete },
+	{ "firmware",	ARG_NONE,		batch_firmware },
+	{ "get",		ARG_REQUIRED,	batch_get },
+	{ "info",		ARG_NONE,		batch_info },
+	{ "list",		ARG_OPTIONAL,	batch_list },
+	{ "put",		ARG_REQUIRED,	batch_put },
+	{ "start",		ARG_REQUIRED,	batch_start },
+	{ "stop",		ARG_NONE,		batch_stop },
+	{ NULL,			0,				NULL }
+};
+
+static const struct batch_cmd* batch_lookup(const char *name) {
+	const struct batch_cmd *cmd;
+
+	for (cmd = batch_cmds; cmd->name; cmd++) {
+		if (strcmp(cmd->name, name) == 0)
+			return cmd;
+	}
+	return NULL;
+}
+
+/*
+ * Parse one script line into step. Returns 1 for a step, 0 for blank
+ * or comment lines and -1 on syntax errors.
+ */
+static int batch_parse(char *line, BatchStep *step) {
+	char *name, *arg, *extra;
+	const char *sep = " \t\r\n";
+
+	if ((name = strchr(line, '#')) != NULL)
+		*name = 0;
+	if ((name = strtok(line, sep)) == NULL)
+		return 0;
+	arg = strtok(NULL, sep);
+	extra = strtok(NULL, sep);
+
+	if ((step->cmd = batch_lookup(name)) == NULL) {
+		fprintf(stderr, "error: line %d: unknown command %s\n", step->line, name);
+		return -1;
+	}
+	if (extra || (arg && step->cmd->arg == ARG_NONE)) {
+		fprintf(stderr, "error: line %d: too many arguments for %s\n", step->line, name);
+		return -1;
+	}
+	if (!arg && step->cmd->arg == ARG_REQUIRED) {
+		fprintf(stderr, "error: line %d: %s needs a filename\n", step->line, name);
+		return -1;
+	}
+	step->arg = NULL;
+	if (arg && (step->arg = strdup(arg)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	return 1;
+}
+
+/*
+ * Read and check a script from path, "-" reads from stdin. The whole
+ * script is parsed before anything is sent to the brick.
+ */
+Batch* batch_load(const char *path) {
+	char line[BUFSIZ];
+	Batch *batch;
+	BatchStep step;
+	FILE *fp;
+	int lineno = 0;
+	int error = 0;
+	int res;
+
+	if (strcmp(path, "-") == 0) {
+		fp = stdin;
+	} else if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "error: could not open script %s\n", path);
+		return NULL;
+	}
+	if ((batch = calloc(1, sizeof(Batch))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		step.line = ++lineno;
+		/* a line longer than the buffer must not turn into two commands */
+		if (strchr(line, '\n') == NULL && !feof(fp)) {
+			fprintf(stderr, "error: line %d: line too long\n", lineno);
+			while ((res = getc(fp)) != EOF && res != '\n')
+				;
+			error = 1;
+			continue;
+		}
+		if ((res = batch_parse(line, &step)) < 0)
+			error = 1;
+		if (res <= 0)
+			continue;
+		batch->steps = realloc(batch->steps, (batch->count + 1) * sizeof(BatchStep));
+		if (batch->steps == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		batch->steps[batch->count++] = step;
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	if (error)
+		return NULL;
+	return batch;
+}
+
+/*
+ * Run all steps of batch. Unless keepgoing is set, the first failing
+ * step ends the run. id is set in fleet mode and names the brick, get
+ * writes to a directory of that name then. Returns 0 if all executed
+ * steps succeeded.
+ */
+int batch_run(NXT *nxt, Batch *batch, int keepgoing, const char *id) {
+	BatchStep *step;
+	double start, t;
+	int i, res;
+	int failed = 0, done = 0;
+
+	start = nxt_clock();
+	for (i = 0; i < batch->count; i++) {
+		step = &batch->steps[i];
+		t = nxt_clock();
+		res = step->cmd->fn(nxt, step->arg, id);
+		t = nxt_clock() - t;
+		done++;
+		fprintf(stderr, "step %d (line %d): %s%s%s: %s, %.1f ms\n",
+				i + 1, step->line, step->cmd->name,
+				step->arg ? " " : "", step->arg ? step->arg : "",
+				res == 0 ? "ok" : "FAILED", t * 1000);
+		if (res != 0) {
+			failed++;
+			if (!keepgoing)
+				break;
+		}
+	}
+	fprintf(stderr, "%d of %d steps run, %d failed, %.3f s total\n",
+			done, batch->count, failed, nxt_clock() - start);
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,39 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "nxt.h"
+
+struct batch_cmd;
+
+typedef struct {
+	int line;
+	const struct batch_cmd *cmd;
+	char *arg;
+} BatchStep;
+
+typedef struct {
+	BatchStep *steps;
+	int count;
+} Batch;
+
+Batch* batch_load(const char *path);
+int batch_run(NXT *nxt, Batch *batch, int keepgoing, const char *id);
+
+#endif
@@ -0,0 +1,753 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmarks for the codecs and the transfer path. Run with "make
+ * bench". The micro suite times the buf and packet codecs, the e2e
+ * suite runs list, get and put against an emulated brick. Results are
+ * printed as tab separated "name value unit" lines, so runs can be
+ * compared with diff or join.
+ */
+
+/* posix_openpt and friends */
+#define _XOPEN_SOURCE 700
+
+#include <sys/socket.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "emu.h"
+#include "nxt.h"
+#include "nxtcmd.h"
+
+int vflag;
+
+#define PACKET_SIZE 64
+#define READ_SIZE   57
+#define WRITE_SIZE  60
+#define TOTAL       (4 * 1024 * 1024)
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+	const char *name;
+	unsigned long user;		/* bytes copied in user space */
+	unsigned long sys;		/* bytes copied by read/write */
+	unsigned long payload;
+	double elapsed;
+} Result;
+
+static void result(const char *name, double value, const char *unit) {
+	printf("%s\t%.3f\t%s\n", name, value, unit);
+}
+
+/* payload bytes copied by buf_read_data and buf_write_data */
+static unsigned long copied;
+
+static int copy_read(Buf *buf, char *s, size_t len) {
+	copied += len;
+	return buf_read_data(buf, s, len);
+}
+
+static int copy_write(Buf *buf, const char *s, size_t len) {
+	copied += len;
+	return buf_write_data(buf, s, len);
+}
+
+static void report(Result *r) {
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s.copies", r->name);
+	result(name, (double) (r->user + r->sys) / r->payload, "copies/byte");
+	snprintf(name, sizeof(name), "%s.rate", r->name);
+	result(name, r->payload / r->elapsed / 1e6, "MB/s");
+}
+
+/*
+ * Upload as done before: read() into a stack buffer, then
+ * buf_write_data() into the request.
+ */
+static void upload_copy(int in, Result *r) {
+	char data[BUFSIZ];
+	Buf *buf = buf_new();
+	unsigned long start = copied;
+	double t = now();
+
+	for (r->payload = 0; r->payload < TOTAL; r->payload += WRITE_SIZE) {
+		buf_reset(buf);
+		buf_pack(buf, "bbb", 0x01, 0x83, 0);
+		read(in, data, WRITE_SIZE);
+		copy_write(buf, data, WRITE_SIZE);
+		r->sys += WRITE_SIZE;
+	}
+	r->elapsed = now() - t;
+	r->user = copied - start;
+	buf_free(buf);
+}
+
+/*
+ * Upload with a reserved header: read() straight into the request
+ */
+static void upload_reserve(int in, Result *r) {
+	Buf *buf = buf_new();
+	unsigned char *p;
+	unsigned long start = copied;
+	double t = now();
+
+	for (r->payload = 0; r->payload < TOTAL; r->payload += WRITE_SIZE) {
+		buf_reset(buf);
+		buf_reserve(buf, 3);
+		p = buf_reserve(buf, WRITE_SIZE);
+		read(in, p, WRITE_SIZE);
+		buf->buf[0] = 0x01;
+		buf->buf[1] = 0x83;
+		buf->buf[2] = 0;
+		r->sys += WRITE_SIZE;
+	}
+	r->elapsed = now() - t;
+	r->user = copied - start;
+	buf_free(buf);
+}
+
+static void make_reply(unsigned char *packet) {
+	memset(packet, 0x55, PACKET_SIZE);
+	packet[0] = 0x02;
+	packet[1] = 0x82;
+	packet[2] = 0;
+	packet[3] = 0;
+	packet[4] = READ_SIZE;
+	packet[5] = 0;
+}
+
+/*
+ * Download as done before by the pipelined path: the reply is copied
+ * from the transfer buffer into the Buf, then buf_read_data() copies
+ * the payload into a stack buffer for write().
+ */
+static void download_copy(int out, Result *r) {
+	unsigned char packet[PACKET_SIZE];
+	char data[BUFSIZ];
+	Buf *buf = buf_new();
+	unsigned char type, cmd, status, handle;
+	unsigned short size;
+	unsigned long start = copied;
+	double t = now();
+
+	make_reply(packet);
+	for (r->payload = 0; r->payload < TOTAL; r->payload += READ_SIZE) {
+		buf_reset(buf);
+		memcpy(buf->buf, packet, sizeof(packet));
+		buf->limit = sizeof(packet);
+		r->user += sizeof(packet);
+		buf_unpack(buf, "bbbbh", &type, &cmd, &status, &handle, &size);
+		copy_read(buf, data, size);
+		write(out, data, size);
+		r->sys += size;
+	}
+	r->elapsed = now() - t;
+	r->user += copied - start;
+	buf_free(buf);
+}
+
+/*
+ * Download with views: the reply stays in the transfer buffer and the
+ * payload is written out from there.
+ */
+static void download_view(int out, Result *r) {
+	unsigned char packet[PACKET_SIZE];
+	Buf buf, data;
+	unsigned char type, cmd, status, handle;
+	unsigned short size;
+	unsigned long start = copied;
+	double t = now();
+
+	make_reply(packet);
+	for (r->payload = 0; r->payload < TOTAL; r->payload += READ_SIZE) {
+		buf_wrap(&buf, packet, sizeof(packet), sizeof(packet));
+		buf_unpack(&buf, "bbbbh", &type, &cmd, &status, &handle, &size);
+		buf_slice(&buf, &data, size);
+		write(out, data.buf, data.limit);
+		r->sys += size;
+	}
+	r->elapsed = now() - t;
+	r->user = copied - start;
+}
+
+#define CODEC_ITERATIONS 2000000
+
+/* keeps the compiler from dropping the codec work */
+static volatile unsigned long codec_sink;
+
+static void make_find_reply(unsigned char *packet) {
+	memset(packet, 0, PACKET_SIZE);
+	packet[0] = 0x02;
+	packet[1] = 0x86;
+	packet[2] = 0;
+	packet[3] = 1;
+	strcpy((char *) packet + 4, "program.rxe");
+	packet[24] = 0x34;
+	packet[25] = 0x12;
+}
+
+/*
+ * Encode OPEN_WRITE and READ requests and decode a FIND_FIRST reply
+ * through the buf_pack format strings
+ */
+static double codec_pack(void) {
+	unsigned char packet[PACKET_SIZE];
+	char filename[20];
+	Buf *buf = buf_new();
+	Buf reply;
+	unsigned char type, cmd, status, handle;
+	unsigned int size;
+	unsigned long sum = 0;
+	double t = now();
+	int i;
+
+	make_find_reply(packet);
+	for (i = 0; i < CODEC_ITERATIONS; i++) {
+		buf_reset(buf);
+		buf_pack(buf, "bbsu", 0x01, 0x81, "program.rxe", (size_t) 20, i);
+		sum += buf->offset;
+		buf_reset(buf);
+		buf_pack(buf, "bbbh", 0x01, 0x82, 1, READ_SIZE);
+		sum += buf->offset;
+		buf_wrap(&reply, packet, sizeof(packet), sizeof(packet));
+		buf_unpack(&reply, "bbb", &type, &cmd, &status);
+		buf_unpack(&reply, "bsu", &handle, filename, (size_t) 20, &size);
+		sum += size + handle;
+	}
+	t = now() - t;
+	codec_sink = sum;
+	buf_free(buf);
+	return t;
+}
+
+/*
+ * The same with the encoders and decoders generated from nxtcmd.h
+ */
+static double codec_table(void) {
+	unsigned char packet[PACKET_SIZE];
+	unsigned char req[PACKET_SIZE];
+	nxt_find_first_file_reply r;
+	unsigned long sum = 0;
+	double t = now();
+	int i;
+
+	make_find_reply(packet);
+	for (i = 0; i < CODEC_ITERATIONS; i++) {
+		sum += nxt_open_write_enc(req, sizeof(req), 1, "program.rxe", i);
+		sum += nxt_read_enc(req, sizeof(req), 1, 1, READ_SIZE);
+		if (nxt_find_first_file_dec(packet, sizeof(packet), &r) == NXT_SUCCESS)
+			sum += r.filesize + r.handle;
+	}
+	t = now() - t;
+	codec_sink = sum;
+	return t;
+}
+
+/*
+ * The byte at a time buf field codecs as they were before the bulk
+ * paths, kept as reference
+ */
+static int ref_write_string(Buf *self, const char *s, size_t flen) {
+	size_t slen = strlen(s);
+	size_t i;
+	if (self->offset + slen + 1 < self->size && slen < flen - 1) {
+		i = 0;
+		while(s[i] && i < flen - 1) {
+			self->buf[self->offset++] = s[i++];
+		}
+		while(i < flen) {
+			self->buf[self->offset++] = 0;
+			i++;
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static int ref_write_uint(Buf *self, uint32_t d) {
+	if (self->offset + sizeof(d) >= self->size) {
+		return -1;
+	}
+	self->buf[self->offset++] = d;
+	self->buf[self->offset++] = d >> 8;
+	self->buf[self->offset++] = d >> 16;
+	self->buf[self->offset++] = d >> 24;
+	return sizeof(d);
+}
+
+static int ref_write_data(Buf *self, const char *s, size_t len) {
+	size_t i;
+	if (self->offset + len >= self->size) {
+		return -1;
+	}
+	i = 0;
+	while (i < len) {
+		self->buf[self->offset++] = s[i++];
+	}
+	return 0;
+}
+
+static int ref_read_string(Buf *self, char *s, size_t len) {
+	size_t i;
+	char c;
+	if (self->offset + len >= self->size) {
+		return -1;
+	}
+	i = 0;
+	while (i < len && (c = self->buf[self->offset])) {
+		s[i] = c;
+		i++;
+		self->offset++;
+	}
+	while (i < len) {
+		s[i++] = 0;
+		self->offset++;
+	}
+	return 0;
+}
+
+static int ref_read_uint(Buf *self, uint32_t *d) {
+	uint32_t result = 0;
+
+	if (self->offset + sizeof(*d) >= self->size) {
+		return -1;
+	}
+	result |= self->buf[self->offset++];
+	result |= self->buf[self->offset++] << 8;
+	result |= self->buf[self->offset++] << 16;
+	result |= self->buf[self->offset++] << 24;
+	*d = result;
+	return sizeof(*d);
+}
+
+static int ref_read_data(Buf *self, char *s, size_t len) {
+	size_t i;
+	if (self->offset + len >= self->size) {
+		return -1;
+	}
+	i = 0;
+	while (i < len) {
+		s[i++] = self->buf[self->offset++];
+	}
+	return 0;
+}
+
+#define FIELD_ITERATIONS 2000000
+#define FIELD_DATA 40
+
+/*
+ * Write and read back a filename, a size and a block of data, the
+ * fields of a typical file transfer packet
+ */
+static double fields_ref(void) {
+	char name[20], data[FIELD_DATA];
+	Buf *buf = buf_new();
+	uint32_t size = 0;
+	unsigned long sum = 0;
+	double t = now();
+	int i;
+
+	memset(data, 0x55, sizeof(data));
+	for (i = 0; i < FIELD_ITERATIONS; i++) {
+		buf_reset(buf);
+		ref_write_string(buf, "program.rxe", 20);
+		ref_write_uint(buf, i);
+		ref_write_data(buf, data, sizeof(data));
+		buf->offset = 0;
+		ref_read_string(buf, name, 20);
+		ref_read_uint(buf, &size);
+		ref_read_data(buf, data, sizeof(data));
+		sum += size + name[0] + data[i % FIELD_DATA];
+	}
+	t = now() - t;
+	codec_sink = sum;
+	buf_free(buf);
+	return t;
+}
+
+static double fields_bulk(void) {
+	char name[20], data[FIELD_DATA];
+	Buf *buf = buf_new();
+	uint32_t size = 0;
+	unsigned long sum = 0;
+	double t = now();
+	int i;
+
+	memset(data, 0x55, sizeof(data));
+	for (i = 0; i < FIELD_ITERATIONS; i++) {
+		buf_reset(buf);
+		buf_write_string(buf, "program.rxe", 20);
+		buf_write_uint(buf, i);
+		buf_write_data(buf, data, sizeof(data));
+		buf->offset = 0;
+		buf_read_string(buf, name, 20);
+		buf_read_uint(buf, &size);
+		buf_read_data(buf, data, sizeof(data));
+		sum += size + name[0] + data[i % FIELD_DATA];
+	}
+	t = now() - t;
+	codec_sink = sum;
+	buf_free(buf);
+	return t;
+}
+
+static void micro(void) {
+	double tpack, ttable, tref, tbulk;
+	Result r[4];
+	int in, out, i;
+
+	if ((in = open("/dev/zero", O_RDONLY)) < 0 ||
+		(out = open("/dev/null", O_WRONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	memset(r, 0, sizeof(r));
+	r[0].name = "micro.upload_copy";
+	upload_copy(in, &r[0]);
+	r[1].name = "micro.upload_reserve";
+	upload_reserve(in, &r[1]);
+	r[2].name = "micro.download_copy";
+	download_copy(out, &r[2]);
+	r[3].name = "micro.download_view";
+	download_view(out, &r[3]);
+
+	for (i = 0; i < 4; i++)
+		report(&r[i]);
+
+	/* three packets per iteration */
+	tpack = codec_pack();
+	ttable = codec_table();
+	result("micro.codec_pack", tpack / CODEC_ITERATIONS / 3 * 1e9, "ns/packet");
+	result("micro.codec_table", ttable / CODEC_ITERATIONS / 3 * 1e9, "ns/packet");
+
+	tref = fields_ref();
+	tbulk = fields_bulk();
+	result("micro.fields_bytewise", tref / FIELD_ITERATIONS * 1e9, "ns/packet");
+	result("micro.fields_bulk", tbulk / FIELD_ITERATIONS * 1e9, "ns/packet");
+
+	close(in);
+	close(out);
+}
+
+#define E2E_FILES    32
+#define E2E_COMMANDS 100
+
+typedef struct {
+	Emu *emu;
+	int fd;
+} Brick;
+
+static void* brick_run(void *arg) {
+	Brick *brick = arg;
+
+	emu_serve(brick->emu, brick->fd);
+	close(brick->fd);
+	return NULL;
+}
+
+/*
+ * get and put report their rate on stdout, keep that out of the results
+ */
+static int quiet_begin(void) {
+	int saved, fd;
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+	return saved;
+}
+
+static void quiet_end(int saved) {
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+}
+
+static int count_file(const char *filename, unsigned int filesize, void *arg) {
+	(*(int *) arg)++;
+	return 0;
+}
+
+static void e2e_put(NXT *nxt, const char *name, const char *local,
+					int window, int interval, unsigned int size) {
+	double t;
+	int saved, res;
+
+	nxt->window = window;
+	nxt->interval = interval;
+	saved = quiet_begin();
+	t = nxt_clock();
+	res = nxt_put_file_as(nxt, "bench.dat", local);
+	t = nxt_clock() - t;
+	quiet_end(saved);
+	if (res != 0) {
+		fprintf(stderr, "error: %s failed\n", name);
+		exit(1);
+	}
+	result(name, size / t / 1024, "KB/s");
+	nxt->window = 1;
+	nxt->interval = 0;
+}
+
+static void e2e_get(NXT *nxt, const char *name, const char *local,
+					int window, const unsigned char *data, unsigned int size) {
+	unsigned char *copy;
+	double t;
+	int saved, res, fd;
+
+	/* downloads never overwrite an existing file */
+	unlink(local);
+	nxt->window = window;
+	saved = quiet_begin();
+	t = nxt_clock();
+	res = nxt_get_file_as(nxt, "bench.dat", local);
+	t = nxt_clock() - t;
+	quiet_end(saved);
+	if (res != 0) {
+		fprintf(stderr, "error: %s failed\n", name);
+		exit(1);
+	}
+	/* a fast but wrong transfer is no result */
+	if ((copy = malloc(size + 1)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	if ((fd = open(local, O_RDONLY)) < 0 ||
+		read(fd, copy, size + 1) != size || memcmp(copy, data, size) != 0) {
+		fprintf(stderr, "error: %s returned wrong data\n", name);
+		exit(1);
+	}
+	close(fd);
+	free(copy);
+	result(name, size / t / 1024, "KB/s");
+	nxt->window = 1;
+}
+
+/*
+ * The same transfers over the serial transport, with the emulator on
+ * the other side of a pty
+ */
+static void e2e_serial(unsigned int rtt, unsigned int size, const char *local,
+					   const char *copy, const unsigned char *data) {
+	EmuConfig config;
+	pthread_t thread;
+	Brick brick;
+	NXT *nxt;
+	char spec[64];
+	int master;
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+		grantpt(master) != 0 || unlockpt(master) != 0) {
+		perror("posix_openpt");
+		exit(1);
+	}
+	snprintf(spec, sizeof(spec), "serial:%s", ptsname(master));
+	nxt = nxt_new();
+	if (nxt_init_transport(nxt, spec) != 0)
+		exit(1);
+	nxt->read_size = NXT_READ_SIZE;
+	nxt->write_size = NXT_WRITE_SIZE;
+
+	emu_config_init(&config);
+	config.rtt = rtt;
+	config.packet = NXT_PACKET_MAX;
+	brick.emu = emu_new(&config);
+	brick.fd = master;
+	if (pthread_create(&thread, NULL, brick_run, &brick) != 0) {
+		fprintf(stderr, "error: could not start emulator\n");
+		exit(1);
+	}
+
+	e2e_put(nxt, "e2e.serial.put", local, 1, 0, size);
+	e2e_put(nxt, "e2e.serial.put.interval8", local, 1, 8, size);
+	e2e_put(nxt, "e2e.serial.put.window8", local, 8, 0, size);
+	e2e_get(nxt, "e2e.serial.get", copy, 1, data, size);
+	e2e_get(nxt, "e2e.serial.get.window8", copy, 8, data, size);
+
+	/* the largest chunks the link takes, as probed without --chunk */
+	nxt->read_size = NXT_PACKET_MAX - NXT_READ_REPLY_SIZE;
+	nxt->write_size = NXT_PACKET_MAX - NXT_WRITE_REQ_SIZE;
+	e2e_put(nxt, "e2e.serial.put.window8.chunk256", local, 8, 0, size);
+	e2e_get(nxt, "e2e.serial.get.window8.chunk256", copy, 8, data, size);
+
+	/* the master sees a hangup when the tty is closed */
+	nxt_free(nxt);
+	pthread_join(thread, NULL);
+	emu_free(brick.emu);
+}
+
+static void e2e(unsigned int rtt, unsigned int size) {
+	char dir[] = "/tmp/nxtbench.XXXXXX";
+	char local[64], copy[64], name[20];
+	unsigned char *data;
+	double t, min, max, sum;
+	EmuConfig config;
+	pthread_t thread;
+	NXTInfo info;
+	Brick brick;
+	NXT *nxt;
+	int fds[2], fd, i, count;
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	snprintf(local, sizeof(local), "%s/bench.dat", dir);
+	snprintf(copy, sizeof(copy), "%s/copy.dat", dir);
+	if ((data = malloc(size)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (i = 0; i < size; i++)
+		data[i] = i * 7;
+	if ((fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+		write(fd, data, size) != size) {
+		perror(local);
+		exit(1);
+	}
+	close(fd);
+
+	emu_config_init(&config);
+	config.rtt = rtt;
+	brick.emu = emu_new(&config);
+	for (i = 0; i < E2E_FILES; i++) {
+		snprintf(name, sizeof(name), "file%02d.txt", i);
+		emu_add_file(brick.emu, name, data, 100);
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	brick.fd = fds[1];
+	if (pthread_create(&thread, NULL, brick_run, &brick) != 0) {
+		fprintf(stderr, "error: could not start emulator\n");
+		exit(1);
+	}
+
+	/* the emulator speaks the nxtd protocol */
+	nxt = nxt_new();
+	nxt_init_socket(nxt, fds[0]);
+	/* fixed chunks keep the results comparable, and no profile is saved */
+	nxt->read_size = NXT_READ_SIZE;
+	nxt->write_size = NXT_WRITE_SIZE;
+
+	result("e2e.rtt", rtt, "us");
+	result("e2e.size", size, "bytes");
+
+	min = 1e9;
+	max = sum = 0;
+	for (i = 0; i < E2E_COMMANDS; i++) {
+		t = nxt_clock();
+		if (nxt_get_device_info(nxt, &info) != 0) {
+			fprintf(stderr, "error: GET_DEVICE_INFO failed\n");
+			exit(1);
+		}
+		t = nxt_clock() - t;
+		sum += t;
+		if (t < min)
+			min = t;
+		if (t > max)
+			max = t;
+	}
+	result("e2e.latency.min", min * 1e6, "us");
+	result("e2e.latency.mean", sum / E2E_COMMANDS * 1e6, "us");
+	result("e2e.latency.max", max * 1e6, "us");
+
+	count = 0;
+	t = nxt_clock();
+	if (nxt_list_files(nxt, "*.txt", count_file, &count) != 0 || count != E2E_FILES) {
+		fprintf(stderr, "error: list failed\n");
+		exit(1);
+	}
+	t = nxt_clock() - t;
+	result("e2e.list", t * 1e3 / E2E_FILES, "ms/file");
+
+	e2e_put(nxt, "e2e.put", local, 1, 0, size);
+	e2e_put(nxt, "e2e.put.interval8", local, 1, 8, size);
+	e2e_put(nxt, "e2e.put.window8", local, 8, 0, size);
+	e2e_get(nxt, "e2e.get", copy, 1, data, size);
+	e2e_get(nxt, "e2e.get.window8", copy, 8, data, size);
+
+	/* closing our end stops the emulator */
+	nxt_free(nxt);
+	pthread_join(thread, NULL);
+	emu_free(brick.emu);
+
+	e2e_serial(rtt, size, local, copy, data);
+
+	unlink(local);
+	unlink(copy);
+	rmdir(dir);
+	free(data);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: nxtbench [-r rtt] [-s size] [micro|e2e]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int rtt = 1000, size = 16384;
+	const char *suite = NULL;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r:s:")) != -1) {
+		switch (ch) {
+		case 'r':
+			rtt = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		suite = argv[optind];
+	if (suite && strcmp(suite, "micro") != 0 && strcmp(suite, "e2e") != 0)
+		usage();
+	if (size == 0)
+		usage();
+
+	printf("# nxtbench 1\n");
+	if (!suite || strcmp(suite, "micro") == 0)
+		micro();
+	if (!suite || strcmp(suite, "e2e") == 0)
+		e2e(rtt, size);
+	return 0;
+}
@@ -23,8 +23,6 @@
 #include <string.h>
 #include "buf.h"
 
-extern int vflag;
-
 /*************************************************************/
 /* buf class */
 /*************************************************************/
@@ -41,93 +39,118 @@ Buf* buf_new() {
 	res->size = BUFSIZ;
 	res->offset = 0;
 	res->limit  = 0;
+	res->borrowed = 0;
 	
 	return res;
 }
 
+void buf_free(Buf *self) {
+	if (!self->borrowed)
+		free(self->buf);
+	free(self);
+}
+
 void buf_reset(Buf *self) {
 	self->offset = 0;
 	self->limit  = 0;
 }
 
+/*
+ * Make self a borrowed buffer on top of size bytes at data, e.g. a
+ * usb transfer buffer, with limit bytes of valid content.
+ */
+void buf_wrap(Buf *self, unsigned char *data, size_t size, size_t limit) {
+	self->buf = data;
+	self->size = size;
+	self->offset = 0;
+	self->limit = limit;
+	self->borrowed = 1;
+}
+
+/*
+ * Let view borrow the next len bytes of self without copying them and
+ * skip them in self. view is only valid as long as the memory of self
+ * is not reused.
+ */
+int buf_slice(Buf *self, Buf *view, size_t len) {
+	if (self->offset + len > self->size) {
+		return -1;
+	}
+	buf_wrap(view, self->buf + self->offset, len, len);
+	self->offset += len;
+	return 0;
+}
+
+/*
+ * Reserve len bytes at the current offset and return a pointer to
+ * them, so callers can place data directly into the buffer, e.g. read
+ * payload from a file or leave room for a header to fill in later.
+ */
+unsigned char* buf_reserve(Buf *self, size_t len) {
+	unsigned char *p;
+
+	if (self->offset + len > self->size) {
+		return NULL;
+	}
+	p = self->buf + self->offset;
+	self->offset += len;
+	return p;
+}
+
 int buf_read_byte(Buf *self, uint8_t *d) {
 	if (self->offset + sizeof(*d) >= self->size) {
 		return -1;
 	}
-	if (vflag)
-		printf("buf_read_byte: offset=%zd, byte: %hhx\n", 
-			   self->offset, self->buf[self->offset]);
 	*d = self->buf[self->offset++];
 	return sizeof(*d);
 }
 
 int buf_read_short(Buf *self, uint16_t *d) {
-	uint16_t result = 0;
-	
 	if (self->offset + sizeof(*d) >= self->size) {
 		return -1;
 	}
-	
-	/* convert little endian to native byte order */
-	result |= self->buf[self->offset++];
-	result |= self->buf[self->offset++] << 8;
-
-	*d = result;
+	*d = buf_get_le16(self->buf + self->offset);
+	self->offset += sizeof(*d);
 	return sizeof(*d);
 }
 
 int buf_read_uint(Buf *self, uint32_t *d) {
-	uint32_t result = 0;
-
 	if (self->offset + sizeof(*d) >= self->size) {
 		return -1;
 	}
-
-	/* convert little endian to native byte order */
-	result |= self->buf[self->offset++];
-	result |= self->buf[self->offset++] << 8;
-	result |= self->buf[self->offset++] << 16;
-	result |= self->buf[self->offset++] << 24;
-
-	*d = result;
+	*d = buf_get_le32(self->buf + self->offset);
+	self->offset += sizeof(*d);
 	return sizeof(*d);
 }
 
+/*
+ * Read a zero padded string field of len bytes. The scan for the
+ * terminating 0 is bounded by the field length.
+ */
 int buf_read_string(Buf *self, char *s, size_t len) {
-	size_t i;
-	char c;
+	const unsigned char *field;
+	const unsigned char *end;
+	size_t n;
+
 	if (self->offset + len >= self->size) {
 		return -1;
 	}
-	i = 0;
-	while (i < len && (c = self->buf[self->offset])) {
-		if (vflag)
-			printf("buf_read_string: offset=%zd, i=%zd, char=%c\n", self->offset, i, self->buf[self->offset]);
-		s[i] = c;
-		i++;
-		self->offset++;
-	}
+	field = self->buf + self->offset;
+	end = memchr(field, 0, len);
+	n = end ? (size_t) (end - field) : len;
+	memcpy(s, field, n);
 	/* fill with 0 bytes up to len */
-	while (i < len) {
-		if (vflag)
-			printf("buf_read_string: offset=%zd, i=%zd, char=%c\n", self->offset, i, 0);
-		s[i++] = 0;
-		self->offset++;
-	}
+	memset(s + n, 0, len - n);
+	self->offset += len;
 	return 0;
 }
 
 int buf_read_data(Buf *self, char *s, size_t len) {
-	size_t i;
 	if (self->offset + len >= self->size) {
 		return -1;
 	}
-	i = 0;
-	while (i < len) {
-		if (vflag > 1)
-			printf("buf_read_data: offset=%zd, i=%zd, data=0x%02hhx\n", self->offset, i, self->buf[self->offset]);
-		s[i++] = self->buf[self->offset++];
-	}
+	memcpy(s, self->buf + self->offset, len);
+	self->offset += len;
 	return 0;
 }
 
@@ -144,9 +167,6 @@ int buf_write_byte(Buf *self, uint8_t d) {
 	if (self->offset + sizeof(d) >= self->size) {
 		return -1;
 	}
-	if (vflag)
-		printf("buf_write_byte offset=%zd, byte: %hhx\n", 
-			   self->offset, d);
 	self->buf[self->offset++] = d;
 	return sizeof(d);
 }
@@ -155,9 +175,8 @@ int buf_write_short(Buf *self, uint16_t d) {
 	if (self->offset + sizeof(d) >= self->size) {
 		return -1;
 	}
-	/* write single bytes to get little-endian */
-	self->buf[self->offset++] = d;
-	self->buf[self->offset++] = d >> 8;
+	buf_put_le16(self->buf + self->offset, d);
+	self->offset += sizeof(d);
 	return sizeof(d);
 }
 
@@ -165,38 +184,28 @@ int buf_write_uint(Buf *self, uint32_t d) {
 	if (self->offset + sizeof(d) >= self->size) {
 		return -1;
 	}
-	/* write single bytes to get little-endian */
-	self->buf[self->offset++] = d;
-	self->buf[self->offset++] = d >> 8;
-	self->buf[self->offset++] = d >> 16;
-	self->buf[self->offset++] = d >> 24;
+	buf_put_le32(self->buf + self->offset, d);
+	self->offset += sizeof(d);
 	return sizeof(d);
 }
 
 /*
- * Write zero terminated string and zero pad up to flen
+ * Write zero terminated string and zero pad up to flen. The string
+ * including its terminating 0 has to fit into flen.
  */
 int buf_write_string(Buf *self, const char *s, size_t flen) {
-	size_t slen = strlen(s);
-	size_t i;
-	if (vflag)
-		printf("buf_write_string: s=%s, len=%zd\n", s, flen);
-	if (self->offset + slen + 1 < self->size && slen < flen - 1) {
-		i = 0;
-		while(s[i] && i < flen - 1) {
-			if (vflag)
-				printf("buf_write_string: offset=%zd, i=%zd, char=%c\n", self->offset, i, s[i]);
-			self->buf[self->offset++] = s[i++];
-		}
-		while(i < flen) {
-			if (vflag)
-				printf("buf_write_string: offset=%zd, i=%zd, char=%c\n", self->offset, i, 0);
-			self->buf[self->offset++] = 0;
-			i++;
-		}
-	} else {
+	size_t slen;
+
+	if (flen == 0 || self->offset + flen >= self->size) {
 		return -1;
 	}
+	/* never look further than the field is long */
+	if ((slen = strnlen(s, flen)) >= flen) {
+		return -1;
+	}
+	memcpy(self->buf + self->offset, s, slen);
+	memset(self->buf + self->offset + slen, 0, flen - slen);
+	self->offset += flen;
 	return 0;
 }
 
@@ -204,16 +213,11 @@ int buf_write_string(Buf *self, const char *s, size_t flen) {
  * Write data wite data with len
  */
 int buf_write_data(Buf *self, const char *s, size_t len) {
-	size_t i;
 	if (self->offset + len >= self->size) {
 		return -1;
 	}
-	i = 0;
-	while (i < len) {
-		if (vflag > 1)
-			printf("buf_write_data: offset=%zd, i=%zd, data=0x%02hhx\n", self->offset, i, s[i]);
-		self->buf[self->offset++] = s[i++];
-	}
+	memcpy(self->buf + self->offset, s, len);
+	self->offset += len;
 	return 0;
 }
 
@@ -323,8 +327,6 @@ int buf_unpack(Buf *self, char *fmt, ...) {
 }
 
 int buf_check_limit(Buf *self) {
-	if (vflag)
-		printf("buf_check_limit: offset=%zd, limit=%zd\n", self->offset, self->limit);
 	if (self->offset == self->limit) {
 		return 0;
 	} else {
@@ -20,6 +20,7 @@
 
 #include <stdarg.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 
 typedef struct {
@@ -27,10 +28,15 @@ typedef struct {
 	size_t size;
 	size_t offset;
 	size_t limit;
+	int borrowed;	/* buf is owned by someone else */
 } Buf;
 
 Buf* buf_new();
+void buf_free(Buf *self);
 void buf_reset(Buf *self);
+void buf_wrap(Buf *self, unsigned char *data, size_t size, size_t limit);
+int buf_slice(Buf *self, Buf *view, size_t len);
+unsigned char* buf_reserve(Buf *self, size_t len);
 int buf_read_byte(Buf *self, uint8_t *d);
 int buf_read_short(Buf *self, uint16_t *d);
 int buf_read_uint(Buf *self, uint32_t *d);
@@ -48,4 +54,52 @@ int buf_unpack(Buf *self, char *fmt, ...);
 int buf_vunpack(Buf *self, char *fmt, va_list ap);
 int buf_check_limit(Buf *self);
 
+/*
+ * Unaligned little endian loads and stores. On little endian hosts
+ * memcpy compiles to a single move, other hosts assemble the bytes.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BUF_LITTLE_ENDIAN
+#endif
+
+static inline uint16_t buf_get_le16(const unsigned char *p) {
+#ifdef BUF_LITTLE_ENDIAN
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+#else
+	return p[0] | p[1] << 8;
+#endif
+}
+
+static inline uint32_t buf_get_le32(const unsigned char *p) {
+#ifdef BUF_LITTLE_ENDIAN
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+#else
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+#endif
+}
+
+static inline void buf_put_le16(unsigned char *p, uint16_t v) {
+#ifdef BUF_LITTLE_ENDIAN
+	memcpy(p, &v, sizeof(v));
+#else
+	p[0] = v;
+	p[1] = v >> 8;
+#endif
+}
+
+static inline void buf_put_le32(unsigned char *p, uint32_t v) {
+#ifdef BUF_LITTLE_ENDIAN
+	memcpy(p, &v, sizeof(v));
+#else
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+#endif
+}
+
 #endif
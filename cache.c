@@ -0,0 +1,262 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Listing cache. The file list of every brick is kept in
+ * ~/.nxtctl/<bluetooth address>.list together with the free flash
+ * reported by GET_DEVICE_INFO at that time. A single GET_DEVICE_INFO
+ * round trip is enough to validate the cache: if the free flash
+ * changed, something else modified the brick and the listing is read
+ * again.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+extern int vflag;
+
+/*
+ * Build the path of a per brick state file name in ~/.nxtctl, e.g.
+ * "~/.nxtctl/0016530a0b0c00.list" for name ".list". The directory is
+ * created if needed.
+ */
+int cache_dir(char *path, size_t len, const char *name, const NXTInfo *info) {
+	const char *home;
+	size_t n;
+	int i;
+
+	if ((home = getenv("HOME")) == NULL || home[0] == 0) {
+		fprintf(stderr, "error: HOME not set\n");
+		return -1;
+	}
+	n = snprintf(path, len, "%s/.nxtctl", home);
+	if (n >= len) {
+		fprintf(stderr, "error: path too long\n");
+		return -1;
+	}
+	if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+		fprintf(stderr, "error: could not create %s\n", path);
+		return -1;
+	}
+	n += snprintf(path + n, len - n, "/");
+	for (i = 0; info && i < sizeof(info->btaddr) && n < len; i++)
+		n += snprintf(path + n, len - n, "%02x", info->btaddr[i]);
+	if (n < len)
+		n += snprintf(path + n, len - n, "%s", name);
+	if (n >= len) {
+		fprintf(stderr, "error: path too long\n");
+		return -1;
+	}
+	return 0;
+}
+
+static CacheFile* cache_find(Cache *cache, const char *name) {
+	int i;
+
+	for (i = 0; i < cache->count; i++) {
+		if (strcmp(cache->files[i].name, name) == 0)
+			return &cache->files[i];
+	}
+	return NULL;
+}
+
+static void cache_add(Cache *cache, const char *name, unsigned int size) {
+	CacheFile *file;
+
+	if ((file = cache_find(cache, name)) == NULL) {
+		cache->files = realloc(cache->files, (cache->count + 1) * sizeof(CacheFile));
+		if (cache->files == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		file = &cache->files[cache->count++];
+		strncpy(file->name, name, sizeof(file->name) - 1);
+		file->name[sizeof(file->name) - 1] = 0;
+	}
+	file->size = size;
+}
+
+static int cache_add_cb(const char *name, unsigned int size, void *arg) {
+	cache_add(arg, name, size);
+	return 0;
+}
+
+static int cache_load(Cache *cache) {
+	char line[BUFSIZ];
+	char name[20];
+	unsigned int size;
+	FILE *fp;
+
+	if ((fp = fopen(cache->path, "r")) == NULL)
+		return -1;
+	if (fgets(line, sizeof(line), fp) == NULL ||
+		sscanf(line, "free %u", &cache->free_space) != 1) {
+		fclose(fp);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%u %19s", &size, name) == 2)
+			cache_add(cache, name, size);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int cache_save(Cache *cache) {
+	char tmp[PATH_MAX + 4];
+	FILE *fp;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache->path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "error: could not write %s\n", tmp);
+		return -1;
+	}
+	fprintf(fp, "free %u\n", cache->free_space);
+	for (i = 0; i < cache->count; i++)
+		fprintf(fp, "%u %s\n", cache->files[i].size, cache->files[i].name);
+	if (fclose(fp) != 0 || rename(tmp, cache->path) != 0) {
+		fprintf(stderr, "error: could not write %s\n", cache->path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Load and validate the cache of the connected brick, reading the
+ * listing from the brick if the cache is missing or out of date.
+ */
+Cache* cache_open(NXT *nxt) {
+	NXTInfo info;
+	Cache *cache;
+
+	if (nxt_get_device_info(nxt, &info) != 0)
+		return NULL;
+	if ((cache = calloc(1, sizeof(Cache))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	if (cache_dir(cache->path, sizeof(cache->path), ".list", &info) != 0) {
+		free(cache);
+		return NULL;
+	}
+
+	if (cache_load(cache) == 0 && cache->free_space == info.free_space) {
+		if (vflag)
+			fprintf(stderr, "cache_open: %s is valid\n", cache->path);
+		return cache;
+	}
+
+	if (vflag)
+		fprintf(stderr, "cache_open: refreshing %s\n", cache->path);
+	cache->count = 0;
+	if (nxt_list_files(nxt, "*.*", cache_add_cb, cache) != 0) {
+		free(cache->files);
+		free(cache);
+		return NULL;
+	}
+	cache->free_space = info.free_space;
+	cache->dirty = 1;
+	return cache;
+}
+
+/*
+ * Write back the cache if needed and free it. After our own changes
+ * the free flash is read once more to get the new fingerprint.
+ */
+int cache_close(NXT *nxt, Cache *cache) {
+	NXTInfo info;
+	int res = 0;
+
+	if (!cache)
+		return 0;
+	if (cache->modified && !cache->stale) {
+		if (nxt_get_device_info(nxt, &info) == 0)
+			cache->free_space = info.free_space;
+		else
+			cache->stale = 1;
+	}
+	if (cache->stale)
+		unlink(cache->path);
+	else if (cache->dirty)
+		res = cache_save(cache);
+	free(cache->files);
+	free(cache);
+	return res;
+}
+
+/*
+ * Returns 0 if name is on the brick and -1 if not
+ */
+int cache_lookup(Cache *cache, const char *name, unsigned int *size) {
+	CacheFile *file;
+
+	if (!cache || (file = cache_find(cache, name)) == NULL)
+		return -1;
+	if (size)
+		*size = file->size;
+	return 0;
+}
+
+void cache_update(Cache *cache, const char *name, unsigned int size) {
+	if (!cache)
+		return;
+	cache_add(cache, name, size);
+	cache->dirty = 1;
+	cache->modified = 1;
+}
+
+void cache_remove(Cache *cache, const char *name) {
+	CacheFile *file;
+
+	if (!cache || (file = cache_find(cache, name)) == NULL)
+		return;
+	memmove(file, file + 1, (cache->files + cache->count - file - 1) * sizeof(CacheFile));
+	cache->count--;
+	cache->dirty = 1;
+	cache->modified = 1;
+}
+
+void cache_invalidate(Cache *cache) {
+	if (cache)
+		cache->stale = 1;
+}
+
+/*
+ * Like nxt_list_files, but answered from the cache
+ */
+int cache_list(Cache *cache, const char *pattern, nxt_file_fn fn, void *arg) {
+	int i;
+
+	for (i = 0; i < cache->count; i++) {
+		if (fnmatch(pattern, cache->files[i].name, 0) != 0)
+			continue;
+		if (fn(cache->files[i].name, cache->files[i].size, arg) != 0)
+			break;
+	}
+	return 0;
+}
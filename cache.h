@@ -0,0 +1,52 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <limits.h>
+#include "nxt.h"
+
+typedef struct {
+	char name[20];
+	unsigned int size;
+} CacheFile;
+
+/*
+ * Host side copy of the file listing of one brick. All functions
+ * accept a NULL cache and do nothing in that case.
+ */
+typedef struct cache {
+	char path[PATH_MAX];
+	unsigned int free_space;	/* fingerprint of the cached state */
+	CacheFile *files;
+	int count;
+	int dirty;		/* needs to be written back */
+	int modified;	/* changed by us, free space must be refreshed */
+	int stale;		/* brick state unknown, drop the cache */
+} Cache;
+
+int cache_dir(char *path, size_t len, const char *name, const NXTInfo *info);
+Cache* cache_open(NXT *nxt);
+int cache_close(NXT *nxt, Cache *cache);
+int cache_lookup(Cache *cache, const char *name, unsigned int *size);
+void cache_update(Cache *cache, const char *name, unsigned int size);
+void cache_remove(Cache *cache, const char *name);
+void cache_invalidate(Cache *cache);
+int cache_list(Cache *cache, const char *pattern, nxt_file_fn fn, void *arg);
+
+#endif
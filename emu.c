@@ -0,0 +1,1286 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emu.h"
+#include "nxt.h"
+#include "nxtcmd.h"
+
+typedef struct {
+	char name[20];
+	unsigned char *data;
+	unsigned int size;		/* size given when the file was opened */
+	unsigned int written;	/* bytes written so far */
+	int appendable;			/* opened with OPEN_WRITE_DATA */
+	int linear;				/* pages are contiguous */
+	unsigned int *pages;	/* flash pages holding the file */
+	unsigned int npages;
+} EmuFile;
+
+enum {
+	EMU_HANDLE_FREE,
+	EMU_HANDLE_READ,
+	EMU_HANDLE_WRITE,
+	EMU_HANDLE_FIND
+};
+
+typedef struct {
+	int mode;
+	EmuFile *file;
+	unsigned int pos;		/* file offset, list index for FIND */
+	char pattern[20];
+} EmuHandle;
+
+/* messages a mailbox holds, the oldest is dropped beyond that */
+#define EMU_MAILBOX_DEPTH 5
+
+typedef struct {
+	unsigned char message[EMU_MAILBOX_DEPTH][NXT_MESSAGE_MAX + 1];
+	unsigned char size[EMU_MAILBOX_DEPTH];
+	int head;
+	int count;
+} EmuMailbox;
+
+/* sensor ports */
+#define EMU_INPUTS 4
+
+typedef struct {
+	unsigned char type;
+	unsigned char mode;
+	unsigned char ls_ready;		/* bytes of the last transaction to read */
+	unsigned char ls_data[16];
+} EmuInput;
+
+struct emu {
+	EmuConfig config;
+	EmuFile **files;
+	int count;
+	EmuHandle *handles;
+	unsigned char *used;	/* per flash page */
+	unsigned int npages;
+	char program[20];		/* running program, empty if none */
+	EmuMailbox mailbox[2 * NXT_MAILBOXES];
+	EmuInput inputs[EMU_INPUTS];
+	double busy;			/* the link is in use until then */
+	unsigned long packets;
+	unsigned int seed;
+};
+
+void emu_config_init(EmuConfig *config) {
+	memset(config, 0, sizeof(*config));
+	config->max_handles = EMU_MAX_HANDLES;
+	config->flash_size = EMU_FLASH_SIZE;
+	config->packet = EMU_PACKET_SIZE;
+	config->seed = 1;
+}
+
+/*
+ * Parse comma separated key=value options into config: rtt (usec),
+ * bw (bytes/s), loss (per 1000), fail (packets), seed, handles, flash
+ * (bytes), packet (bytes) and dir.
+ */
+int emu_config_parse(EmuConfig *config, const char *options) {
+	char *copy, *opt, *val, *end, *last;
+	unsigned long n;
+	int res = 0;
+
+	if ((copy = strdup(options)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (opt = strtok_r(copy, ",", &last); opt; opt = strtok_r(NULL, ",", &last)) {
+		if ((val = strchr(opt, '=')) == NULL) {
+			fprintf(stderr, "error: emulator option %s has no value\n", opt);
+			res = -1;
+			break;
+		}
+		*val++ = 0;
+		if (strcmp(opt, "dir") == 0) {
+			if (strlen(val) >= sizeof(config->dir)) {
+				fprintf(stderr, "error: emulator directory too long\n");
+				res = -1;
+				break;
+			}
+			strcpy(config->dir, val);
+			continue;
+		}
+		if (strcmp(opt, "program") == 0) {
+			if (strlen(val) >= sizeof(config->program)) {
+				fprintf(stderr, "error: emulator program name too long\n");
+				res = -1;
+				break;
+			}
+			strcpy(config->program, val);
+			continue;
+		}
+		n = strtoul(val, &end, 0);
+		if (val[0] == 0 || *end) {
+			fprintf(stderr, "error: invalid value %s for emulator option %s\n", val, opt);
+			res = -1;
+			break;
+		}
+		if (strcmp(opt, "rtt") == 0)
+			config->rtt = n;
+		else if (strcmp(opt, "bw") == 0)
+			config->bandwidth = n;
+		else if (strcmp(opt, "loss") == 0 && n <= 1000)
+			config->loss = n;
+		else if (strcmp(opt, "fail") == 0)
+			config->fail = n;
+		else if (strcmp(opt, "seed") == 0)
+			config->seed = n;
+		else if (strcmp(opt, "handles") == 0 && n > 0 && n <= 256)
+			config->max_handles = n;
+		else if (strcmp(opt, "flash") == 0 && n >= NXT_FLASH_PAGE && n <= EMU_FLASH_MAX)
+			config->flash_size = n;
+		else if (strcmp(opt, "packet") == 0 && n >= EMU_PACKET_SIZE && n <= NXT_FRAME_MAX)
+			config->packet = n;
+		else {
+			fprintf(stderr, "error: invalid emulator option %s=%s\n", opt, val);
+			res = -1;
+			break;
+		}
+	}
+	free(copy);
+	return res;
+}
+
+Emu* emu_new(const EmuConfig *config) {
+	Emu *emu;
+
+	if ((emu = calloc(1, sizeof(Emu))) == NULL ||
+		(emu->handles = calloc(config->max_handles, sizeof(EmuHandle))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	emu->config = *config;
+	emu->seed = config->seed;
+	strcpy(emu->program, config->program);
+	emu->npages = (config->flash_size + NXT_FLASH_PAGE - 1) / NXT_FLASH_PAGE;
+	if ((emu->used = calloc(emu->npages ? emu->npages : 1, 1)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	return emu;
+}
+
+void emu_free(Emu *emu) {
+	int i;
+
+	for (i = 0; i < emu->count; i++) {
+		free(emu->files[i]->pages);
+		free(emu->files[i]->data);
+		free(emu->files[i]);
+	}
+	free(emu->files);
+	free(emu->handles);
+	free(emu->used);
+	free(emu);
+}
+
+/***********************************************************************/
+/* flash file table                                                    */
+/***********************************************************************/
+
+static int emu_find_file(Emu *emu, const char *name) {
+	int i;
+
+	for (i = 0; i < emu->count; i++)
+		if (strcmp(emu->files[i]->name, name) == 0)
+			return i;
+	return -1;
+}
+
+static unsigned int emu_free_space(Emu *emu) {
+	unsigned int used = 0;
+	int i;
+
+	for (i = 0; i < emu->count; i++)
+		used += emu->files[i]->size;
+	return emu->config.flash_size - used;
+}
+
+static int emu_busy(Emu *emu, EmuFile *file) {
+	unsigned int i;
+
+	for (i = 0; i < emu->config.max_handles; i++)
+		if (emu->handles[i].mode != EMU_HANDLE_FREE &&
+			emu->handles[i].mode != EMU_HANDLE_FIND &&
+			emu->handles[i].file == file)
+			return 1;
+	return 0;
+}
+
+/*
+ * Give file the pages for its size. Regular files take the first free
+ * pages wherever they are, linear files need a contiguous run, so
+ * deleting files fragments the flash for them. Returns a NXT status.
+ */
+static int emu_alloc(Emu *emu, EmuFile *file, int linear) {
+	unsigned int n, i, free_pages = 0;
+
+	n = (file->size + NXT_FLASH_PAGE - 1) / NXT_FLASH_PAGE;
+	for (i = 0; i < emu->npages; i++)
+		free_pages += !emu->used[i];
+	if (n > free_pages)
+		return NXT_ERROR_NO_SPACE;
+	if (n && (file->pages = malloc(n * sizeof(unsigned int))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (i = 0; i < emu->npages && file->npages < n; i++) {
+		if (emu->used[i]) {
+			if (linear)
+				file->npages = 0;
+			continue;
+		}
+		file->pages[file->npages++] = i;
+	}
+	if (file->npages < n) {
+		free(file->pages);
+		file->pages = NULL;
+		file->npages = 0;
+		return NXT_ERROR_NO_LINEAR_SPACE;
+	}
+	for (i = 0; i < n; i++)
+		emu->used[file->pages[i]] = 1;
+	file->linear = linear;
+	return NXT_SUCCESS;
+}
+
+static void emu_release(Emu *emu, EmuFile *file) {
+	unsigned int i;
+
+	for (i = 0; i < file->npages; i++)
+		emu->used[file->pages[i]] = 0;
+	free(file->pages);
+	file->pages = NULL;
+	file->npages = 0;
+}
+
+/*
+ * Create an empty file of the given size, returns a NXT status
+ */
+static int emu_create(Emu *emu, const char *name, unsigned int size, int linear,
+					  EmuFile **res) {
+	EmuFile *file;
+	const char *dot;
+	int status;
+
+	dot = strchr(name, '.');
+	if (name[0] == 0 || dot == NULL || dot == name || dot[1] == 0)
+		return NXT_ERROR_ILLEGAL_FILE_NAME;
+	if (emu_find_file(emu, name) >= 0)
+		return NXT_ERROR_FILE_EXISTS;
+	if (size > emu_free_space(emu))
+		return NXT_ERROR_NO_SPACE;
+	if ((file = calloc(1, sizeof(EmuFile))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	file->size = size;
+	if ((status = emu_alloc(emu, file, linear)) != NXT_SUCCESS) {
+		free(file);
+		return status;
+	}
+	if ((file->data = calloc(1, size ? size : 1)) == NULL ||
+		(emu->files = realloc(emu->files, (emu->count + 1) * sizeof(EmuFile *))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	strncpy(file->name, name, sizeof(file->name) - 1);
+	emu->files[emu->count++] = file;
+	*res = file;
+	return NXT_SUCCESS;
+}
+
+int emu_add_file(Emu *emu, const char *name, const unsigned char *data, unsigned int size) {
+	EmuFile *file;
+	int status;
+
+	if (strlen(name) >= sizeof(file->name) ||
+		(status = emu_create(emu, name, size, 0, &file)) != NXT_SUCCESS)
+		return -1;
+	memcpy(file->data, data, size);
+	file->written = size;
+	return 0;
+}
+
+static int emu_open_handle(Emu *emu, int mode, EmuFile *file, unsigned char *handle) {
+	unsigned int i;
+
+	for (i = 0; i < emu->config.max_handles; i++) {
+		if (emu->handles[i].mode == EMU_HANDLE_FREE) {
+			emu->handles[i].mode = mode;
+			emu->handles[i].file = file;
+			emu->handles[i].pos = 0;
+			*handle = i;
+			return NXT_SUCCESS;
+		}
+	}
+	return NXT_ERROR_NO_MORE_HANDLES;
+}
+
+static EmuHandle* emu_handle(Emu *emu, unsigned char handle, int mode) {
+	if (handle >= emu->config.max_handles || emu->handles[handle].mode != mode)
+		return NULL;
+	return &emu->handles[handle];
+}
+
+/***********************************************************************/
+/* commands                                                            */
+/***********************************************************************/
+
+static int emu_get_battery_level(Emu *emu, nxt_get_battery_level_request *q,
+								 nxt_get_battery_level_reply *r) {
+	r->millivolts = 7800;
+	return NXT_SUCCESS;
+}
+
+static int emu_keep_alive(Emu *emu, nxt_keep_alive_request *q, nxt_keep_alive_reply *r) {
+	r->sleep_time = 10 * 60 * 1000;
+	return NXT_SUCCESS;
+}
+
+static int emu_get_firmware_version(Emu *emu, nxt_get_firmware_version_request *q,
+									nxt_get_firmware_version_reply *r) {
+	r->protocol_major = 1;
+	r->protocol_minor = 124;
+	r->firmware_major = 1;
+	r->firmware_minor = 29;
+	return NXT_SUCCESS;
+}
+
+static int emu_get_device_info(Emu *emu, nxt_get_device_info_request *q,
+							   nxt_get_device_info_reply *r) {
+	static const uint8_t btaddr[7] = { 0x00, 0x16, 0x53, 0xe0, 0x00, 0x01, 0x00 };
+
+	strncpy(r->name, "EMU", sizeof(r->name) - 1);
+	memcpy(r->btaddr, btaddr, sizeof(r->btaddr));
+	r->free_space = emu_free_space(emu);
+	return NXT_SUCCESS;
+}
+
+static int emu_start_program(Emu *emu, nxt_start_program_request *q,
+							 nxt_start_program_reply *r) {
+	size_t len = strlen(q->filename);
+	EmuFile *file;
+	int i, status;
+
+	/* the firmware reports missing programs as out of range */
+	if ((i = emu_find_file(emu, q->filename)) < 0 || len < 4 ||
+		strcmp(q->filename + len - 4, ".rxe") != 0)
+		return NXT_ERROR_OUT_OF_RANGE;
+	/* programs run in place, a fragmented one has to be moved first */
+	file = emu->files[i];
+	if (!file->linear) {
+		emu_release(emu, file);
+		if ((status = emu_alloc(emu, file, 1)) != NXT_SUCCESS) {
+			emu_alloc(emu, file, 0);
+			return status;
+		}
+	}
+	memcpy(emu->program, q->filename, sizeof(emu->program));
+	memset(emu->mailbox, 0, sizeof(emu->mailbox));
+	return NXT_SUCCESS;
+}
+
+static int emu_stop_program(Emu *emu, nxt_stop_program_request *q,
+							nxt_stop_program_reply *r) {
+	if (emu->program[0] == 0)
+		return NXT_ERROR_NO_ACTIVE_PROGRAM;
+	emu->program[0] = 0;
+	memset(emu->mailbox, 0, sizeof(emu->mailbox));
+	return NXT_SUCCESS;
+}
+
+static int emu_get_current_program_name(Emu *emu, nxt_get_current_program_name_request *q,
+										nxt_get_current_program_name_reply *r) {
+	if (emu->program[0] == 0)
+		return NXT_ERROR_NO_ACTIVE_PROGRAM;
+	memcpy(r->filename, emu->program, sizeof(r->filename));
+	return NXT_SUCCESS;
+}
+
+static int emu_open_read(Emu *emu, nxt_open_read_request *q, nxt_open_read_reply *r) {
+	EmuFile *file;
+	int i;
+
+	if ((i = emu_find_file(emu, q->filename)) < 0)
+		return NXT_ERROR_FILE_NOT_FOUND;
+	file = emu->files[i];
+	if (emu_busy(emu, file))
+		return NXT_ERROR_FILE_IS_BUSY;
+	r->filesize = file->size;
+	return emu_open_handle(emu, EMU_HANDLE_READ, file, &r->handle);
+}
+
+static int emu_open_new(Emu *emu, const char *filename, unsigned int filesize, int linear,
+						unsigned char *res) {
+	EmuFile *file;
+	unsigned char handle;
+	int status;
+
+	/* check for a free handle first, so no file is left behind */
+	if ((status = emu_open_handle(emu, EMU_HANDLE_WRITE, NULL, &handle)) != NXT_SUCCESS)
+		return status;
+	if ((status = emu_create(emu, filename, filesize, linear, &file)) != NXT_SUCCESS) {
+		emu->handles[handle].mode = EMU_HANDLE_FREE;
+		return status;
+	}
+	emu->handles[handle].file = file;
+	*res = handle;
+	return NXT_SUCCESS;
+}
+
+static int emu_open_write(Emu *emu, nxt_open_write_request *q, nxt_open_write_reply *r) {
+	return emu_open_new(emu, q->filename, q->filesize, 0, &r->handle);
+}
+
+static int emu_open_write_linear(Emu *emu, nxt_open_write_linear_request *q,
+								 nxt_open_write_linear_reply *r) {
+	return emu_open_new(emu, q->filename, q->filesize, 1, &r->handle);
+}
+
+static int emu_open_write_data(Emu *emu, nxt_open_write_data_request *q,
+							   nxt_open_write_data_reply *r) {
+	int status;
+
+	if ((status = emu_open_new(emu, q->filename, q->filesize, 0, &r->handle)) == NXT_SUCCESS)
+		emu->handles[r->handle].file->appendable = 1;
+	return status;
+}
+
+/*
+ * The firmware hands out the flash address of linear files
+ */
+static int emu_open_read_linear(Emu *emu, nxt_open_read_linear_request *q,
+								nxt_open_read_linear_reply *r) {
+	EmuFile *file;
+	int i;
+
+	if ((i = emu_find_file(emu, q->filename)) < 0)
+		return NXT_ERROR_FILE_NOT_FOUND;
+	file = emu->files[i];
+	if (!file->linear)
+		return NXT_ERROR_NOT_A_LINEAR_FILE;
+	r->address = NXT_FLASH_BASE + (file->npages ? file->pages[0] : 0) * NXT_FLASH_PAGE;
+	return NXT_SUCCESS;
+}
+
+static int emu_open_append_data(Emu *emu, nxt_open_append_data_request *q,
+								nxt_open_append_data_reply *r) {
+	EmuFile *file;
+	int i, status;
+
+	if ((i = emu_find_file(emu, q->filename)) < 0)
+		return NXT_ERROR_FILE_NOT_FOUND;
+	file = emu->files[i];
+	if (emu_busy(emu, file))
+		return NXT_ERROR_FILE_IS_BUSY;
+	if (!file->appendable)
+		return NXT_ERROR_APPEND_NOT_POSSIBLE;
+	if (file->written >= file->size)
+		return NXT_ERROR_FILE_IS_FULL;
+	if ((status = emu_open_handle(emu, EMU_HANDLE_WRITE, file, &r->handle)) != NXT_SUCCESS)
+		return status;
+	emu->handles[r->handle].pos = file->written;
+	r->available = file->size - file->written;
+	return NXT_SUCCESS;
+}
+
+static int emu_close(Emu *emu, nxt_close_request *q, nxt_close_reply *r) {
+	if (q->handle >= emu->config.max_handles ||
+		emu->handles[q->handle].mode == EMU_HANDLE_FREE)
+		return NXT_ERROR_HANDLE_ALREADY_CLOSED;
+	emu->handles[q->handle].mode = EMU_HANDLE_FREE;
+	r->handle = q->handle;
+	return NXT_SUCCESS;
+}
+
+static int emu_delete(Emu *emu, nxt_delete_request *q, nxt_delete_reply *r) {
+	EmuFile *file;
+	int i;
+
+	memcpy(r->filename, q->filename, sizeof(r->filename));
+	if ((i = emu_find_file(emu, q->filename)) < 0)
+		return NXT_ERROR_FILE_NOT_FOUND;
+	file = emu->files[i];
+	if (emu_busy(emu, file))
+		return NXT_ERROR_FILE_IS_BUSY;
+	emu_release(emu, file);
+	free(file->data);
+	free(file);
+	memmove(emu->files + i, emu->files + i + 1, (emu->count - i - 1) * sizeof(EmuFile *));
+	emu->count--;
+	return NXT_SUCCESS;
+}
+
+static int emu_delete_user_flash(Emu *emu, nxt_delete_user_flash_request *q,
+								 nxt_delete_user_flash_reply *r) {
+	unsigned int i;
+
+	for (i = 0; i < emu->config.max_handles; i++)
+		emu->handles[i].mode = EMU_HANDLE_FREE;
+	while (emu->count > 0) {
+		emu->count--;
+		emu_release(emu, emu->files[emu->count]);
+		free(emu->files[emu->count]->data);
+		free(emu->files[emu->count]);
+	}
+	emu->program[0] = 0;
+	return NXT_SUCCESS;
+}
+
+/*
+ * Continue the search of handle h and fill in the next match
+ */
+static int emu_find_next(Emu *emu, unsigned char h, nxt_find_first_file_reply *r) {
+	EmuHandle *handle = &emu->handles[h];
+	EmuFile *file;
+
+	while (handle->pos < emu->count) {
+		file = emu->files[handle->pos++];
+		if (fnmatch(handle->pattern, file->name, 0) == 0) {
+			r->handle = h;
+			memcpy(r->filename, file->name, sizeof(r->filename));
+			r->filesize = file->size;
+			return NXT_SUCCESS;
+		}
+	}
+	return NXT_ERROR_FILE_NOT_FOUND;
+}
+
+static int emu_find_first_file(Emu *emu, nxt_find_first_file_request *q,
+							   nxt_find_first_file_reply *r) {
+	unsigned char h;
+	int status;
+
+	if ((status = emu_open_handle(emu, EMU_HANDLE_FIND, NULL, &h)) != NXT_SUCCESS)
+		return status;
+	memcpy(emu->handles[h].pattern, q->pattern, sizeof(q->pattern));
+	if ((status = emu_find_next(emu, h, r)) != NXT_SUCCESS)
+		emu->handles[h].mode = EMU_HANDLE_FREE;
+	return status;
+}
+
+static int emu_find_next_file(Emu *emu, nxt_find_next_file_request *q,
+							  nxt_find_next_file_reply *r) {
+	if (emu_handle(emu, q->handle, EMU_HANDLE_FIND) == NULL)
+		return NXT_ERROR_ILLEGAL_HANDLE;
+	/* same layout as the FIND_FIRST_FILE reply */
+	return emu_find_next(emu, q->handle, (nxt_find_first_file_reply *) r);
+}
+
+/*
+ * READ and WRITE carry a variable payload after the fixed fields
+ */
+static int emu_read(Emu *emu, const unsigned char *req, size_t len,
+					unsigned char *reply, size_t size) {
+	nxt_read_request q;
+	nxt_read_reply r;
+	EmuHandle *handle;
+	unsigned int n;
+
+	memset(&r, 0, sizeof(r));
+	if (nxt_read_req_dec(req, len, &q) != 0) {
+		r.status = NXT_ERROR_INSANE_PACKET;
+	} else if ((handle = emu_handle(emu, q.handle, EMU_HANDLE_READ)) == NULL) {
+		r.status = NXT_ERROR_ILLEGAL_HANDLE;
+	} else if (NXT_READ_REPLY_SIZE + q.size > size) {
+		r.status = NXT_ERROR_ILLEGAL_SIZE;
+	} else {
+		r.handle = q.handle;
+		n = handle->file->size - handle->pos;
+		if (q.size > n)
+			r.status = NXT_ERROR_END_OF_FILE;
+		else
+			n = q.size;
+		memcpy(reply + NXT_READ_REPLY_SIZE, handle->file->data + handle->pos, n);
+		handle->pos += n;
+		r.size = n;
+	}
+	if (nxt_read_reply_enc(reply, size, &r) < 0)
+		return -1;
+	return NXT_READ_REPLY_SIZE + r.size;
+}
+
+static int emu_write(Emu *emu, const unsigned char *req, size_t len,
+					 unsigned char *reply, size_t size) {
+	nxt_write_request q;
+	nxt_write_reply r;
+	EmuHandle *handle;
+	unsigned int n;
+
+	memset(&r, 0, sizeof(r));
+	if (nxt_write_req_dec(req, len, &q) != 0) {
+		r.status = NXT_ERROR_INSANE_PACKET;
+	} else if ((handle = emu_handle(emu, q.handle, EMU_HANDLE_WRITE)) == NULL) {
+		r.status = NXT_ERROR_ILLEGAL_HANDLE;
+	} else {
+		r.handle = q.handle;
+		n = len - NXT_WRITE_REQ_SIZE;
+		if (n > handle->file->size - handle->pos) {
+			n = handle->file->size - handle->pos;
+			r.status = NXT_ERROR_FILE_IS_FULL;
+		}
+		memcpy(handle->file->data + handle->pos, req + NXT_WRITE_REQ_SIZE, n);
+		handle->pos += n;
+		if (handle->pos > handle->file->written)
+			handle->file->written = handle->pos;
+		r.size = n;
+	}
+	return nxt_write_reply_enc(reply, size, &r);
+}
+
+/*
+ * The sensors read a sawtooth that advances with every packet, analog
+ * ones over the 10 bit range, lowspeed ones count up from the register
+ * read.
+ */
+static int emu_set_input_mode(Emu *emu, nxt_set_input_mode_request *q,
+							  nxt_set_input_mode_reply *r) {
+	if (q->port >= EMU_INPUTS)
+		return NXT_ERROR_OUT_OF_RANGE;
+	emu->inputs[q->port].type = q->type;
+	emu->inputs[q->port].mode = q->mode;
+	emu->inputs[q->port].ls_ready = 0;
+	return NXT_SUCCESS;
+}
+
+static int emu_get_input_values(Emu *emu, nxt_get_input_values_request *q,
+								nxt_get_input_values_reply *r) {
+	EmuInput *in;
+
+	if (q->port >= EMU_INPUTS)
+		return NXT_ERROR_OUT_OF_RANGE;
+	in = &emu->inputs[q->port];
+	r->port = q->port;
+	r->type = in->type;
+	r->mode = in->mode;
+	if (in->type == NXT_SENSOR_NO_SENSOR || in->type == NXT_SENSOR_LOWSPEED ||
+		in->type == NXT_SENSOR_LOWSPEED_9V) {
+		r->raw = r->normalized = 1023;
+		return NXT_SUCCESS;
+	}
+	r->valid = 1;
+	r->raw = (emu->packets * 7 + q->port * 256) % 1024;
+	r->normalized = r->raw;
+	switch (in->mode & 0xe0) {
+	case NXT_MODE_BOOLEAN:
+		r->scaled = r->raw < 512;
+		break;
+	case NXT_MODE_PERCENT:
+		r->scaled = (1023 - r->raw) * 100 / 1023;
+		break;
+	default:
+		r->scaled = r->raw;
+	}
+	return NXT_SUCCESS;
+}
+
+static int emu_ls_write(Emu *emu, const unsigned char *req, size_t len,
+						unsigned char *reply, size_t size) {
+	nxt_ls_write_request q;
+	nxt_ls_write_reply r;
+	EmuInput *in;
+	int i;
+
+	memset(&r, 0, sizeof(r));
+	if (nxt_ls_write_req_dec(req, len, &q) != 0 || q.tx_len > 16 || q.rx_len > 16 ||
+		len != NXT_LS_WRITE_REQ_SIZE + q.tx_len) {
+		r.status = NXT_ERROR_INSANE_PACKET;
+	} else if (q.port >= EMU_INPUTS) {
+		r.status = NXT_ERROR_OUT_OF_RANGE;
+	} else if (emu->inputs[q.port].type != NXT_SENSOR_LOWSPEED &&
+			   emu->inputs[q.port].type != NXT_SENSOR_LOWSPEED_9V) {
+		r.status = NXT_ERROR_BAD_INPUT_OUTPUT;
+	} else {
+		in = &emu->inputs[q.port];
+		in->ls_ready = q.rx_len;
+		for (i = 0; i < q.rx_len; i++)
+			in->ls_data[i] = (q.tx_len > 1 ? req[NXT_LS_WRITE_REQ_SIZE + 1] : 0) +
+				i + emu->packets;
+	}
+	return nxt_ls_write_reply_enc(reply, size, &r);
+}
+
+static int emu_ls_get_status(Emu *emu, nxt_ls_get_status_request *q,
+							 nxt_ls_get_status_reply *r) {
+	if (q->port >= EMU_INPUTS)
+		return NXT_ERROR_OUT_OF_RANGE;
+	r->bytes_ready = emu->inputs[q->port].ls_ready;
+	return NXT_SUCCESS;
+}
+
+static int emu_ls_read(Emu *emu, nxt_ls_read_request *q, nxt_ls_read_reply *r) {
+	EmuInput *in;
+
+	if (q->port >= EMU_INPUTS)
+		return NXT_ERROR_OUT_OF_RANGE;
+	in = &emu->inputs[q->port];
+	if (in->ls_ready == 0)
+		return NXT_ERROR_BUS_ERROR;
+	r->bytes_read = in->ls_ready;
+	memcpy(r->data, in->ls_data, in->ls_ready);
+	in->ls_ready = 0;
+	return NXT_SUCCESS;
+}
+
+/*
+ * The running program echoes every message that arrives in inbox n to
+ * mailbox n + 10, where the host can read it back.
+ */
+static int emu_message_write(Emu *emu, const unsigned char *req, size_t len,
+							 unsigned char *reply, size_t size) {
+	nxt_message_write_request q;
+	nxt_message_write_reply r;
+	EmuMailbox *box;
+
+	memset(&r, 0, sizeof(r));
+	if (nxt_message_write_req_dec(req, len, &q) != 0 || q.size == 0 ||
+		q.size > NXT_MESSAGE_MAX + 1 || len != NXT_MESSAGE_WRITE_REQ_SIZE + q.size) {
+		r.status = NXT_ERROR_INSANE_PACKET;
+	} else if (q.inbox >= NXT_MAILBOXES) {
+		r.status = NXT_ERROR_ILLEGAL_QUEUE;
+	} else if (emu->program[0] == 0) {
+		r.status = NXT_ERROR_NO_ACTIVE_PROGRAM;
+	} else {
+		box = &emu->mailbox[q.inbox + NXT_MAILBOXES];
+		if (box->count == EMU_MAILBOX_DEPTH) {
+			box->head = (box->head + 1) % EMU_MAILBOX_DEPTH;
+			box->count--;
+		}
+		memcpy(box->message[(box->head + box->count) % EMU_MAILBOX_DEPTH],
+			   req + NXT_MESSAGE_WRITE_REQ_SIZE, q.size);
+		box->size[(box->head + box->count) % EMU_MAILBOX_DEPTH] = q.size;
+		box->count++;
+	}
+	return nxt_message_write_reply_enc(reply, size, &r);
+}
+
+static int emu_message_read(Emu *emu, nxt_message_read_request *q,
+							nxt_message_read_reply *r) {
+	EmuMailbox *box;
+
+	if (q->remote_inbox >= 2 * NXT_MAILBOXES)
+		return NXT_ERROR_ILLEGAL_QUEUE;
+	if (emu->program[0] == 0)
+		return NXT_ERROR_NO_ACTIVE_PROGRAM;
+	box = &emu->mailbox[q->remote_inbox];
+	r->local_inbox = q->local_inbox;
+	if (box->count == 0)
+		return NXT_ERROR_QUEUE_EMPTY;
+	r->size = box->size[box->head];
+	memcpy(r->message, box->message[box->head], r->size);
+	if (q->remove) {
+		box->head = (box->head + 1) % EMU_MAILBOX_DEPTH;
+		box->count--;
+	}
+	return NXT_SUCCESS;
+}
+
+#define EMU_CASE(NAME, name)											\
+	case NXT_CMD_##NAME: {												\
+		nxt_##name##_request q;											\
+		nxt_##name##_reply r;											\
+		memset(&r, 0, sizeof(r));										\
+		if (nxt_##name##_req_dec(req, len, &q) != 0)					\
+			r.status = NXT_ERROR_INSANE_PACKET;							\
+		else															\
+			r.status = emu_##name(emu, &q, &r);							\
+		n = nxt_##name##_reply_enc(reply, size, &r);					\
+		break;															\
+	}
+
+/*
+ * Process one request packet and build the reply in reply. Returns
+ * the length of the reply, 0 if the request does not want one and -1
+ * if no reply can be built.
+ */
+int emu_packet(Emu *emu, const unsigned char *req, size_t len,
+			   unsigned char *reply, size_t size) {
+	int n;
+
+	if (len < 2 || size < 3)
+		return -1;
+	if (size > emu->config.packet)
+		size = emu->config.packet;
+	if (len > emu->config.packet) {
+		reply[0] = NXT_REPLY_COMMAND;
+		reply[1] = req[1];
+		reply[2] = NXT_ERROR_ILLEGAL_SIZE;
+		return req[0] & 0x80 ? 0 : 3;
+	}
+	switch (req[1]) {
+	EMU_CASE(START_PROGRAM, start_program)
+	EMU_CASE(STOP_PROGRAM, stop_program)
+	EMU_CASE(GET_BATTERY_LEVEL, get_battery_level)
+	EMU_CASE(KEEP_ALIVE, keep_alive)
+	EMU_CASE(GET_CURRENT_PROGRAM_NAME, get_current_program_name)
+	EMU_CASE(OPEN_READ, open_read)
+	EMU_CASE(OPEN_WRITE, open_write)
+	EMU_CASE(CLOSE, close)
+	EMU_CASE(DELETE, delete)
+	EMU_CASE(FIND_FIRST_FILE, find_first_file)
+	EMU_CASE(FIND_NEXT_FILE, find_next_file)
+	EMU_CASE(GET_FIRMWARE_VERSION, get_firmware_version)
+	EMU_CASE(OPEN_WRITE_LINEAR, open_write_linear)
+	EMU_CASE(OPEN_READ_LINEAR, open_read_linear)
+	EMU_CASE(OPEN_WRITE_DATA, open_write_data)
+	EMU_CASE(OPEN_APPEND_DATA, open_append_data)
+	EMU_CASE(GET_DEVICE_INFO, get_device_info)
+	EMU_CASE(DELETE_USER_FLASH, delete_user_flash)
+	EMU_CASE(MESSAGE_READ, message_read)
+	EMU_CASE(SET_INPUT_MODE, set_input_mode)
+	EMU_CASE(GET_INPUT_VALUES, get_input_values)
+	EMU_CASE(LS_GET_STATUS, ls_get_status)
+	EMU_CASE(LS_READ, ls_read)
+	case NXT_CMD_LS_WRITE:
+		n = emu_ls_write(emu, req, len, reply, size);
+		break;
+	case NXT_CMD_MESSAGE_WRITE:
+		n = emu_message_write(emu, req, len, reply, size);
+		break;
+	case NXT_CMD_READ:
+		n = emu_read(emu, req, len, reply, size);
+		break;
+	case NXT_CMD_WRITE:
+		n = emu_write(emu, req, len, reply, size);
+		break;
+	default:
+		reply[0] = NXT_REPLY_COMMAND;
+		reply[1] = req[1];
+		reply[2] = NXT_ERROR_UNKNOWN_COMMAND_OPCODE;
+		n = 3;
+	}
+	if (req[0] & 0x80)
+		return 0;
+	return n;
+}
+
+/***********************************************************************/
+/* the emulated link                                                   */
+/***********************************************************************/
+
+#define EMU_QUEUE 64
+
+struct emu_reply {
+	double due;
+	int lost;
+	size_t len;
+	unsigned char data[NXT_FRAME_MAX];
+};
+
+/*
+ * Pass one request over the emulated link: apply the faults, process
+ * it and compute when its reply arrives. Returns like emu_packet, -1
+ * also for a lost request or reply.
+ */
+static int emu_exchange(Emu *emu, const unsigned char *req, size_t len,
+						unsigned char *reply, size_t size, double *due) {
+	double now = nxt_clock();
+	int n, lost;
+
+	emu->packets++;
+	lost = (emu->config.fail && emu->packets > emu->config.fail) ||
+		(emu->config.loss && rand_r(&emu->seed) % 1000 < emu->config.loss);
+	if (lost)
+		n = (len > 0 && req[0] & 0x80) ? 0 : -1;
+	else
+		n = emu_packet(emu, req, len, reply, size);
+
+	/* the link carries one packet at a time */
+	if (emu->busy < now)
+		emu->busy = now;
+	if (emu->config.bandwidth)
+		emu->busy += (len + (n > 0 ? n : 0)) / (double) emu->config.bandwidth;
+	*due = emu->busy + emu->config.rtt / 1e6;
+	return n;
+}
+
+/*
+ * Serve requests framed like nxtd on fd until it is closed. Every
+ * reply is held back until it is due, while later requests are already
+ * accepted, so pipelined transfers behave like on a real link.
+ */
+int emu_serve(Emu *emu, int fd) {
+	struct emu_reply *queue, *r;
+	unsigned int head = 0, tail = 0;
+	unsigned char req[NXT_FRAME_MAX];
+	struct timeval tv, *tvp;
+	fd_set rfds;
+	double now, wait;
+	size_t len;
+	int n, res = 0;
+
+	if ((queue = calloc(EMU_QUEUE, sizeof(*queue))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (;;) {
+		now = nxt_clock();
+		while (head != tail && queue[head % EMU_QUEUE].due <= now) {
+			r = &queue[head % EMU_QUEUE];
+			if (nxt_frame_write(fd, r->data, r->len) != 0) {
+				res = -1;
+				goto out;
+			}
+			head++;
+		}
+
+		FD_ZERO(&rfds);
+		if (tail - head < EMU_QUEUE)
+			FD_SET(fd, &rfds);
+		tvp = NULL;
+		if (head != tail) {
+			wait = queue[head % EMU_QUEUE].due - now;
+			tv.tv_sec = wait;
+			tv.tv_usec = (wait - tv.tv_sec) * 1e6;
+			tvp = &tv;
+		}
+		if (select(fd + 1, &rfds, NULL, NULL, tvp) < 0) {
+			if (errno == EINTR)
+				continue;
+			res = -1;
+			break;
+		}
+		if (!FD_ISSET(fd, &rfds))
+			continue;
+
+		/* a closed connection ends the session */
+		if (nxt_frame_read(fd, req, sizeof(req), &len) != 0)
+			break;
+		r = &queue[tail % EMU_QUEUE];
+		n = emu_exchange(emu, req, len, r->data, sizeof(r->data), &r->due);
+		if (n == 0)
+			continue;
+		/* a zero length reply tells the client the request failed */
+		r->len = n < 0 ? 0 : n;
+		tail++;
+	}
+out:
+	free(queue);
+	return res;
+}
+
+/*
+ * The in-process transport: replies are queued with their due time and
+ * read blocks until the next one is due.
+ */
+typedef struct {
+	Emu *emu;
+	struct emu_reply queue[EMU_QUEUE];
+	unsigned int head;
+	unsigned int tail;
+} EmuLink;
+
+static void emu_sleep_until(double due) {
+	struct timespec ts;
+	double wait;
+
+	while ((wait = due - nxt_clock()) > 0) {
+		ts.tv_sec = wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static int emu_link_write(NXT *self, const unsigned char *data, size_t len) {
+	EmuLink *link = self->link;
+	struct emu_reply *r;
+	int n;
+
+	if (link->tail - link->head >= EMU_QUEUE)
+		return -1;
+	r = &link->queue[link->tail % EMU_QUEUE];
+	n = emu_exchange(link->emu, data, len, r->data, sizeof(r->data), &r->due);
+	if (n == 0)
+		return 0;
+	r->lost = n < 0;
+	r->len = n < 0 ? 0 : n;
+	link->tail++;
+	return 0;
+}
+
+static int emu_link_read(NXT *self, unsigned char *data, size_t size, size_t *len) {
+	EmuLink *link = self->link;
+	struct emu_reply *r;
+
+	/* a real brick would let the read time out */
+	if (link->head == link->tail)
+		return NXT_TIMEOUT;
+	r = &link->queue[link->head++ % EMU_QUEUE];
+	emu_sleep_until(r->due);
+	if (r->lost) {
+		emu_sleep_until(nxt_clock() + self->timeout / 1e3);
+		return NXT_TIMEOUT;
+	}
+	if (r->len > size)
+		return -1;
+	memcpy(data, r->data, r->len);
+	*len = r->len;
+	return 0;
+}
+
+static void emu_link_close(NXT *self) {
+	EmuLink *link = self->link;
+
+	if (link->emu->config.dir[0])
+		emu_save_dir(link->emu, link->emu->config.dir);
+	emu_free(link->emu);
+	free(link);
+	self->link = NULL;
+}
+
+static const NXTTransport emu_transport = {
+	"emu", emu_link_write, emu_link_read, emu_link_close
+};
+
+/*
+ * Connect nxt to a new emulated brick configured by options, see
+ * emu_config_parse. With dir set the flash is loaded from that
+ * directory and written back to it on close.
+ */
+int emu_link_open(NXT *nxt, const char *options) {
+	EmuConfig config;
+	EmuLink *link;
+
+	emu_config_init(&config);
+	if (emu_config_parse(&config, options) != 0)
+		return -1;
+	if ((link = calloc(1, sizeof(EmuLink))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	link->emu = emu_new(&config);
+	if (config.dir[0] && emu_load_dir(link->emu, config.dir) != 0) {
+		emu_free(link->emu);
+		free(link);
+		return -1;
+	}
+	nxt->link = link;
+	nxt->transport = &emu_transport;
+	return 0;
+}
+
+/***********************************************************************/
+/* flash image directory                                               */
+/***********************************************************************/
+
+#define EMU_INDEX ".emu"
+
+static int emu_valid_name(const char *name) {
+	return strlen(name) < 20 && name[0] != '.' && strchr(name, '.') != NULL;
+}
+
+/*
+ * Give file the flash pages listed in runs, "first+count" separated by
+ * commas or "-" for none, as saved by emu_save_index. Fails if they do
+ * not match the size of the file or are taken already.
+ */
+static int emu_claim(Emu *emu, EmuFile *file, const char *runs) {
+	unsigned int n, first, count, i;
+	char *end;
+
+	n = (file->size + NXT_FLASH_PAGE - 1) / NXT_FLASH_PAGE;
+	if (n && (file->pages = malloc(n * sizeof(unsigned int))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	while (strcmp(runs, "-") != 0 && *runs) {
+		first = strtoul(runs, &end, 10);
+		if (*end != '+')
+			goto fail;
+		count = strtoul(end + 1, &end, 10);
+		if ((*end != ',' && *end != 0) || count > n - file->npages ||
+			first >= emu->npages || count > emu->npages - first)
+			goto fail;
+		for (i = first; i < first + count; i++) {
+			if (emu->used[i])
+				goto fail;
+			file->pages[file->npages++] = i;
+		}
+		runs = *end ? end + 1 : end;
+	}
+	if (file->npages != n)
+		goto fail;
+	for (i = 0; i < n; i++)
+		emu->used[file->pages[i]] = 1;
+	return 0;
+fail:
+	free(file->pages);
+	file->pages = NULL;
+	file->npages = 0;
+	return -1;
+}
+
+/*
+ * dir/.emu keeps what the files in dir do not tell, one
+ * "name written appendable linear pages" line per file: partly written
+ * files and files opened as data files can be appended to by the next
+ * run, and the files keep their place in flash, so does fragmentation.
+ * Files without a line, e.g. copied into dir, take the first free pages.
+ */
+static void emu_load_index(Emu *emu, const char *dir) {
+	char path[PATH_MAX], line[4096], name[20], runs[4096];
+	unsigned int written;
+	int i, n, appendable, linear;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/" EMU_INDEX, dir);
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+	for (i = 0; i < emu->count; i++)
+		emu_release(emu, emu->files[i]);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		n = sscanf(line, "%19s %u %d %d %4095s", name, &written, &appendable, &linear, runs);
+		if (n < 3 || (i = emu_find_file(emu, name)) < 0 || written > emu->files[i]->size)
+			continue;
+		emu->files[i]->written = written;
+		emu->files[i]->appendable = appendable;
+		if (n == 5 && emu_claim(emu, emu->files[i], runs) == 0)
+			emu->files[i]->linear = linear;
+	}
+	fclose(f);
+	for (i = 0; i < emu->count; i++)
+		if (emu->files[i]->pages == NULL && emu->files[i]->size > 0)
+			emu_alloc(emu, emu->files[i], 0);
+}
+
+static int emu_save_index(Emu *emu, const char *dir) {
+	char path[PATH_MAX];
+	EmuFile *file;
+	unsigned int j, first;
+	int i;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/" EMU_INDEX, dir);
+	if (emu->count == 0) {
+		unlink(path);
+		return 0;
+	}
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "error: could not save %s from the emulator\n", path);
+		return -1;
+	}
+	for (i = 0; i < emu->count; i++) {
+		file = emu->files[i];
+		fprintf(f, "%s %u %d %d ", file->name, file->written, file->appendable, file->linear);
+		if (file->npages == 0)
+			fprintf(f, "-");
+		for (j = 0; j < file->npages; j = first) {
+			for (first = j + 1; first < file->npages &&
+					 file->pages[first] == file->pages[first - 1] + 1; first++)
+				;
+			fprintf(f, "%s%u+%u", j ? "," : "", file->pages[j], first - j);
+		}
+		fprintf(f, "\n");
+	}
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * Add every regular file with a valid NXT file name in dir to the flash
+ */
+int emu_load_dir(Emu *emu, const char *dir) {
+	char path[PATH_MAX];
+	unsigned char *data;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int fd, res = 0;
+
+	if ((d = opendir(dir)) == NULL) {
+		fprintf(stderr, "error: could not open emulator directory %s\n", dir);
+		return -1;
+	}
+	while (res == 0 && (de = readdir(d)) != NULL) {
+		if (!emu_valid_name(de->d_name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		if ((data = malloc(st.st_size ? st.st_size : 1)) == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		if ((fd = open(path, O_RDONLY)) < 0 ||
+			read(fd, data, st.st_size) != st.st_size ||
+			emu_add_file(emu, de->d_name, data, st.st_size) != 0) {
+			fprintf(stderr, "error: could not load %s into the emulator\n", path);
+			res = -1;
+		}
+		if (fd >= 0)
+			close(fd);
+		free(data);
+	}
+	closedir(d);
+	if (res == 0)
+		emu_load_index(emu, dir);
+	return res;
+}
+
+/*
+ * Make dir hold exactly the files in flash: write them all and remove
+ * files with valid NXT names that are no longer there
+ */
+int emu_save_dir(Emu *emu, const char *dir) {
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+	int i, fd, res = 0;
+
+	for (i = 0; i < emu->count; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, emu->files[i]->name);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 ||
+			write(fd, emu->files[i]->data, emu->files[i]->size) != emu->files[i]->size) {
+			fprintf(stderr, "error: could not save %s from the emulator\n", path);
+			res = -1;
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+	if (emu_save_index(emu, dir) != 0)
+		res = -1;
+	if ((d = opendir(dir)) == NULL) {
+		fprintf(stderr, "error: could not open emulator directory %s\n", dir);
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (emu_valid_name(de->d_name) && emu_find_file(emu, de->d_name) < 0) {
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			unlink(path);
+		}
+	}
+	closedir(d);
+	return res;
+}
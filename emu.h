@@ -0,0 +1,75 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EMU_H
+#define EMU_H
+
+#include <limits.h>
+#include <stddef.h>
+
+/*
+ * Software NXT brick for benchmarks and testing without hardware. It
+ * keeps a flash file table and implements the file, program and info
+ * commands nxtctl uses, including the handle limit and the error codes
+ * of the firmware. Files occupy flash pages, linear files a contiguous
+ * run of them, so deleting files fragments the flash like on the brick.
+ * The emulated link is USB by default: requests and replies are at
+ * most EMU_PACKET_SIZE bytes, larger requests fail with ILLEGAL_SIZE.
+ * The packet option raises the limit like other links. A started
+ * program echoes the messages written to inbox n to mailbox n + 10,
+ * the sensor ports read synthetic values.
+ *
+ * The link delays every reply by rtt plus the time the packets take at
+ * the configured bandwidth. For fault injection a share of the packets
+ * can be lost, and the brick can stop answering after a number of
+ * packets as if it was unplugged.
+ */
+
+#define EMU_PACKET_SIZE 64
+#define EMU_MAX_HANDLES 16
+#define EMU_FLASH_SIZE  (128 * 1024)
+#define EMU_FLASH_MAX   (16 * 1024 * 1024)
+
+typedef struct {
+	unsigned int rtt;			/* usec from request to reply */
+	unsigned int bandwidth;		/* bytes per second, 0: unlimited */
+	unsigned int loss;			/* lost packets per 1000 */
+	unsigned long fail;			/* stop answering after n packets, 0: never */
+	unsigned int seed;			/* for the packet loss */
+	unsigned int max_handles;
+	unsigned int flash_size;
+	unsigned int packet;		/* largest request and reply */
+	char dir[PATH_MAX];			/* flash contents are kept here, "" if not */
+	char program[20];			/* running from the start, "" if none */
+} EmuConfig;
+
+typedef struct emu Emu;
+struct nxt;
+
+void emu_config_init(EmuConfig *config);
+int emu_config_parse(EmuConfig *config, const char *options);
+Emu* emu_new(const EmuConfig *config);
+void emu_free(Emu *emu);
+int emu_add_file(Emu *emu, const char *name, const unsigned char *data, unsigned int size);
+int emu_packet(Emu *emu, const unsigned char *req, size_t len,
+			   unsigned char *reply, size_t size);
+int emu_serve(Emu *emu, int fd);
+int emu_load_dir(Emu *emu, const char *dir);
+int emu_save_dir(Emu *emu, const char *dir);
+int emu_link_open(struct nxt *nxt, const char *options);
+
+#endif
@@ -0,0 +1,293 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fio.h"
+
+static int fio_write_full(int fd, const unsigned char *data, size_t len) {
+	ssize_t nw;
+
+	while (len > 0) {
+		nw = write(fd, data, len);
+		if (nw < 0 && errno == EINTR)
+			continue;
+		if (nw <= 0)
+			return -1;
+		data += nw;
+		len -= nw;
+	}
+	return 0;
+}
+
+/*
+ * Read everything from fd into memory
+ */
+static int fio_slurp(FileSource *src, int fd) {
+	size_t size = FIO_BLOCK_SIZE;
+	ssize_t nr;
+
+	src->size = 0;
+	if ((src->data = malloc(size)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (;;) {
+		if (src->size == size) {
+			size *= 2;
+			if ((src->data = realloc(src->data, size)) == NULL) {
+				fprintf(stderr, "malloc failed\n");
+				exit(1);
+			}
+		}
+		nr = read(fd, src->data + src->size, size - src->size);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr < 0) {
+			free(src->data);
+			src->data = NULL;
+			return -1;
+		}
+		if (nr == 0)
+			break;
+		src->size += nr;
+	}
+	return 0;
+}
+
+/*
+ * Open path for upload, "-" reads stdin. Regular files are mapped,
+ * everything else is read into memory since the size has to be known
+ * before the transfer starts.
+ */
+int fio_source_open(FileSource *src, const char *path) {
+	struct stat sb;
+	int fd;
+
+	memset(src, 0, sizeof(*src));
+	if (strcmp(path, "-") == 0) {
+		src->name = "stdin";
+		fd = STDIN_FILENO;
+	} else {
+		src->name = path;
+		if ((fd = open(path, O_RDONLY)) < 0) {
+			fprintf(stderr, "error: could not open local file %s\n", path);
+			return -1;
+		}
+	}
+
+	if (fd != STDIN_FILENO && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode))
+		src->mtime = sb.st_mtime;
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		src->data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (src->data != MAP_FAILED) {
+			src->size = sb.st_size;
+			src->mapped = 1;
+		} else {
+			src->data = NULL;
+		}
+	}
+	if (!src->mapped && fio_slurp(src, fd) != 0) {
+		fprintf(stderr, "error: could not read %s\n", src->name);
+		if (fd != STDIN_FILENO)
+			close(fd);
+		return -1;
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return 0;
+}
+
+void fio_source_close(FileSource *src) {
+	if (src->mapped)
+		munmap(src->data, src->size);
+	else
+		free(src->data);
+	src->data = NULL;
+}
+
+/*
+ * Create path for download with mode, before the umask, "-" writes to
+ * stdout. Existing files are never overwritten.
+ */
+int fio_sink_open(FileSink *sink, const char *path, long sync, mode_t mode) {
+	struct stat sb;
+
+	memset(sink, 0, sizeof(*sink));
+	if (strcmp(path, "-") == 0) {
+		sink->name = "stdout";
+		sink->fd = STDOUT_FILENO;
+	} else {
+		sink->name = path;
+		sink->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+		if (sink->fd < 0) {
+			fprintf(stderr, "error: could not open local file %s\n", path);
+			return -1;
+		}
+	}
+	sink->regular = fstat(sink->fd, &sb) == 0 && S_ISREG(sb.st_mode);
+	sink->sync = sync;
+	if ((sink->buf = malloc(FIO_BLOCK_SIZE)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	return 0;
+}
+
+/*
+ * Continue writing the partial file at path, which holds the first skip
+ * bytes of the download already. Those bytes are not written again but
+ * compared with the data coming in, expect points to a copy of them.
+ */
+int fio_sink_open_resume(FileSink *sink, const char *path, long sync,
+						 const unsigned char *expect, size_t skip) {
+	memset(sink, 0, sizeof(*sink));
+	sink->name = path;
+	sink->fd = open(path, O_WRONLY | O_CREAT, 0777);
+	if (sink->fd < 0 || ftruncate(sink->fd, skip) != 0 ||
+		lseek(sink->fd, skip, SEEK_SET) < 0) {
+		fprintf(stderr, "error: could not open local file %s\n", path);
+		if (sink->fd >= 0)
+			close(sink->fd);
+		return -1;
+	}
+	sink->regular = 1;
+	sink->sync = sync;
+	sink->expect = expect;
+	sink->skip = skip;
+	if ((sink->buf = malloc(FIO_BLOCK_SIZE)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	return 0;
+}
+
+/*
+ * Write out what is buffered, for readers waiting at the other end
+ */
+int fio_sink_flush(FileSink *sink) {
+	if (sink->len == 0)
+		return 0;
+	if (fio_write_full(sink->fd, sink->buf, sink->len) != 0) {
+		fprintf(stderr, "error: could not write %s: %s\n", sink->name, strerror(errno));
+		return -1;
+	}
+	sink->unsynced += sink->len;
+	sink->len = 0;
+	if (sink->regular && sink->sync > 0 && sink->unsynced >= sink->sync) {
+		if (fsync(sink->fd) != 0) {
+			fprintf(stderr, "error: could not sync %s\n", sink->name);
+			return -1;
+		}
+		sink->unsynced = 0;
+	}
+	return 0;
+}
+
+int fio_sink_write(FileSink *sink, const void *data, size_t len) {
+	size_t n;
+
+	if (sink->skip > 0) {
+		n = len < sink->skip ? len : sink->skip;
+		if (memcmp(data, sink->expect, n) != 0) {
+			fprintf(stderr, "error: %s does not match the remote file, remove it to start over\n",
+					sink->name);
+			return -1;
+		}
+		sink->expect += n;
+		sink->skip -= n;
+		data = (const unsigned char *) data + n;
+		len -= n;
+		if (len == 0)
+			return 0;
+	}
+	if (sink->hash)
+		*sink->hash = fio_hash(*sink->hash, data, len);
+	if (sink->len + len > FIO_BLOCK_SIZE && fio_sink_flush(sink) != 0)
+		return -1;
+	if (len >= FIO_BLOCK_SIZE) {
+		if (fio_write_full(sink->fd, data, len) != 0) {
+			fprintf(stderr, "error: could not write %s: %s\n", sink->name, strerror(errno));
+			return -1;
+		}
+		sink->unsynced += len;
+		return 0;
+	}
+	memcpy(sink->buf + sink->len, data, len);
+	sink->len += len;
+	return 0;
+}
+
+/*
+ * Flush, sync according to the policy and close the sink
+ */
+int fio_sink_close(FileSink *sink) {
+	int res;
+
+	res = fio_sink_flush(sink);
+	if (res == 0 && sink->regular && sink->sync != FIO_SYNC_NONE &&
+		sink->unsynced > 0 && fsync(sink->fd) != 0) {
+		fprintf(stderr, "error: could not sync %s\n", sink->name);
+		res = -1;
+	}
+	if (sink->fd != STDOUT_FILENO && close(sink->fd) != 0)
+		res = -1;
+	free(sink->buf);
+	sink->buf = NULL;
+	return res;
+}
+
+/*
+ * Parse a fsync policy: "none", "end" or a number of bytes
+ */
+int fio_parse_sync(const char *s, long *sync) {
+	char *end;
+
+	if (strcmp(s, "none") == 0) {
+		*sync = FIO_SYNC_NONE;
+	} else if (strcmp(s, "end") == 0) {
+		*sync = FIO_SYNC_END;
+	} else {
+		*sync = strtol(s, &end, 10);
+		if (*end != 0 || *sync <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * 64 bit FNV-1a hash of data, continuing from hash
+ */
+uint64_t fio_hash(uint64_t hash, const void *data, size_t len) {
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
@@ -0,0 +1,75 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FIO_H
+#define FIO_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* buffered output is written out in blocks of this size */
+#define FIO_BLOCK_SIZE (64 * 1024)
+
+/* fsync policies, positive values mean fsync every n bytes */
+#define FIO_SYNC_NONE 0
+#define FIO_SYNC_END  (-1)
+
+/* start value of fio_hash */
+#define FIO_HASH_INIT 0xcbf29ce484222325ULL
+
+/*
+ * Upload source. The whole content is available at data, either
+ * mmap'ed or read into memory for stdin and other non-regular files.
+ */
+typedef struct {
+	const char *name;
+	unsigned char *data;
+	size_t size;
+	int mapped;
+	time_t mtime;	/* of a named regular file, else 0 */
+} FileSource;
+
+/*
+ * Download sink coalescing small writes into large blocks
+ */
+typedef struct {
+	const char *name;
+	int fd;
+	int regular;	/* fsync makes sense */
+	long sync;		/* fsync policy */
+	unsigned char *buf;
+	size_t len;
+	unsigned long unsynced;
+	const unsigned char *expect;	/* data already in the file when resuming */
+	size_t skip;					/* bytes left to compare against expect */
+	uint64_t *hash;					/* fio_hash of the data written, if set */
+} FileSink;
+
+int fio_source_open(FileSource *src, const char *path);
+void fio_source_close(FileSource *src);
+int fio_sink_open(FileSink *sink, const char *path, long sync, mode_t mode);
+int fio_sink_open_resume(FileSink *sink, const char *path, long sync,
+						 const unsigned char *expect, size_t skip);
+int fio_sink_write(FileSink *sink, const void *data, size_t len);
+int fio_sink_flush(FileSink *sink);
+int fio_sink_close(FileSink *sink);
+int fio_parse_sync(const char *s, long *sync);
+uint64_t fio_hash(uint64_t hash, const void *data, size_t len);
+
+#endif
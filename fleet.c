@@ -0,0 +1,339 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <libusb.h>
+#include "fleet.h"
+
+#define FLEET_MAX_JOBS 64
+
+enum {
+	BRICK_PENDING,
+	BRICK_OK,
+	BRICK_FAILED,
+	BRICK_SKIPPED
+};
+
+/* how far a brick is selected before it is opened */
+enum {
+	SELECT_NO,
+	SELECT_YES,
+	SELECT_NAME		/* only its name can tell */
+};
+
+typedef struct {
+	struct libusb_device *dev;
+	char path[32];
+	char serial[32];	/* usb serial number, the bluetooth address */
+	NXTInfo info;
+	int select;
+	int state;
+	double elapsed;
+} Brick;
+
+typedef struct {
+	Brick *bricks;
+	int count;
+	int next;
+	const char *selector;
+	fleet_fn fn;
+	void *arg;
+	pthread_mutex_t lock;
+} Fleet;
+
+/*
+ * Build the bus path of a device, e.g. "1-2.4" for bus 1, port 2,
+ * port 4 of the hub connected there.
+ */
+static void fleet_bus_path(struct libusb_device *dev, char *s, size_t len) {
+	uint8_t ports[8];
+	int i, n;
+	size_t off;
+
+	off = snprintf(s, len, "%u", libusb_get_bus_number(dev));
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (i = 0; i < n && off < len; i++)
+		off += snprintf(s + off, len - off, "%c%u", i ? '.' : '-', ports[i]);
+}
+
+/*
+ * The usb serial number of a brick is its bluetooth address as 12 hex
+ * digits. Reading it opens the device but neither resets it nor claims
+ * the interface. Left empty if it can not be read.
+ */
+static void fleet_serial(Brick *brick) {
+	struct libusb_device_descriptor desc;
+	struct libusb_device_handle *handle;
+
+	brick->serial[0] = 0;
+	if (libusb_get_device_descriptor(brick->dev, &desc) != 0 || desc.iSerialNumber == 0 ||
+		libusb_open(brick->dev, &handle) != 0)
+		return;
+	if (libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+										   (unsigned char*) brick->serial,
+										   sizeof(brick->serial)) < 0)
+		brick->serial[0] = 0;
+	libusb_close(handle);
+}
+
+/*
+ * Compare a bluetooth address like 00:16:53:0a:0b:0c, optionally with
+ * the trailing pad byte, with a usb serial number
+ */
+static int fleet_serial_match(const char *token, const char *serial) {
+	size_t i, n = 0;
+
+	if (strlen(token) != 17 && strlen(token) != 20)
+		return 0;
+	for (i = 0; i < 17; i++) {
+		if (i % 3 == 2) {
+			if (token[i] != ':')
+				return 0;
+		} else if (serial[n] == 0 || tolower((unsigned char) token[i]) !=
+				   tolower((unsigned char) serial[n++])) {
+			return 0;
+		}
+	}
+	return serial[n] == 0;
+}
+
+static int fleet_is_address(const char *token) {
+	return (strlen(token) == 17 || strlen(token) == 20) && token[2] == ':';
+}
+
+static int fleet_is_path(const char *token) {
+	return strspn(token, "0123456789") > 0 && strchr(token, '-') != NULL &&
+		strspn(token, "0123456789-.") == strlen(token);
+}
+
+/*
+ * Select a brick by what is known without opening it: "all", its bus
+ * path and its bluetooth address if the serial number was read. Only
+ * bricks a brick name may still select are opened to ask for it.
+ */
+static int fleet_preselect(const char *selector, Brick *brick) {
+	char *list, *token, *last;
+	int select = SELECT_NO;
+
+	if ((list = strdup(selector)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (token = strtok_r(list, ",", &last); token && select != SELECT_YES;
+		 token = strtok_r(NULL, ",", &last)) {
+		if (strcmp(token, "all") == 0 || strcmp(token, brick->path) == 0 ||
+			(brick->serial[0] && fleet_serial_match(token, brick->serial)))
+			select = SELECT_YES;
+		else if (fleet_is_path(token) || (brick->serial[0] && fleet_is_address(token)))
+			continue;
+		else
+			select = SELECT_NAME;
+	}
+	free(list);
+	return select;
+}
+
+/*
+ * selector is a comma separated list of "all", bus paths, brick
+ * names or bluetooth addresses.
+ */
+static int fleet_match(const char *selector, Brick *brick) {
+	char *list, *token, *last;
+	char btaddr[32];
+	int match = 0;
+
+	if ((list = strdup(selector)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	nxt_format_btaddr(&brick->info, btaddr, sizeof(btaddr));
+	for (token = strtok_r(list, ",", &last); token && !match;
+		 token = strtok_r(NULL, ",", &last)) {
+		if (strcmp(token, "all") == 0 ||
+			strcmp(token, brick->path) == 0 ||
+			strcmp(token, brick->info.name) == 0 ||
+			strcasecmp(token, btaddr) == 0 ||
+			/* address without the trailing pad byte */
+			(strlen(token) == 17 && strncasecmp(token, btaddr, 17) == 0))
+			match = 1;
+	}
+	free(list);
+	return match;
+}
+
+static void fleet_service(Fleet *fleet, Brick *brick) {
+	NXT *nxt;
+	double start;
+
+	if (brick->select == SELECT_NO)
+		return;
+	start = nxt_clock();
+	nxt = nxt_new();
+	if (nxt_init_device(nxt, brick->dev) != 0 ||
+		nxt_get_device_info(nxt, &brick->info) != 0) {
+		if (brick->select == SELECT_YES) {
+			brick->state = BRICK_FAILED;
+		} else {
+			/* it may not have been meant at all */
+			fprintf(stderr, "warning: skipping brick %s, its name could not be read\n",
+					brick->path);
+			brick->state = BRICK_SKIPPED;
+		}
+	} else if (brick->select == SELECT_NAME && !fleet_match(fleet->selector, brick)) {
+		brick->state = BRICK_SKIPPED;
+	} else if (fleet->fn(nxt, brick->path, fleet->arg) != 0) {
+		brick->state = BRICK_FAILED;
+	} else {
+		brick->state = BRICK_OK;
+	}
+	nxt_close(nxt);
+	brick->elapsed = nxt_clock() - start;
+}
+
+static void* fleet_worker(void *arg) {
+	Fleet *fleet = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&fleet->lock);
+		i = fleet->next++;
+		pthread_mutex_unlock(&fleet->lock);
+		if (i >= fleet->count)
+			break;
+		fleet_service(fleet, &fleet->bricks[i]);
+	}
+	return NULL;
+}
+
+static void fleet_summary(Fleet *fleet) {
+	static const char *states[] = { "pending", "ok", "FAILED", "skipped" };
+	char btaddr[32];
+	Brick *brick;
+	int i;
+
+	printf("%-12s %-15s %-21s %-8s %s\n",
+		   "bus path", "name", "bluetooth address", "status", "time");
+	for (i = 0; i < fleet->count; i++) {
+		brick = &fleet->bricks[i];
+		if (brick->state == BRICK_SKIPPED)
+			continue;
+		nxt_format_btaddr(&brick->info, btaddr, sizeof(btaddr));
+		printf("%-12s %-15s %-21s %-8s %.2fs\n",
+			   brick->path, brick->info.name, btaddr,
+			   states[brick->state], brick->elapsed);
+	}
+}
+
+/*
+ * Run fn on every NXT matching selector with at most jobs bricks
+ * serviced concurrently. Returns the number of failed bricks or -1 if
+ * no brick matched.
+ */
+int fleet_run(const char *selector, int jobs, fleet_fn fn, void *arg) {
+	pthread_t threads[FLEET_MAX_JOBS];
+	struct libusb_device **list;
+	Fleet fleet;
+	Brick *brick;
+	ssize_t n;
+	int i, failed = 0, selected = 0, candidates = 0;
+
+	if (libusb_init(NULL) != 0) {
+		fprintf(stderr, "libusb_init failed\n");
+		return -1;
+	}
+	if ((n = libusb_get_device_list(NULL, &list)) < 0) {
+		fprintf(stderr, "could not get usb device list\n");
+		return -1;
+	}
+
+	memset(&fleet, 0, sizeof(fleet));
+	if ((fleet.bricks = calloc(n + 1, sizeof(Brick))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		if (!nxt_is_device(list[i]))
+			continue;
+		brick = &fleet.bricks[fleet.count++];
+		brick->dev = list[i];
+		fleet_bus_path(list[i], brick->path, sizeof(brick->path));
+		fleet_serial(brick);
+		if ((brick->select = fleet_preselect(selector, brick)) == SELECT_NO)
+			brick->state = BRICK_SKIPPED;
+		else
+			candidates++;
+	}
+	if (fleet.count == 0) {
+		fprintf(stderr, "no NXT device found\n");
+		libusb_free_device_list(list, 1);
+		free(fleet.bricks);
+		return -1;
+	}
+
+	fleet.selector = selector;
+	fleet.fn = fn;
+	fleet.arg = arg;
+	pthread_mutex_init(&fleet.lock, NULL);
+
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > FLEET_MAX_JOBS)
+		jobs = FLEET_MAX_JOBS;
+	if (jobs > candidates)
+		jobs = candidates;
+
+	/* keep output of concurrent bricks from tearing lines */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, fleet_worker, &fleet) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			jobs = i;
+			break;
+		}
+	}
+	/* no thread could be started, do the work ourselves */
+	if (jobs == 0 && candidates > 0)
+		fleet_worker(&fleet);
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < fleet.count; i++) {
+		if (fleet.bricks[i].state == BRICK_FAILED)
+			failed++;
+		if (fleet.bricks[i].state != BRICK_SKIPPED)
+			selected++;
+	}
+	if (selected > 0)
+		fleet_summary(&fleet);
+
+	pthread_mutex_destroy(&fleet.lock);
+	libusb_free_device_list(list, 1);
+	free(fleet.bricks);
+
+	if (selected == 0) {
+		fprintf(stderr, "no NXT device matches %s\n", selector);
+		return -1;
+	}
+	return failed;
+}
@@ -15,22 +15,248 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/stat.h>
+
+#include <errno.h>
 #include <getopt.h>
+#include <glob.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include "archive.h"
+#include "batch.h"
+#include "cache.h"
+#include "fio.h"
+#include "fleet.h"
+#include "mbox.h"
+#include "plan.h"
+#include "sample.h"
+#include "sync.h"
 #include "nxt.h"
+#include "stats.h"
+#include "trace.h"
 
-int Bflag, bflag, dflag, fflag, gflag, iflag, lflag, pflag, vflag,
-	startflag, stopflag;
+int Bflag, bflag, cflag, dflag, fflag, gflag, iflag, kflag, lflag, pflag, rflag,
+	vflag, startflag, stopflag;
 char *filename;
+char *localfile;
+long fsync_policy = FIO_SYNC_NONE;
+int window = 0;	/* -w not given */
+int interval = 0;
+int resume = 0;
+unsigned short chunk_read, chunk_write;
+int chunk_probe;
+int linear = NXT_LINEAR_AUTO;
+char *selector;
+int jobs = 4;
+char *script;
+char *syncdir, *syncpattern;
+char *backupfile, *restorefile;
+int planflag, defragflag;
+char **planfiles;
+int plancount;
+char **mboxargv;
+int mboxargc;
+char **sampleargv;
+int sampleargc;
+char *tracefile;
+char *transport;
+glob_t putfiles;	/* local files for -p */
+
+enum {
+	OPT_STATS = 256,
+	OPT_RESUME,
+	OPT_CHUNK,
+	OPT_LINEAR
+};
+
+static const struct option longopts[] = {
+	{ "stats", optional_argument, NULL, OPT_STATS },
+	{ "resume", no_argument, NULL, OPT_RESUME },
+	{ "chunk", required_argument, NULL, OPT_CHUNK },
+	{ "linear", required_argument, NULL, OPT_LINEAR },
+	{ NULL, 0, NULL, 0 }
+};
+Batch *batch;
+
+/*
+ * Write the trace ring to the -T file. Without -T it is kept in
+ * ~/.nxtctl/last.trace after a failure for a post-mortem.
+ */
+static void save_trace(int failed) {
+	char path[PATH_MAX];
+
+	if (tracefile) {
+		if (trace_dump(tracefile) != 0)
+			fprintf(stderr, "error: could not write trace %s\n", tracefile);
+	} else if (failed && trace_count() > 0 &&
+			   cache_dir(path, sizeof(path), "last.trace", NULL) == 0 &&
+			   trace_dump(path) == 0) {
+		fprintf(stderr, "trace written to %s\n", path);
+	}
+}
+
+/*
+ * Run the command given on the command line. id is set in fleet mode
+ * and names the brick, downloads go to a directory of that name then.
+ */
+static int run_commands(NXT *nxt, const char *id, void *arg) {
+	char localname[PATH_MAX];
+	const char *pattern;
+	const char *archive;
+	int status = 0;
+
+	nxt->window = window;
+	nxt->interval = interval;
+	nxt->sync = fsync_policy;
+	nxt->resume = resume;
+	nxt->read_size = chunk_read;
+	nxt->write_size = chunk_write;
+	nxt->probe = chunk_probe;
+	nxt->linear = linear;
+
+	if (cflag && (nxt->cache = cache_open(nxt)) == NULL) {
+		fprintf(stderr, "error: could not open listing cache\n");
+		return -1;
+	}
+  
+	if (Bflag) {
+#if DANGEROUS
+		status += nxt_boot(nxt);
+#endif
+	}
+
+	if (bflag) {
+		status += nxt_print_battery_level(nxt);
+	}
+
+	if (dflag) {
+		if (!filename) {
+			fprintf(stderr, "error: filename is mandatory\n");
+			status = -1;
+		} else {
+			status += nxt_delete_file(nxt, filename);
+		}
+	}
+
+	if (fflag) {
+		status += nxt_print_firmware_version(nxt);
+	}
+
+	if (gflag) {
+		if (!filename) {
+			fprintf(stderr, "error: filename is mandatory\n");
+			status = -1;
+		} else {
+			if (id) {
+				if (mkdir(id, 0777) != 0 && errno != EEXIST) {
+					fprintf(stderr, "error: could not create directory %s\n", id);
+					return -1;
+				}
+				snprintf(localname, sizeof(localname), "%s/%s", id, filename);
+				status += strpbrk(filename, "*?") ?
+					nxt_get_files(nxt, filename, id) :
+					nxt_get_file_as(nxt, filename, localname);
+			} else if (strpbrk(filename, "*?")) {
+				status += nxt_get_files(nxt, filename, NULL);
+			} else if (localfile) {
+				status += nxt_get_file_as(nxt, filename, localfile);
+			} else {
+				status += nxt_get_file(nxt, filename);
+			}
+		}
+	}
+
+	if (pflag) {
+		if (!filename) {
+			fprintf(stderr, "error: filename is mandatory\n");
+			status = -1;
+		} else if (putfiles.gl_pathc > 1) {
+			status += nxt_put_files(nxt, putfiles.gl_pathv, putfiles.gl_pathc);
+		} else if (localfile) {
+			status += nxt_put_file_as(nxt, filename, localfile);
+		} else {
+			status += nxt_put_file(nxt, filename);
+		}
+	}
+
+	if (iflag) {
+		status += nxt_print_device_info(nxt);
+	}
+
+	if (lflag) {
+		pattern = filename ? filename : "*.rxe";
+		status += nxt_print_files(nxt, pattern);
+	}
+
+	if (startflag) {
+		if (!filename) {
+			fprintf(stderr, "error: filename is mandatory\n");
+			status = -1;
+		} else {
+			status += nxt_start_program(nxt, filename);
+		}
+	}
+
+	if (stopflag) {
+		status += nxt_stop_program(nxt);
+	}
+
+	if (batch) {
+		status += batch_run(nxt, batch, kflag, id);
+	}
+
+	if (syncdir) {
+		status += sync_run(nxt, syncdir, syncpattern, rflag);
+	}
+
+	/* in fleet mode every brick has its own archive in its directory */
+	if (backupfile || restorefile) {
+		archive = backupfile ? backupfile : restorefile;
+		if (id) {
+			if (backupfile && mkdir(id, 0777) != 0 && errno != EEXIST) {
+				fprintf(stderr, "error: could not create directory %s\n", id);
+				return -1;
+			}
+			snprintf(localname, sizeof(localname), "%s/%s", id,
+					 strcmp(archive, "-") == 0 ? "brick.tar" : archive);
+			archive = localname;
+		}
+		if (backupfile)
+			status += archive_backup(nxt, archive);
+		else
+			status += archive_restore(nxt, archive);
+	}
+
+	if (planflag || defragflag) {
+		status += plan_run(nxt, planfiles, plancount, defragflag);
+	}
+
+	if (mboxargv) {
+		status += mbox_run(nxt, mboxargv, mboxargc);
+	}
+
+	if (sampleargv) {
+		status += sample_run(nxt, sampleargv, sampleargc, localfile ? localfile : "-");
+	}
+
+	if (nxt->cache) {
+		status += cache_close(nxt, nxt->cache);
+		nxt->cache = NULL;
+	}
+
+	return status;
+}
 
 int main(int argc, char *argv[]){
-	int ch;
+	int ch, i;
 	int commands = 0;
 	int status = 0;
+	int stats = 0;
 
-	while ((ch = getopt(argc, argv, "BbdfghilpsSv")) != -1) {
+	while ((ch = getopt_long(argc, argv, "BbcdF:fghij:kln:o:prsSt:T:vw:x:y:",
+							 longopts, NULL)) != -1) {
 		switch (ch) {
 		case 'B':
 			Bflag = 1;
@@ -40,10 +266,16 @@ int main(int argc, char *argv[]){
 			bflag = 1;
 			commands++;
 			break;
+		case 'c':
+			cflag = 1;
+			break;
 		case 'd':
 			dflag = 1;
 			commands++;
 			break;
+		case 'F':
+			selector = optarg;
+			break;
 		case 'f':
 			fflag = 1;
 			commands++;
@@ -56,14 +288,37 @@ int main(int argc, char *argv[]){
 			iflag = 1;
 			commands++;
 			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, "error: invalid number of jobs %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'k':
+			kflag = 1;
+			break;
 		case 'l':
 			lflag = 1;
 			commands++;
 			break;
+		case 'n':
+			interval = atoi(optarg);
+			if (interval < 1) {
+				fprintf(stderr, "error: invalid check interval %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'o':
+			localfile = optarg;
+			break;
 		case 'p':
 			pflag = 1;
 			commands++;
 			break;
+		case 'r':
+			rflag = 1;
+			break;
 		case 's':
 			startflag = 1;
 			commands++;
@@ -72,118 +327,236 @@ int main(int argc, char *argv[]){
 			stopflag = 1;
 			commands++;
 			break;
+		case 't':
+			transport = optarg;
+			break;
+		case 'T':
+			tracefile = optarg;
+			break;
 		case 'v':
 			vflag++;
 			break;
+		case 'w':
+			window = atoi(optarg);
+			if (window < 1) {
+				fprintf(stderr, "error: invalid window size %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'x':
+			script = optarg;
+			commands++;
+			break;
+		case 'y':
+			if (fio_parse_sync(optarg, &fsync_policy) != 0) {
+				fprintf(stderr, "error: invalid fsync policy %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_STATS:
+			if (!optarg || strcmp(optarg, "table") == 0) {
+				stats = STATS_TABLE;
+			} else if (strcmp(optarg, "json") == 0) {
+				stats = STATS_JSON;
+			} else {
+				fprintf(stderr, "error: invalid stats format %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_RESUME:
+			resume = 1;
+			break;
+		case OPT_CHUNK:
+			if (strcmp(optarg, "probe") == 0) {
+				chunk_probe = 1;
+			} else if (nxt_parse_chunk(optarg, &chunk_read, &chunk_write) != 0) {
+				fprintf(stderr, "error: invalid chunk sizes %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_LINEAR:
+			if (strcmp(optarg, "auto") == 0) {
+				linear = NXT_LINEAR_AUTO;
+			} else if (strcmp(optarg, "always") == 0) {
+				linear = NXT_LINEAR_ALWAYS;
+			} else if (strcmp(optarg, "never") == 0) {
+				linear = NXT_LINEAR_NEVER;
+			} else {
+				fprintf(stderr, "error: invalid linear mode %s\n", optarg);
+				exit(1);
+			}
+			break;
 		case 'h':
 		default:
 			(void)fprintf(stderr,
-                          "usage: nxtctl [-BbdfghilpsSv] [filename/pattern]\n"
+                          "usage: nxtctl [-BbcdfghiklprsSv] [-F bricks] [-j jobs] [-n chunks]\n"
+                          "              [-o localfile] [-t transport] [-T tracefile] [-w window]\n"
+                          "              [-x script] [-y sync] [--chunk read,write|probe]\n"
+                          "              [--linear auto|always|never] [--resume]\n"
+                          "              [--stats[=json]] [filename/pattern]\n"
+                          "       nxtctl [options] sync localdir [pattern]\n"
+                          "       nxtctl [options] backup|restore [archive]\n"
+                          "       nxtctl [options] plan|defrag [localfile ...]\n"
+                          "       nxtctl [options] mbox send|call inbox [message ...]\n"
+                          "       nxtctl [options] mbox recv [box ...]\n"
+                          "       nxtctl [options] mbox stream inbox [box ...]\n"
+                          "       nxtctl [options] sample [rate=hz,count=n,time=sec,format=csv|bin]\n"
+                          "              port:type[:mode] ...\n"
                           "        -B             boot (disabled by default)\n"
                           "        -b             print battery level\n"
+                          "        -c             use the host side listing cache\n"
                           "        -d [filename]  delete file\n"
+                          "        -F [bricks]    run on all bricks matching a comma separated\n"
+                          "                       list of bus paths, names, bluetooth addresses\n"
+                          "                       or \"all\"\n"
                           "        -f             print firmware version\n"
-                          "        -g [filename]  get file\n"
-                          "        -p [filename]  put file\n"
+                          "        -g [filename]  get file, or all files matching a pattern\n"
+                          "        -n [chunks]    check only every nth reply of -p and mbox writes\n"
+                          "        -o [localfile] local file for -g, -p and sample, - for stdout/stdin\n"
+                          "        -p [filename]  put file, or several files\n"
                           "        -i             print device info\n"
+                          "        -j [jobs]      bricks serviced in parallel with -F (default 4)\n"
+                          "        -k             keep going after failed steps with -x\n"
                           "        -l [pattern]   list files\n"
+                          "        -r             delete remote files missing locally with sync\n"
                           "        -s [filename]  start program\n"
                           "        -S             stop running program\n"
-                          "        -v             verbose debug output\n");
+                          "        -t [transport] usb, nxtd[:socket], serial:tty or emu[:options]\n"
+                          "                       instead of nxtd if running, else usb\n"
+                          "        -T [tracefile] write the transport trace to tracefile\n"
+                          "        -v             verbose debug output\n"
+                          "        -w [window]    requests in flight for -g, -p, mbox and sample\n"
+                          "        -x [script]    run commands from script, - for stdin\n"
+                          "        -y [sync]      fsync downloads: none, end or every n bytes\n"
+                          "        --chunk [read,write]\n"
+                          "                       READ and WRITE payload instead of the probed\n"
+                          "                       sizes, probe to probe again\n"
+                          "        --linear [mode] write -p files contiguously: auto for programs,\n"
+                          "                       sounds and images (default), always or never\n"
+                          "        --resume       continue interrupted -g and -p transfers\n"
+                          "        --stats[=json] print per command statistics on exit and\n"
+                          "                       progress of long transfers\n");
 			exit(1);
 			/* NOTREACHED */
 		}
 	}
 	argv += optind;
 	argc -= optind;
-	if (argc > 0 && argv[0]) {
+	if (argc > 0 && strcmp(argv[0], "sync") == 0) {
+		if (argc < 2 || argc > 3) {
+			fprintf(stderr, "error: usage: sync localdir [pattern]\n");
+			exit(1);
+		}
+		syncdir = argv[1];
+		syncpattern = argc > 2 ? argv[2] : NULL;
+		commands++;
+	} else if (argc > 0 && (strcmp(argv[0], "backup") == 0 ||
+							strcmp(argv[0], "restore") == 0)) {
+		if (argc > 2) {
+			fprintf(stderr, "error: usage: %s [archive]\n", argv[0]);
+			exit(1);
+		}
+		if (argv[0][0] == 'b')
+			backupfile = argc > 1 ? argv[1] : "-";
+		else
+			restorefile = argc > 1 ? argv[1] : "-";
+		commands++;
+	} else if (argc > 0 && (strcmp(argv[0], "plan") == 0 ||
+							strcmp(argv[0], "defrag") == 0)) {
+		if (argv[0][0] == 'p')
+			planflag = 1;
+		else
+			defragflag = 1;
+		planfiles = argv + 1;
+		plancount = argc - 1;
+		commands++;
+	} else if (argc > 0 && strcmp(argv[0], "mbox") == 0) {
+		mboxargv = argv + 1;
+		mboxargc = argc - 1;
+		commands++;
+	} else if (argc > 0 && strcmp(argv[0], "sample") == 0) {
+		sampleargv = argv + 1;
+		sampleargc = argc - 1;
+		commands++;
+	} else if (argc > 0 && argv[0]) {
 		filename = argv[0];
 	}
 
-	if (commands == 0) {
-		fprintf(stderr, "error: no command option given\n");
+	/* -p takes several files, or patterns the shell did not expand */
+	if (pflag) {
+		for (i = 0; i < argc; i++)
+			glob(argv[i], GLOB_NOCHECK | (i ? GLOB_APPEND : 0), NULL, &putfiles);
+		if (putfiles.gl_pathc == 1)
+			filename = putfiles.gl_pathv[0];
+	} else if (filename && argc > 1) {
+		fprintf(stderr, "error: only -p takes several files\n");
 		exit(1);
 	}
 
-	if (commands > 1) {
-		fprintf(stderr, "error: multiple command options given\n");
+	if (localfile && (putfiles.gl_pathc > 1 || (gflag && filename && strpbrk(filename, "*?")))) {
+		fprintf(stderr, "error: -o can not be used with several files\n");
 		exit(1);
 	}
 
-	if (filename && vflag) {
-		fprintf(stderr, "filename: %s argc: %d\n", filename, argc);
-	}
-	
-	NXT *nxt = nxt_new();
-	if (nxt_init(nxt) != 0) {
+	/* the journals of --resume are kept per local file */
+	if (resume && (putfiles.gl_pathc > 1 || (gflag && filename && strpbrk(filename, "*?")))) {
+		fprintf(stderr, "error: --resume can not be used with several files\n");
 		exit(1);
 	}
-  
-	if (Bflag) {
-#if DANGEROUS
-		status += nxt_boot(nxt);
-#endif
-	}
 
-	if (bflag) {
-		status += nxt_print_battery_level(nxt);
+	if (commands == 0) {
+		fprintf(stderr, "error: no command option given\n");
+		exit(1);
 	}
 
-	if (dflag) {
-		if (!filename) {
-			fprintf(stderr, "error: filename is mandatory\n");
-			status = -1;
-		} else {
-			status += nxt_delete_file(nxt, filename);
-		}
+	if (commands > 1) {
+		fprintf(stderr, "error: multiple command options given\n");
+		exit(1);
 	}
 
-	if (fflag) {
-		status += nxt_print_firmware_version(nxt);
+	if (localfile && selector) {
+		fprintf(stderr, "error: -o can not be used with -F\n");
+		exit(1);
 	}
 
-	if (gflag) {
-		if (!filename) {
-			fprintf(stderr, "error: filename is mandatory\n");
-			status = -1;
-		} else {
-			status += nxt_get_file(nxt, filename);
-		}
+	if ((mboxargv || sampleargv) && selector) {
+		fprintf(stderr, "error: %s can not be used with -F\n", mboxargv ? "mbox" : "sample");
+		exit(1);
 	}
 
-	if (pflag) {
-		if (!filename) {
-			fprintf(stderr, "error: filename is mandatory\n");
-			status = -1;
-		} else {
-			status += nxt_put_file(nxt, filename);
-		}
+	if (transport && selector) {
+		fprintf(stderr, "error: -t can not be used with -F\n");
+		exit(1);
 	}
 
-	if (iflag) {
-		status += nxt_print_device_info(nxt);
+	if (filename && vflag) {
+		fprintf(stderr, "filename: %s argc: %d\n", filename, argc);
 	}
-
-	if (lflag) {
-		if (! filename) {
-			filename = "*.rxe";
-		}
-		status += nxt_print_files(nxt, filename);
+	
+	if (script && (batch = batch_load(script)) == NULL) {
+		exit(1);
 	}
 
-	if (startflag) {
-		if (!filename) {
-			fprintf(stderr, "error: filename is mandatory\n");
-			status = -1;
-		} else {
-			status += nxt_start_program(nxt, filename);
-		}
+	/* progress lines of parallel bricks would overwrite each other */
+	if (stats)
+		stats_start(stats, !selector);
+
+	if (selector) {
+		status = fleet_run(selector, jobs, run_commands, NULL);
+		stats_print(stderr);
+		save_trace(status != 0);
+		return (status == 0) ? 0 : 1;
 	}
 
-	if (stopflag) {
-		status += nxt_stop_program(nxt);
+	NXT *nxt = nxt_new();
+	if ((transport ? nxt_init_transport(nxt, transport) : nxt_init(nxt)) != 0) {
+		save_trace(1);
+		exit(1);
 	}
+	status = run_commands(nxt, NULL, NULL);
 
 	nxt_close(nxt);
+	stats_print(stderr);
+	save_trace(status != 0);
 	return (status == 0) ? 0 : 1;
 }
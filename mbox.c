@@ -0,0 +1,501 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Mailbox messaging with the program running on the brick. The host
+ * writes to the inboxes 0-9 of the program with MESSAGE_WRITE and reads
+ * what the program sends to the mailboxes 10-19 with MESSAGE_READ. On
+ * the command line both are numbered 0-9.
+ *
+ *   send inbox [message ...]	write the messages, or the lines of stdin
+ *   recv [box ...]			print the waiting messages
+ *   call inbox [message ...]	write requests and wait for the answers
+ *   stream inbox [box ...]	lines of stdin to inbox, messages to stdout
+ *
+ * A sweep reads every mailbox with all MESSAGE_READs in flight, so it
+ * costs about one round trip however many mailboxes are read. Requests
+ * of call carry a correlation id: "<id> message" goes to the inbox and
+ * the program answers "<id> answer" in the mailbox of the same number.
+ * Answers may arrive in any order, they are printed in request order.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mbox.h"
+
+/* messages the firmware keeps per mailbox, more get lost */
+#define MBOX_QUEUE   5
+/* lines of stdin written at once */
+#define MBOX_BATCH   64
+/* msec between sweeps while nothing happens */
+#define MBOX_POLL    10
+/* sec call waits for an answer */
+#define MBOX_TIMEOUT 5.0
+
+typedef struct {
+	char buf[4096];
+	size_t len;
+	int eof;
+	char line[MBOX_BATCH][NXT_MESSAGE_MAX + 1];
+	char *lines[MBOX_BATCH];
+} MboxInput;
+
+typedef struct {
+	NXT *nxt;
+	int boxes[NXT_MAILBOXES];	/* mailboxes 10-19 read */
+	int count;
+	int hit[2 * NXT_MAILBOXES];	/* got a message in the last sweep */
+	unsigned long sent;
+	unsigned long received;
+	double start;
+	/* call */
+	char **answers;				/* per request, NULL until answered */
+	int calls;
+	int answered;
+} Mbox;
+
+static int mbox_number(const char *s, int *box) {
+	char *end;
+	long n;
+
+	n = strtol(s, &end, 10);
+	if (s[0] == 0 || *end || n < 0 || n >= NXT_MAILBOXES) {
+		fprintf(stderr, "error: mailbox %s out of range 0-%d\n", s, NXT_MAILBOXES - 1);
+		return -1;
+	}
+	*box = n;
+	return 0;
+}
+
+/*
+ * Mailboxes to read from the arguments, all of them if there are none
+ */
+static int mbox_boxes(Mbox *m, char *const *argv, int argc) {
+	int i;
+
+	if (argc > NXT_MAILBOXES) {
+		fprintf(stderr, "error: too many mailboxes\n");
+		return -1;
+	}
+	m->count = argc ? argc : NXT_MAILBOXES;
+	for (i = 0; i < m->count; i++) {
+		if (!argc)
+			m->boxes[i] = i;
+		else if (mbox_number(argv[i], &m->boxes[i]) != 0)
+			return -1;
+		m->boxes[i] += NXT_MAILBOXES;
+	}
+	return 0;
+}
+
+static int mbox_check(char *const *messages, int count) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (strlen(messages[i]) > NXT_MESSAGE_MAX) {
+			fprintf(stderr, "error: message longer than %d bytes: %s\n",
+					NXT_MESSAGE_MAX, messages[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read what is available on stdin, waiting up to timeout msec (-1:
+ * forever). Returns 1 if data or the end arrived, 0 if not and -1 on
+ * error.
+ */
+static int mbox_input_fill(MboxInput *in, int timeout) {
+	struct pollfd pfd;
+	ssize_t n;
+
+	if (in->eof || in->len == sizeof(in->buf))
+		return 0;
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) <= 0)
+		return 0;
+	if ((n = read(STDIN_FILENO, in->buf + in->len, sizeof(in->buf) - in->len)) < 0) {
+		if (errno == EINTR)
+			return 0;
+		fprintf(stderr, "error: could not read stdin\n");
+		return -1;
+	}
+	if (n == 0)
+		in->eof = 1;
+	in->len += n;
+	return 1;
+}
+
+/*
+ * Move the next line of stdin to line, the last one may lack the
+ * newline. Returns 1 if there was one, 0 if not and -1 if it is too
+ * long for a message.
+ */
+static int mbox_input_line(MboxInput *in, char *line) {
+	char *nl;
+	size_t len, skip;
+
+	if ((nl = memchr(in->buf, '\n', in->len)) != NULL) {
+		len = nl - in->buf;
+		skip = len + 1;
+	} else if ((in->eof && in->len > 0) || in->len == sizeof(in->buf)) {
+		len = skip = in->len;
+	} else {
+		return 0;
+	}
+	if (len > NXT_MESSAGE_MAX) {
+		fprintf(stderr, "error: line longer than %d bytes\n", NXT_MESSAGE_MAX);
+		return -1;
+	}
+	memcpy(line, in->buf, len);
+	line[len] = 0;
+	memmove(in->buf, in->buf + skip, in->len - skip);
+	in->len -= skip;
+	return 1;
+}
+
+/*
+ * Collect up to MBOX_BATCH lines of stdin in in->lines, waiting up to
+ * timeout msec for the first one. Returns the number of lines or -1 on
+ * error.
+ */
+static int mbox_input_batch(MboxInput *in, int timeout) {
+	int n = 0, res;
+
+	while (n < MBOX_BATCH) {
+		if ((res = mbox_input_line(in, in->line[n])) < 0)
+			return -1;
+		if (res) {
+			in->lines[n] = in->line[n];
+			n++;
+			continue;
+		}
+		if ((res = mbox_input_fill(in, n ? 0 : timeout)) < 0)
+			return -1;
+		if (res == 0)
+			break;
+	}
+	return n;
+}
+
+static int mbox_write(Mbox *m, int inbox, char *const *messages, int count) {
+	if (count == 0)
+		return 0;
+	if (nxt_message_write(m->nxt, inbox, messages, count) != 0)
+		return -1;
+	m->sent += count;
+	return 0;
+}
+
+static int mbox_print(int box, const char *message, size_t len, void *arg) {
+	Mbox *m = arg;
+
+	m->hit[box] = 1;
+	m->received++;
+	if (m->count > 1)
+		printf("%d ", box - NXT_MAILBOXES);
+	fwrite(message, 1, len, stdout);
+	putchar('\n');
+	return 0;
+}
+
+/*
+ * Read one message from each mailbox in boxes
+ */
+static int mbox_sweep(Mbox *m, const int *boxes, int count, nxt_message_fn fn) {
+	int res;
+
+	memset(m->hit, 0, sizeof(m->hit));
+	res = nxt_message_poll(m->nxt, boxes, count, 1, fn, m);
+	fflush(stdout);
+	return res;
+}
+
+static int mbox_send(Mbox *m, char *const *argv, int argc) {
+	MboxInput *in;
+	int inbox, n;
+
+	if (argc < 1) {
+		fprintf(stderr, "error: usage: mbox send inbox [message ...]\n");
+		return -1;
+	}
+	if (mbox_number(argv[0], &inbox) != 0)
+		return -1;
+	if (argc > 1)
+		return mbox_check(argv + 1, argc - 1) == 0 ?
+			mbox_write(m, inbox, argv + 1, argc - 1) : -1;
+
+	if ((in = calloc(1, sizeof(MboxInput))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	while ((n = mbox_input_batch(in, -1)) > 0)
+		if (mbox_write(m, inbox, in->lines, n) != 0)
+			break;
+	free(in);
+	return n == 0 ? 0 : -1;
+}
+
+/*
+ * Sweep the mailboxes until they are empty, reading again only those
+ * that had a message.
+ */
+static int mbox_recv(Mbox *m, char *const *argv, int argc) {
+	int boxes[NXT_MAILBOXES];
+	int i, count, res;
+
+	if (mbox_boxes(m, argv, argc) != 0)
+		return -1;
+	memcpy(boxes, m->boxes, sizeof(boxes));
+	count = m->count;
+	while (count > 0) {
+		if ((res = mbox_sweep(m, boxes, count, mbox_print)) < 0)
+			return -1;
+		for (i = count = 0; i < m->count; i++)
+			if (m->hit[m->boxes[i]])
+				boxes[count++] = m->boxes[i];
+	}
+	return 0;
+}
+
+static int mbox_stream(Mbox *m, char *const *argv, int argc) {
+	MboxInput *in;
+	int inbox, n = 0, res = 0, idle = 0;
+	double progress;
+
+	if (argc < 1) {
+		fprintf(stderr, "error: usage: mbox stream inbox [box ...]\n");
+		return -1;
+	}
+	if (mbox_number(argv[0], &inbox) != 0 ||
+		mbox_boxes(m, argc > 1 ? argv + 1 : argv, argc > 1 ? argc - 1 : 1) != 0)
+		return -1;
+	if ((in = calloc(1, sizeof(MboxInput))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	/*
+	 * Waiting for stdin is the pause between idle sweeps. After the
+	 * end of stdin the program may still be answering the last lines,
+	 * so the sweeps go on until MBOX_TIMEOUT passes without a message.
+	 */
+	progress = nxt_clock();
+	for (;;) {
+		if ((n = mbox_input_batch(in, idle ? MBOX_POLL : 0)) < 0 ||
+			mbox_write(m, inbox, in->lines, n) != 0 ||
+			(res = mbox_sweep(m, m->boxes, m->count, mbox_print)) < 0) {
+			res = -1;
+			break;
+		}
+		if (n > 0 || res > 0)
+			progress = nxt_clock();
+		idle = n == 0 && res == 0;
+		if (in->eof && in->len == 0 && idle) {
+			if (nxt_clock() - progress > MBOX_TIMEOUT)
+				break;
+			fflush(stdout);
+			poll(NULL, 0, MBOX_POLL);
+		}
+	}
+	free(in);
+	return res < 0 ? -1 : 0;
+}
+
+/*
+ * Keep the answer to its request, answers to other or earlier requests
+ * are dropped
+ */
+static int mbox_answer(int box, const char *message, size_t len, void *arg) {
+	Mbox *m = arg;
+	unsigned long id = 0;
+	size_t i;
+
+	m->received++;
+	for (i = 0; i < len && message[i] >= '0' && message[i] <= '9'; i++)
+		id = id * 10 + message[i] - '0';
+	if (i == 0 || i > 9 || (i < len && message[i] != ' ') ||
+		id < 1 || id > m->sent || m->answers[id - 1] != NULL) {
+		fprintf(stderr, "warning: dropping unexpected message %.*s\n", (int) len, message);
+		return 0;
+	}
+	if (i < len)
+		i++;
+	if ((m->answers[id - 1] = malloc(len - i + 1)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	memcpy(m->answers[id - 1], message + i, len - i);
+	m->answers[id - 1][len - i] = 0;
+	m->answered++;
+	return 0;
+}
+
+static int mbox_discard(int box, const char *message, size_t len, void *arg) {
+	Mbox *m = arg;
+
+	m->hit[box] = 1;
+	return 0;
+}
+
+/*
+ * Requests are numbered from 1. Up to -w of them wait for an answer at
+ * once, at most as many as a mailbox holds, and a sweep reads the
+ * answer mailbox once for every one of them.
+ */
+static int mbox_call(Mbox *m, char *const *argv, int argc) {
+	MboxInput *in = NULL;
+	char **requests = NULL, msg[NXT_MESSAGE_MAX + 1];
+	char *batch[MBOX_QUEUE];
+	int boxes[MBOX_QUEUE];
+	int inbox, i, n, window, printed = 0, res = 0;
+	double progress;
+
+	if (argc < 1) {
+		fprintf(stderr, "error: usage: mbox call inbox [message ...]\n");
+		return -1;
+	}
+	if (mbox_number(argv[0], &inbox) != 0)
+		return -1;
+	if (argc > 1) {
+		m->calls = argc - 1;
+		requests = (char**) argv + 1;
+	} else {
+		if ((in = calloc(1, sizeof(MboxInput))) == NULL) {
+			fprintf(stderr, "malloc failed\n");
+			exit(1);
+		}
+		while ((n = mbox_input_batch(in, -1)) > 0) {
+			if ((requests = realloc(requests, (m->calls + n) * sizeof(char*))) == NULL) {
+				fprintf(stderr, "malloc failed\n");
+				exit(1);
+			}
+			for (i = 0; i < n; i++)
+				if ((requests[m->calls++] = strdup(in->lines[i])) == NULL) {
+					fprintf(stderr, "malloc failed\n");
+					exit(1);
+				}
+		}
+		free(in);
+		if (n < 0)
+			res = -1;
+	}
+	if ((m->answers = calloc(m->calls ? m->calls : 1, sizeof(char*))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	window = m->nxt->window < MBOX_QUEUE ? m->nxt->window : MBOX_QUEUE;
+	if (window < 1)
+		window = 1;
+	for (i = 0; i < window; i++)
+		boxes[i] = inbox + NXT_MAILBOXES;
+
+	/* answers left over from earlier calls */
+	do {
+		n = res ? -1 : mbox_sweep(m, boxes, 1, mbox_discard);
+	} while (n > 0);
+	if (n < 0)
+		res = -1;
+
+	progress = nxt_clock();
+	while (res == 0 && printed < m->calls) {
+		for (n = 0; m->sent + n < (unsigned long) m->calls &&
+				 m->sent + n - m->answered < (unsigned long) window; n++) {
+			if (snprintf(msg, sizeof(msg), "%lu %s", m->sent + n + 1,
+						 requests[m->sent + n]) >= (int) sizeof(msg)) {
+				fprintf(stderr, "error: request longer than %d bytes with its id: %s\n",
+						NXT_MESSAGE_MAX, requests[m->sent + n]);
+				res = -1;
+				break;
+			}
+			if ((batch[n] = strdup(msg)) == NULL) {
+				fprintf(stderr, "malloc failed\n");
+				exit(1);
+			}
+		}
+		if (res == 0 && mbox_write(m, inbox, batch, n) != 0)
+			res = -1;
+		for (i = 0; i < n; i++)
+			free(batch[i]);
+		if (res != 0)
+			break;
+
+		if ((n = nxt_message_poll(m->nxt, boxes, m->sent - m->answered, 1,
+								  mbox_answer, m)) < 0) {
+			res = -1;
+			break;
+		}
+		for (; printed < m->calls && m->answers[printed]; printed++)
+			printf("%s\n", m->answers[printed]);
+		fflush(stdout);
+		if (n > 0) {
+			progress = nxt_clock();
+		} else if (nxt_clock() - progress > MBOX_TIMEOUT) {
+			fprintf(stderr, "error: no answer to %lu requests\n", m->sent - m->answered);
+			res = -1;
+		} else {
+			poll(NULL, 0, MBOX_POLL);
+		}
+	}
+
+	for (i = 0; i < m->calls; i++)
+		free(m->answers[i]);
+	free(m->answers);
+	if (argc == 1) {
+		for (i = 0; i < m->calls; i++)
+			free(requests[i]);
+		free(requests);
+	}
+	return res;
+}
+
+int mbox_run(NXT *nxt, char *const *argv, int argc) {
+	Mbox m;
+	double elapsed;
+	int res;
+
+	memset(&m, 0, sizeof(m));
+	m.nxt = nxt;
+	m.start = nxt_clock();
+	if (argc < 1) {
+		fprintf(stderr, "error: mbox needs send, recv, call or stream\n");
+		return -1;
+	}
+	if (strcmp(argv[0], "send") == 0) {
+		res = mbox_send(&m, argv + 1, argc - 1);
+	} else if (strcmp(argv[0], "recv") == 0) {
+		res = mbox_recv(&m, argv + 1, argc - 1);
+	} else if (strcmp(argv[0], "call") == 0) {
+		res = mbox_call(&m, argv + 1, argc - 1);
+	} else if (strcmp(argv[0], "stream") == 0) {
+		res = mbox_stream(&m, argv + 1, argc - 1);
+	} else {
+		fprintf(stderr, "error: unknown mbox command %s\n", argv[0]);
+		return -1;
+	}
+	elapsed = nxt_clock() - m.start;
+	fprintf(stderr, "%lu messages sent, %lu received in %.2f s (%.0f messages/s)\n",
+			m.sent, m.received, elapsed,
+			elapsed > 0 ? (m.sent + m.received) / elapsed : 0.0);
+	return res;
+}
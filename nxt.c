@@ -15,95 +15,51 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* struct ucred for SO_PEERCRED */
+#define _GNU_SOURCE
+
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
-#include <stdarg.h>
+#include <limits.h>
+#include <poll.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libusb.h>
+#include "cache.h"
+#include "emu.h"
+#include "fio.h"
 #include "nxt.h"
+#include "nxtcmd.h"
+#include "serial.h"
+#include "stats.h"
+#include "trace.h"
 
 /* USB IDs of a lego nxt brick */
 #define LEGO_VENDOR_ID       0x0694
 #define LEGO_NXT_PRODUCT_ID  0x0002
 
-/* Some codes, defined in Appendix 1 of Bluetooth handbook */
-#define NXT_DIRECT_COMMAND 0x00
-#define NXT_SYSTEM_COMMAND 0x01
-#define NXT_REPLY_COMMAND  0x02
-#define NXT_DIRECT_COMMAND_NOREPLY 0x80
-#define NXT_SYSTEM_COMMAND_NOREPLY 0x81
-
-/* direct commands */
-#define NXT_CMD_GET_BATTERY_LEVEL 0x0b
-#define NXT_CMD_START_PROGRAM     0x00
-#define NXT_CMD_STOP_PROGRAM      0x01
-
-
-/* system commands */
-#define NXT_CMD_OPEN_READ         	 0x80
-#define NXT_CMD_OPEN_WRITE        	 0x81
-#define NXT_CMD_READ              	 0x82
-#define NXT_CMD_WRITE             	 0x83
-#define NXT_CMD_CLOSE             	 0x84
-#define NXT_CMD_DELETE            	 0x85
-#define NXT_CMD_FIND_FIRST_FILE   	 0x86
-#define NXT_CMD_FIND_NEXT_FILE    	 0x87
-#define NXT_CMD_GET_FIRMWARE_VERSION 0x88
-#define NXT_CMD_BOOT                 0x97
-#define NXT_CMD_GET_DEVICE_INFO      0x9b
-
-/* error codes */
-#define NXT_SUCCESS                      0x00
-#define NXT_ERROR_PENDING_TRANSACTION    0x20
-#define NXT_ERROR_QUEUE_EMPTY            0x40
-#define NXT_ERROR_NO_MORE_HANDLES        0x81
-#define NXT_ERROR_NO_SPACE               0x82
-#define NXT_ERROR_NO_MORE_FILES          0x83
-#define NXT_ERROR_END_OF_FILE_EXPECTED   0x84
-#define NXT_ERROR_END_OF_FILE            0x85
-#define NXT_ERROR_NOT_A_LINEAR_FILE      0x86
-#define NXT_ERROR_FILE_NOT_FOUND         0x87
-#define NXT_ERROR_HANDLE_ALREADY_CLOSED  0x88
-#define NXT_ERROR_NO_LINEAR_SPACE        0x89
-#define NXT_ERROR_UNDEFINED_ERROR        0x8A
-#define NXT_ERROR_FILE_IS_BUSY           0x8B
-#define NXT_ERROR_NO_WRITE_BUFFERS       0x8C
-#define NXT_ERROR_APPEND_NOT_POSSIBLE    0x8D
-#define NXT_ERROR_FILE_IS_FULL           0x8E
-#define NXT_ERROR_FILE_EXISTS            0x8F
-#define NXT_ERROR_MODULE_NOT_FOUND       0x90
-#define NXT_ERROR_OUT_OF_BOUNDARY        0x91
-#define NXT_ERROR_ILLEGAL_FILE_NAME      0x92
-#define NXT_ERROR_ILLEGAL_HANDLE         0x93
-#define NXT_ERROR_REQUEST_FAILED         0xBD
-#define NXT_ERROR_UNKNOWN_COMMAND_OPCODE 0xBE
-#define NXT_ERROR_INSANE_PACKET          0xBF
-#define NXT_ERROR_OUT_OF_RANGE           0xC0
-#define NXT_ERROR_BUS_ERROR              0xDD
-#define NXT_ERROR_COMM_OUT_OF_MEMORY     0xDE
-#define NXT_ERROR_CHANNEL_INVALID        0xDF
-#define NXT_ERROR_CHANNEL_BUSY           0xE0
-#define NXT_ERROR_NO_ACTIVE_PROGRAM      0xEC
-#define NXT_ERROR_ILLEGAL_SIZE           0xED
-#define NXT_ERROR_ILLEGAL_QUEUE          0xEE
-#define NXT_ERROR_INVALID_FIELD          0xEF
-#define NXT_ERROR_BAD_INPUT_OUTPUT       0xF0
-#define NXT_ERROR_INSUFFICIENT_MEMORY    0xFB
-#define NXT_ERROR_BAD_ARGUMENTS          0xFF
-		
 #define NXT_WRITE_ENDPOINT 0x01
 #define NXT_READ_ENDPOINT  0x82
-#define NXT_WRITE_TIMEOUT  1000
-#define NXT_READ_TIMEOUT   1000
+
+/* max size of a single usb packet */
+#define NXT_PACKET_SIZE    64
+/* max number of requests in flight for pipelined transfers */
+#define NXT_MAX_WINDOW     32
+/* msec to wait for late replies after a failed transfer */
+#define NXT_DRAIN_TIMEOUT  20
 
 #define USB_INTERFACE 0
 #define USB_CONFIG 1
@@ -111,383 +67,953 @@
 extern int vflag;
 
 /***********************************************************************/
-/* libusb helper functions                                             */
+/* nxtd socket framing                                                 */
 /***********************************************************************/
 
-static int usb_write(struct libusb_device_handle *handle, Buf *buf, const char *desc) {
-	int len;
-	if (vflag)
-		printf("usb_write: offset=%zd\n", buf->offset);
-	if ((libusb_bulk_transfer(handle, NXT_WRITE_ENDPOINT, 
-								   buf->buf, buf->offset, &len, NXT_WRITE_TIMEOUT)) != 0) {
-		fprintf(stderr, "usb_bulk_write failed for %s\n", desc);
-		return -1;
+static int fd_read_full(int fd, unsigned char *data, size_t len) {
+	ssize_t nr;
+
+	while (len > 0) {
+		nr = read(fd, data, len);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr <= 0)
+			return -1;
+		data += nr;
+		len -= nr;
 	}
 	return 0;
 }
 
-static int usb_read(struct libusb_device_handle *handle, Buf *buf, const char *desc) {
-	int len;
-	buf_reset(buf);
-	if (vflag)
-		printf("usb_read: offset=%zd size=%zd\n", buf->offset, buf->size);
-	if ((libusb_bulk_transfer(handle, NXT_READ_ENDPOINT, 
-									buf->buf, buf->size, &len, NXT_READ_TIMEOUT)) != 0) {
-		fprintf(stderr, "usb_bulk_read failed for %s (%d)\n", desc, len);
-		return -1;
+static int fd_write_full(int fd, const unsigned char *data, size_t len) {
+	ssize_t nw;
+
+	while (len > 0) {
+		nw = write(fd, data, len);
+		if (nw < 0 && errno == EINTR)
+			continue;
+		if (nw <= 0)
+			return -1;
+		data += nw;
+		len -= nw;
 	}
-	buf->limit = len;
 	return 0;
 }
 
-static int usb_communicate(struct libusb_device_handle *handle, Buf *buf, const char*desc) {
-	if (usb_write(handle, buf, desc) != 0) {
+/*
+ * Packets are framed with a 2 byte little endian length prefix, like
+ * on the bluetooth link of the brick. A zero length frame in reply to
+ * a request signals a failed usb transaction in the daemon.
+ */
+int nxt_frame_write(int fd, const unsigned char *data, size_t len) {
+	unsigned char frame[2 + NXT_FRAME_MAX];
+
+	if (len > NXT_FRAME_MAX)
+		return -1;
+	frame[0] = len;
+	frame[1] = len >> 8;
+	memcpy(frame + 2, data, len);
+	return fd_write_full(fd, frame, len + 2);
+}
+
+int nxt_frame_read(int fd, unsigned char *data, size_t size, size_t *len) {
+	unsigned char hdr[2];
+
+	if (fd_read_full(fd, hdr, sizeof(hdr)) != 0)
 		return -1;
-	}
-	if (usb_read(handle, buf, desc) != 0) {
+	*len = hdr[0] | hdr[1] << 8;
+	if (*len > size)
 		return -1;
-	}
-	return 0;
+	return fd_read_full(fd, data, *len);
+}
+
+const char* nxt_socket_path(void) {
+	static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	const char *env;
+
+	if ((env = getenv("NXTD_SOCKET")) != NULL)
+		return env;
+	/* /tmp is shared, the fallback gets a private directory made by nxtd */
+	if ((env = getenv("XDG_RUNTIME_DIR")) != NULL && env[0] == '/')
+		snprintf(path, sizeof(path), "%s/nxtd.sock", env);
+	else
+		snprintf(path, sizeof(path), "/tmp/nxtd-%u/nxtd.sock", (unsigned) getuid());
+	return path;
 }
 
+/*
+ * uid of the process at the other end of a UNIX domain socket
+ */
+int nxt_peer_uid(int fd, uid_t *uid) {
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+		return -1;
+	*uid = cred.uid;
+	return 0;
+#else
+	gid_t gid;
+
+	return getpeereid(fd, uid, &gid);
+#endif
+}
 
 /***********************************************************************/
-/* nxt command wrappers                                                */
+/* transports                                                          */
 /***********************************************************************/
-static const char* nxt_strerror(int error) {
-	const char *str;
 
-	switch(error) {
-	case NXT_SUCCESS:
-		str = "Success";
-		break;
-	case NXT_ERROR_PENDING_TRANSACTION:
-		str = "Pending communication transaction in progress";
-		break;
-	case NXT_ERROR_QUEUE_EMPTY:
-		str = "Specified mailbox queue is empty";
-		break;
-	case NXT_ERROR_NO_MORE_HANDLES:
-		str = "No more handles";
-		break;
-	case NXT_ERROR_NO_SPACE:
-		str = "No space";
-		break;
-	case NXT_ERROR_NO_MORE_FILES:
-		str = "No more files";
-		break;
-	case NXT_ERROR_END_OF_FILE_EXPECTED:
-		str = "End of file expected";
-		break;
-	case NXT_ERROR_END_OF_FILE:
-		str = "End of file";
-		break;
-	case NXT_ERROR_NOT_A_LINEAR_FILE:
-		str = "Not a linear file";
-		break;
-	case NXT_ERROR_FILE_NOT_FOUND:
-		str = "File not found";
-		break;
-	case NXT_ERROR_HANDLE_ALREADY_CLOSED:
-		str = "Handle all ready closed";
-		break;
-	case NXT_ERROR_NO_LINEAR_SPACE:
-		str = "No linear space";
-		break;
-	case NXT_ERROR_UNDEFINED_ERROR:
-		str = "Undefined error";
-		break;
-	case NXT_ERROR_FILE_IS_BUSY:
-		str = "File is busy";
-		break;
-	case NXT_ERROR_NO_WRITE_BUFFERS:
-		str = "No write buffers";
-		break;
-	case NXT_ERROR_APPEND_NOT_POSSIBLE:
-		str = "Append not possible";
-		break;
-	case NXT_ERROR_FILE_IS_FULL:
-		str = "File is full";
-		break;
-	case NXT_ERROR_FILE_EXISTS:
-		str = "File exists";
-		break;
-	case NXT_ERROR_MODULE_NOT_FOUND:
-		str = "Module not found";
-		break;
-	case NXT_ERROR_OUT_OF_BOUNDARY:
-		str = "Out of boundary";
-		break;
-	case NXT_ERROR_ILLEGAL_FILE_NAME:
-		str = "Illegal file name";
-		break;
-	case NXT_ERROR_ILLEGAL_HANDLE:
-		str = "Illegal handle";
-		break;
-	case NXT_ERROR_REQUEST_FAILED:
-		str = "Request failed (i.e. specified file not found)";
-		break;
-	case NXT_ERROR_UNKNOWN_COMMAND_OPCODE:
-		str = "Unknown command opcode";
-		break;
-	case NXT_ERROR_INSANE_PACKET:
-		str = "Insane packet";
-		break;
-	case NXT_ERROR_OUT_OF_RANGE:
-		str = "Data contains out-of-range values";
-		break;
-	case NXT_ERROR_BUS_ERROR:
-		str = "Communication bus error";
-		break;
-	case NXT_ERROR_COMM_OUT_OF_MEMORY:
-		str = "No free memory in communication buffer";
-		break;
-	case NXT_ERROR_CHANNEL_INVALID:
-		str = "Specified channel/connection is not valid";
-		break;
-	case NXT_ERROR_CHANNEL_BUSY:
-		str = "Specified channel/connection not configured or busy";
-		break;
-	case NXT_ERROR_NO_ACTIVE_PROGRAM:
-		str = "No active program";
-		break;
-	case NXT_ERROR_ILLEGAL_SIZE:
-		str = "Illegal size specified";
-		break;
-	case NXT_ERROR_ILLEGAL_QUEUE:
-		str = "Illegal mailbox queue ID specified";
-		break;
-	case NXT_ERROR_INVALID_FIELD:
-		str = "Attempted to access invalid field of a structure";
-		break;
-	case NXT_ERROR_BAD_INPUT_OUTPUT:
-		str = "Bad input or output specified";
-		break;
-	case NXT_ERROR_INSUFFICIENT_MEMORY:
-		str = "Insufficient memory available";
-		break;
-	case NXT_ERROR_BAD_ARGUMENTS:
-		str = "Bad arguments";
-		break;
-	default:
-		str = "Unknown error";
+static int usb_bulk_write(NXT *self, const unsigned char *data, size_t len) {
+	int n, res;
+
+	if ((res = libusb_bulk_transfer(self->handle, NXT_WRITE_ENDPOINT, (unsigned char *) data,
+									len, &n, self->timeout)) != 0) {
+		TRACE_ERROR(res, 0);
+		return -1;
 	}
-	return str;
+	return 0;
 }
 
-static int nxt_failed(int status) {
-	if (status == NXT_SUCCESS) {
-		return 0;
-	} else {
-		fprintf(stderr, "error: %s (0x%x)\n", nxt_strerror(status), status);
-		return 1;
+static int usb_bulk_read(NXT *self, unsigned char *data, size_t size, size_t *len) {
+	int n, res;
+
+	if ((res = libusb_bulk_transfer(self->handle, NXT_READ_ENDPOINT,
+									data, size, &n, self->timeout)) != 0) {
+		TRACE_ERROR(res, 0);
+		return res == LIBUSB_ERROR_TIMEOUT ? NXT_TIMEOUT : -1;
 	}
+	*len = n;
+	return 0;
 }
 
-static int nxt_simple_command(NXT* self, char *desc, char *fmt, ...) {
-	va_list ap;
-	int ret;
-	Buf *buf;
-	unsigned char reply, command, status;
-
-	buf = self->buf;
-	buf_reset(buf);
+static void usb_close(NXT *self) {
+	libusb_release_interface(self->handle, USB_INTERFACE);
+	libusb_close(self->handle);
+	self->handle = NULL;
+}
 
-	va_start(ap,fmt);
-	ret = buf_vpack(buf, fmt, ap);
-	va_end(ap);
+const NXTTransport nxt_usb_transport = {
+	"usb", usb_bulk_write, usb_bulk_read, usb_close
+};
 
-	if (ret < 0) {
+/*
+ * nxtd relays the packets in length prefixed frames, a zero length
+ * reply means the daemon could not talk to the brick
+ */
+static int daemon_write(NXT *self, const unsigned char *data, size_t len) {
+	if (nxt_frame_write(self->sock, data, len) != 0) {
+		TRACE_ERROR(-1, 0);
 		return -1;
 	}
+	return 0;
+}
 
-	if (usb_communicate(self->handle, buf, desc) != 0)
-		return -1;
-	if (buf_unpack(buf, "bbb", &reply, &command, &status) == -1)
-		return -1;
-	if (nxt_failed(status))
+/*
+ * nxtd answers with an empty frame when its own transfer times out, so
+ * only wait that long longer for it
+ */
+static int daemon_read(NXT *self, unsigned char *data, size_t size, size_t *len) {
+	struct pollfd pfd;
+	int res;
+
+	pfd.fd = self->sock;
+	pfd.events = POLLIN;
+	while ((res = poll(&pfd, 1, self->timeout + NXT_TIMEOUT_MAX)) < 0 && errno == EINTR)
+		;
+	if (res == 0) {
+		TRACE_ERROR(NXT_TIMEOUT, 0);
+		return NXT_TIMEOUT;
+	}
+	if (res < 0 || nxt_frame_read(self->sock, data, size, len) != 0 || *len == 0) {
+		TRACE_ERROR(-1, 0);
 		return -1;
+	}
 	return 0;
 }
 
-static int nxt_cmd_write(NXT *self, 
-						 unsigned char handle,
-						 char *data,
-						 unsigned short size) {
-	Buf *buf = self->buf;
-	unsigned short writesize;
-	unsigned char writehandle;
-	unsigned char reply, command, status;
+static void daemon_close(NXT *self) {
+	close(self->sock);
+	self->sock = -1;
+}
 
-	buf_reset(buf);
+const NXTTransport nxt_daemon_transport = {
+	"nxtd", daemon_write, daemon_read, daemon_close
+};
 
-    /* send command */
-	if (buf_pack(buf, "bbbd", NXT_SYSTEM_COMMAND, NXT_CMD_WRITE, handle, data, size) == -1)
-		return -1;
+/***********************************************************************/
+/* timeouts and retries                                                */
+/***********************************************************************/
 
-	/* do usb transaction */
-	if (usb_communicate(self->handle, buf, "WRITE") != 0)
-		return -1;
+/*
+ * Timeout in msec for a transfer of opcode: the smoothed round trip
+ * time plus four times its variation, doubled for every timeout since
+ * the last sample
+ */
+static unsigned int nxt_timeout(NXT *self, int opcode) {
+	NXTRtt *rtt = &self->rtt[opcode & 0xff];
+	float rto;
+
+	if (rtt->srtt == 0)
+		rto = NXT_TIMEOUT_INIT;
+	else
+		rto = rtt->srtt + 4 * rtt->rttvar;
+	rto *= 1 << rtt->backoff;
+	if (rto < NXT_TIMEOUT_MIN)
+		return NXT_TIMEOUT_MIN;
+	if (rto > NXT_TIMEOUT_MAX)
+		return NXT_TIMEOUT_MAX;
+	return rto;
+}
 
-	/* read result */
-	if (buf_unpack(buf, "bbb", &reply, &command, &status) == -1)
-		return -1;
-	if (nxt_failed(status))
-		return -1;
-	if (buf_unpack(buf, "bh", &writehandle, &writesize) == -1)
-		return -1;
+static void nxt_rtt_sample(NXT *self, int opcode, double seconds) {
+	NXTRtt *rtt = &self->rtt[opcode & 0xff];
+	float r = seconds * 1e3;
 
-	/* do some sanity checks */
-	if (writesize != size) {
-		fprintf(stderr, "error: writesize=%hu size=%hu\n", 
-				writesize, size);
-		return -1;
-	}
-	if (writehandle != handle) {
-		fprintf(stderr, "error: handles don't match\n");
-		return -1;
+	if (rtt->srtt == 0) {
+		rtt->srtt = r;
+		rtt->rttvar = r / 2;
+	} else {
+		rtt->rttvar = 0.75 * rtt->rttvar + 0.25 * (rtt->srtt > r ? rtt->srtt - r : r - rtt->srtt);
+		rtt->srtt = 0.875 * rtt->srtt + 0.125 * r;
 	}
-	if (vflag) 
-		fprintf(stderr, "nxt_cmd_write: data written: %hu\n", writesize);
+	rtt->backoff = 0;
+}
 
-	return 0;
+static void nxt_rtt_timeout(NXT *self, int opcode) {
+	NXTRtt *rtt = &self->rtt[opcode & 0xff];
+
+	if (rtt->backoff < 4)
+		rtt->backoff++;
 }
 
+/*
+ * Count a retry and wait before it, NXT_RETRY_DELAY doubled for every
+ * earlier attempt
+ */
+static void nxt_retry(NXT *self, int opcode, int attempt, const char *desc) {
+	struct timespec ts;
+	long ms = NXT_RETRY_DELAY << attempt;
 
-static int nxt_cmd_read(NXT *self, unsigned char handle, char *data, unsigned short size) {
-	Buf *buf = self->buf;
-	unsigned short readsize;
-	unsigned char readhandle;
-	unsigned char reply, command, status;
+	stats_retry(opcode);
+	if (vflag)
+		fprintf(stderr, "retrying %s (%d of %d)\n", desc, attempt + 1, NXT_RETRIES);
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
 
-	buf_reset(buf);
+/*
+ * After a failed read the brick may still answer late. Drop anything
+ * that arrives shortly, so it is not taken as the reply to the next
+ * request.
+ */
+static void nxt_drain(NXT *self) {
+	unsigned char junk[NXT_FRAME_MAX];
+	unsigned int timeout = self->timeout;
+	size_t len;
+
+	/* nxtd drains its link itself before it answers with an empty frame */
+	if (self->transport == &nxt_daemon_transport)
+		return;
+	self->timeout = NXT_DRAIN_TIMEOUT;
+	while (self->transport->read(self, junk, sizeof(junk), &len) == 0)
+		TRACE_PACKET(TRACE_REPLY, junk, len, 0);
+	self->timeout = timeout;
+}
 
-	if (buf_pack(buf, "bbbh", NXT_SYSTEM_COMMAND, NXT_CMD_READ, handle, size) == -1)
-		return -1;
-	
-	/* do usb transaction */
-	if (usb_communicate(self->handle, buf, "READ") != 0)
-		return -1;
-	
-	/* read result */
-	if (buf_unpack(buf, "bbb", &reply, &command, &status) == -1)
-		return -1;
-	if (nxt_failed(status))
-		return -1;
-	if (buf_unpack(buf, "bh", &readhandle, &readsize) == -1)
-		return -1;
-	
-	/* do some sanity checks */
-	if (readsize != size) {
-		fprintf(stderr, "nxt_cmd_read: error: readsize=%hu size=%hu\n", 
-				readsize, size);
-		return -1;
+/*
+ * Commands without side effects on the brick, they can be sent again
+ * when their reply is lost
+ */
+static int nxt_idempotent(int opcode) {
+	switch (opcode) {
+	case NXT_CMD_GET_BATTERY_LEVEL:
+	case NXT_CMD_KEEP_ALIVE:
+	case NXT_CMD_GET_CURRENT_PROGRAM_NAME:
+	case NXT_CMD_GET_FIRMWARE_VERSION:
+	case NXT_CMD_GET_DEVICE_INFO:
+		return 1;
+	default:
+		return 0;
 	}
-	
-	/* read the actual data and write to outfile */
-	buf_read_data(buf, data, size);
-	if (vflag) 
-		fprintf(stderr, "nxt_cmd_read: got data: %hu\n", readsize);
+}
+
+/***********************************************************************/
+/* lock-step transfers                                                 */
+/***********************************************************************/
 
+/*
+ * A request that could not be written never reached the brick, so it
+ * is retried. Requests without reply are counted for the stats here,
+ * the others in usb_communicate together with their latency.
+ */
+static int usb_write(NXT *self, Buf *buf, const char *desc) {
+	int noreply = buf->buf[0] & 0x80;
+	int attempt;
+
+	TRACE_PACKET(TRACE_REQUEST, buf->buf, buf->offset, 0);
+	self->timeout = nxt_timeout(self, buf->buf[1]);
+	for (attempt = 0; self->transport->write(self, buf->buf, buf->offset) != 0; attempt++) {
+		stats_error(buf->buf[1], 0);
+		if (attempt == NXT_RETRIES) {
+			fprintf(stderr, "%s write failed for %s\n", self->transport->name, desc);
+			return -1;
+		}
+		nxt_retry(self, buf->buf[1], attempt, desc);
+	}
+	if (noreply)
+		stats_record(buf->buf[1], buf->offset, -1);
 	return 0;
 }
 
-static int nxt_cmd_open_read(NXT *self, 
-							 const char *filename, 
-							 unsigned char *handle,
-							 unsigned int  *filesize) {
-	if (nxt_simple_command(self, "OPEN_READ", "bbs", 
-						   NXT_SYSTEM_COMMAND, NXT_CMD_OPEN_READ, 
-						   filename, 20) == -1)
-		return -1;
-	if (buf_unpack(self->buf, "bu", handle, filesize) == -1)
-		return -1;
+/*
+ * Returns 0, -1 on error or NXT_TIMEOUT
+ */
+static int usb_read(NXT *self, Buf *buf, const char *desc) {
+	size_t len;
+	int res;
+
+	buf_reset(buf);
+	if ((res = self->transport->read(self, buf->buf, buf->size, &len)) != 0) {
+		fprintf(stderr, "%s %s for %s\n", self->transport->name,
+				res == NXT_TIMEOUT ? "read timed out" : "read failed", desc);
+		return res;
+	}
+	buf->limit = len;
+	TRACE_PACKET(TRACE_REPLY, buf->buf, buf->limit, 0);
 	return 0;
 }
 
-static int nxt_cmd_open_write(NXT *self, 
-							  const char *filename, 
-							  unsigned int  filesize,
-							  unsigned char *handle) {
-	if (nxt_simple_command(self, "OPEN_READ", "bbsu", 
-						   NXT_SYSTEM_COMMAND, NXT_CMD_OPEN_WRITE, 
-						   filename, 20, filesize) == -1)
-		return -1;
-	if (buf_read_byte(self->buf, handle) == -1)
+/*
+ * Send the request in buf and read the reply into buf. Only clean
+ * round trips feed the rtt estimate. A lost reply is retried for
+ * commands without side effects, for the others the caller has to
+ * decide how to recover.
+ */
+static int usb_communicate(NXT *self, Buf *buf, const char*desc) {
+	unsigned char req[NXT_PACKET_MAX];
+	unsigned char opcode = buf->buf[1];
+	size_t len = buf->offset;
+	double start;
+	int attempt, res;
+
+	if (len > sizeof(req)) {
+		fprintf(stderr, "error: request too long for %s\n", desc);
 		return -1;
+	}
+	memcpy(req, buf->buf, len);
+	for (attempt = 0; ; attempt++) {
+		start = nxt_clock();
+		if (usb_write(self, buf, desc) != 0)
+			return -1;
+		if ((res = usb_read(self, buf, desc)) == 0)
+			break;
+		stats_error(opcode, res == NXT_TIMEOUT);
+		if (res == NXT_TIMEOUT)
+			nxt_rtt_timeout(self, opcode);
+		nxt_drain(self);
+		if (attempt == NXT_RETRIES || !nxt_idempotent(opcode))
+			return -1;
+		nxt_retry(self, opcode, attempt, desc);
+		buf_reset(buf);
+		memcpy(buf->buf, req, len);
+		buf->offset = len;
+	}
+	if (attempt == 0)
+		nxt_rtt_sample(self, opcode, nxt_clock() - start);
+	stats_record(opcode, len + buf->limit, nxt_clock() - start);
 	return 0;
 }
 
-static int nxt_cmd_close(NXT *self, unsigned char handle) {
-	return nxt_simple_command(self, "CLOSE", "bbb", 
-							  NXT_SYSTEM_COMMAND, NXT_CMD_CLOSE, handle);
-}
-
-static int nxt_cmd_delete(NXT *self, const char* filename) {
-	return nxt_simple_command(self, "DELETE", "bbs", 
-							  NXT_SYSTEM_COMMAND, NXT_CMD_DELETE, filename, 20);
-}
+/***********************************************************************/
+/* pipelined libusb transfers                                          */
+/***********************************************************************/
 
 /*
- * pattern:  if not null, find first file matching this pattern. if
- *           null, find next file.
- * handle:   on find first returns the handle, on find next has to be a
- *           valid handle
- * filename: return the found file. should have space for at least 20 characters
- * filesize: returns the size of the file
+ * A pipe keeps up to `window' request/reply pairs in flight using the
+ * libusb asynchronous interface. Every request gets a sequence number
+ * and occupies slot (seq % window) until its reply has been reaped.
+ * The IN transfer of a slot is submitted before its OUT transfer, so
+ * the reply always has a buffer waiting for it. Replies are handed
+ * back strictly in sequence order.
  *
- * returns 0 on success and -1 on error and -2 on file not found
+ * Requests are built directly in the OUT buffer of their slot (see
+ * usb_pipe_request) and replies are handed out as views of the IN
+ * buffer, so payload is never copied between buffers.
+ *
+ * Other transports queue requests themselves, so submitting a request
+ * is just writing it and reaping reads the next reply.
  */
-static int nxt_cmd_find(NXT *self, 
-						const char *pattern, 
-						unsigned char *handle, 
-						char *filename, 
-						unsigned int *filesize) {
-	Buf *buf = self->buf;
-	unsigned char reply, command, status;
+struct usb_slot {
+	struct libusb_transfer *out;
+	struct libusb_transfer *in;
+	unsigned char obuf[NXT_PACKET_MAX];
+	unsigned char ibuf[NXT_PACKET_MAX];
+	unsigned int seq;
+	int busy;		/* number of transfers still owned by libusb */
+	int done;		/* reply has arrived */
+	int error;		/* one of the transfers failed, NXT_TIMEOUT if timed out */
+	double sent;	/* for the stats */
+	unsigned char opcode;
+	size_t len;
+};
+
+typedef struct usb_pipe {
+	struct libusb_device_handle *handle;
+	NXT *nxt;
+	int stream;		/* transport other than usb */
+	Buf req;		/* request under construction */
+	unsigned char sbuf[NXT_FRAME_MAX];	/* last reply read from nxt */
+	struct usb_slot slot[NXT_MAX_WINDOW];
+	int window;
+	unsigned int submitted;
+	unsigned int reaped;
+} UsbPipe;
+
+static void usb_pipe_out_cb(struct libusb_transfer *transfer) {
+	struct usb_slot *slot = transfer->user_data;
+
+	slot->busy--;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		slot->error = 1;
+}
 
-	buf_reset(buf);
-	buf_write_byte(buf, NXT_SYSTEM_COMMAND);
-	if (pattern) {
-		buf_write_byte(buf, NXT_CMD_FIND_FIRST_FILE);
-		buf_write_string(buf, pattern, 20);
-	} else {
-		buf_write_byte(buf, NXT_CMD_FIND_NEXT_FILE);
-		buf_write_byte(buf, *handle);
+static void usb_pipe_in_cb(struct libusb_transfer *transfer) {
+	struct usb_slot *slot = transfer->user_data;
+
+	slot->busy--;
+	if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+		slot->error = NXT_TIMEOUT;
+	else if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		slot->error = 1;
+	else
+		slot->done = 1;
+}
+
+static void usb_pipe_close(UsbPipe *pipe);
+
+static UsbPipe* usb_pipe_open(NXT *self, int window) {
+	UsbPipe *pipe;
+	int i;
+
+	if (window > NXT_MAX_WINDOW)
+		window = NXT_MAX_WINDOW;
+	if ((pipe = calloc(1, sizeof(UsbPipe))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
 	}
-	
-	if (usb_communicate(self->handle, buf, "find first/next file") != 0)
-		return -1;
+	pipe->handle = self->handle;
+	pipe->nxt = self;
+	pipe->window = window;
+	if (self->transport != &nxt_usb_transport) {
+		pipe->stream = 1;
+		return pipe;
+	}
+	for (i = 0; i < window; i++) {
+		pipe->slot[i].out = libusb_alloc_transfer(0);
+		pipe->slot[i].in = libusb_alloc_transfer(0);
+		if (!pipe->slot[i].out || !pipe->slot[i].in) {
+			fprintf(stderr, "libusb_alloc_transfer failed\n");
+			usb_pipe_close(pipe);
+			return NULL;
+		}
+	}
+	return pipe;
+}
 
-	if (buf_unpack(buf, "bbb", &reply, &command, &status) == -1)
-		return -1;
+/*
+ * Return a buffer to build the next request in. It lives in the OUT
+ * transfer buffer of the next free slot. NULL if the window is full.
+ */
+static Buf* usb_pipe_request(UsbPipe *pipe) {
+	struct usb_slot *slot;
+
+	if (pipe->submitted - pipe->reaped >= (unsigned int) pipe->window)
+		return NULL;
+	slot = &pipe->slot[pipe->submitted % pipe->window];
+	buf_wrap(&pipe->req, slot->obuf, sizeof(slot->obuf), 0);
+	return &pipe->req;
+}
 
-	if (status == NXT_ERROR_FILE_NOT_FOUND)
-		return -2;
-	if (nxt_failed(status))
-		return -1;
+/*
+ * Queue the request built in the buffer from usb_pipe_request
+ */
+static int usb_pipe_submit(UsbPipe *pipe, const char *desc) {
+	struct usb_slot *slot;
+	Buf *buf = &pipe->req;
+	unsigned int timeout;
+	int res;
 
-	if (buf_read_byte(buf, handle) == -1)
+	if (pipe->submitted - pipe->reaped >= (unsigned int) pipe->window) {
+		fprintf(stderr, "usb_pipe_submit: window full for %s\n", desc);
 		return -1;
-
-	if (filename) {
-		buf_read_string(buf, filename, 20);
-	} else {
-		buf_read_skip(buf, 20);
 	}
 
-	if (filesize) {
-		buf_read_uint(buf, filesize);
+	slot = &pipe->slot[pipe->submitted % pipe->window];
+	slot->opcode = buf->buf[1];
+	slot->len = buf->offset;
+	if (stats_mode)
+		slot->sent = nxt_clock();
+
+	/* the reply waits for all requests ahead of it */
+	timeout = nxt_timeout(pipe->nxt, slot->opcode) * pipe->window;
+
+	TRACE_PACKET(TRACE_REQUEST, buf->buf, buf->offset, pipe->submitted);
+	if (pipe->stream) {
+		pipe->nxt->timeout = timeout;
+		if (pipe->nxt->transport->write(pipe->nxt, buf->buf, buf->offset) != 0) {
+			TRACE_ERROR(-1, pipe->submitted);
+			stats_error(slot->opcode, 0);
+			fprintf(stderr, "usb_pipe_submit: %s write failed for %s\n",
+					pipe->nxt->transport->name, desc);
+			return -1;
+		}
+		pipe->submitted++;
+		return 0;
 	}
 
+	slot->seq = pipe->submitted;
+	slot->done = 0;
+	slot->error = 0;
+
+	libusb_fill_bulk_transfer(slot->in, pipe->handle, NXT_READ_ENDPOINT,
+							  slot->ibuf, sizeof(slot->ibuf),
+							  usb_pipe_in_cb, slot, timeout);
+	libusb_fill_bulk_transfer(slot->out, pipe->handle, NXT_WRITE_ENDPOINT,
+							  slot->obuf, buf->offset,
+							  usb_pipe_out_cb, slot, timeout);
+	if ((res = libusb_submit_transfer(slot->in)) != 0) {
+		TRACE_ERROR(res, slot->seq);
+		stats_error(slot->opcode, 0);
+		fprintf(stderr, "usb_pipe_submit: submit failed for %s\n", desc);
+		return -1;
+	}
+	slot->busy++;
+	if ((res = libusb_submit_transfer(slot->out)) != 0) {
+		TRACE_ERROR(res, slot->seq);
+		stats_error(slot->opcode, 0);
+		fprintf(stderr, "usb_pipe_submit: submit failed for %s\n", desc);
+		libusb_cancel_transfer(slot->in);
+		slot->error = 1;
+		pipe->submitted++;
+		return -1;
+	}
+	slot->busy++;
+	pipe->submitted++;
 	return 0;
 }
 
-static int nxt_cmd_boot(NXT *self) {
-	const char *samba = "Let's dance: SAMBA";
-	return nxt_simple_command(self, "BOOT", "bbd", 
-							  NXT_SYSTEM_COMMAND, NXT_CMD_BOOT, 
-							  samba, strlen(samba) + 1);
+/*
+ * Wait for the reply to the oldest outstanding request and make buf a
+ * view of it. The view stays valid until the next request is
+ * submitted. The sequence number of the request is stored in seq.
+ */
+static int usb_pipe_reap(UsbPipe *pipe, Buf *buf, unsigned int *seq, const char *desc) {
+	struct usb_slot *slot;
+	struct timeval tv;
+	size_t len;
+	int res;
+
+	if (pipe->reaped == pipe->submitted) {
+		fprintf(stderr, "usb_pipe_reap: nothing in flight for %s\n", desc);
+		return -1;
+	}
+
+	slot = &pipe->slot[pipe->reaped % pipe->window];
+	if (pipe->stream) {
+		*seq = pipe->reaped++;
+		pipe->nxt->timeout = nxt_timeout(pipe->nxt, slot->opcode) * pipe->window;
+		if ((res = pipe->nxt->transport->read(pipe->nxt, pipe->sbuf,
+											  sizeof(pipe->sbuf), &len)) != 0) {
+			TRACE_ERROR(res, *seq);
+			stats_error(slot->opcode, res == NXT_TIMEOUT);
+			fprintf(stderr, "usb_pipe_reap: %s %s for %s (seq=%u)\n",
+					pipe->nxt->transport->name,
+					res == NXT_TIMEOUT ? "read timed out" : "read failed", desc, *seq);
+			return -1;
+		}
+		buf_wrap(buf, pipe->sbuf, sizeof(pipe->sbuf), len);
+		TRACE_PACKET(TRACE_REPLY, buf->buf, buf->limit, *seq);
+		if (stats_mode)
+			stats_record(slot->opcode, slot->len + len, nxt_clock() - slot->sent);
+		return 0;
+	}
+
+	while (!slot->done && !slot->error) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		if (libusb_handle_events_timeout_completed(NULL, &tv, &slot->done) != 0) {
+			slot->error = 1;
+		}
+	}
+	pipe->reaped++;
+
+	if (slot->error) {
+		TRACE_ERROR(LIBUSB_ERROR_IO, slot->seq);
+		stats_error(slot->opcode, slot->error == NXT_TIMEOUT);
+		fprintf(stderr, "usb_pipe_reap: transfer failed for %s (seq=%u)\n", desc, slot->seq);
+		return -1;
+	}
+
+	buf_wrap(buf, slot->ibuf, sizeof(slot->ibuf), slot->in->actual_length);
+	*seq = slot->seq;
+	TRACE_PACKET(TRACE_REPLY, buf->buf, buf->limit, *seq);
+	if (stats_mode)
+		stats_record(slot->opcode, slot->len + buf->limit, nxt_clock() - slot->sent);
+	return 0;
+}
+
+/*
+ * Wait for all transfers still owned by libusb and free the pipe.
+ * Outstanding replies are drained rather than cancelled, so the brick
+ * and the host agree on the protocol state afterwards.
+ */
+static void usb_pipe_close(UsbPipe *pipe) {
+	struct timeval tv;
+	Buf reply;
+	unsigned int seq;
+	int i, busy;
+
+	if (pipe->stream) {
+		/* after a timeout the rest would only time out as well */
+		while (pipe->reaped != pipe->submitted &&
+			   usb_pipe_reap(pipe, &reply, &seq, "drain") == 0)
+			;
+		free(pipe);
+		return;
+	}
+
+	do {
+		busy = 0;
+		for (i = 0; i < pipe->window; i++)
+			busy += pipe->slot[i].busy;
+		if (busy) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 100000;
+			if (libusb_handle_events_timeout_completed(NULL, &tv, NULL) != 0)
+				break;
+		}
+	} while (busy);
+	for (i = 0; i < pipe->window; i++) {
+		if (pipe->slot[i].in)
+			libusb_free_transfer(pipe->slot[i].in);
+		if (pipe->slot[i].out)
+			libusb_free_transfer(pipe->slot[i].out);
+	}
+	free(pipe);
+}
+
+
+/***********************************************************************/
+/* nxt command wrappers                                                */
+/***********************************************************************/
+#define NXT_ERROR_CASE(NAME, code, msg) case code: return msg;
+static const char* nxt_strerror(int error) {
+	switch(error) {
+	case NXT_SUCCESS:
+		return "Success";
+	NXT_ERRORS(NXT_ERROR_CASE)
+	default:
+		return "Unknown error";
+	}
+}
+#undef NXT_ERROR_CASE
+
+/*
+ * Check the result of a reply decoder: the status byte of the reply
+ * or -1 if the reply is malformed
+ */
+static int nxt_failed(int status) {
+	if (status == NXT_SUCCESS) {
+		return 0;
+	} else if (status < 0) {
+		fprintf(stderr, "error: malformed reply\n");
+		return 1;
+	} else {
+		fprintf(stderr, "error: %s (0x%x)\n", nxt_strerror(status), status);
+		return 1;
+	}
+}
+
+/*
+ * Send the request of length len encoded into self->buf by one of the
+ * nxt_*_enc functions and read the reply into self->buf
+ */
+static int nxt_transact(NXT *self, int len, const char *desc) {
+	Buf *buf = self->buf;
+
+	if (len < 0) {
+		fprintf(stderr, "error: invalid arguments for %s\n", desc);
+		return -1;
+	}
+	buf_reset(buf);
+	buf->offset = len;
+	return usb_communicate(self, buf, desc);
+}
+
+/*
+ * Start a WRITE request in self->buf and return where the caller has
+ * to place size bytes of payload. The header is left blank and filled
+ * in by nxt_cmd_write, so payload can be read directly into the
+ * transfer buffer.
+ */
+static unsigned char* nxt_write_payload(NXT *self, unsigned short size) {
+	buf_reset(self->buf);
+	if (buf_reserve(self->buf, NXT_WRITE_REQ_SIZE) == NULL)
+		return NULL;
+	return buf_reserve(self->buf, size);
+}
+
+/*
+ * Send the WRITE request prepared with nxt_write_payload. Without
+ * reply the brick does not answer, errors only show up on the next
+ * checked command for the same handle.
+ */
+static int nxt_cmd_write(NXT *self, 
+						 unsigned char handle,
+						 unsigned short size,
+						 int reply) {
+	Buf *buf = self->buf;
+	nxt_write_reply r;
+
+	nxt_write_enc(buf->buf, NXT_WRITE_REQ_SIZE, reply, handle);
+
+	if (!reply)
+		return usb_write(self, buf, "WRITE");
+
+	/* do usb transaction */
+	if (usb_communicate(self, buf, "WRITE") != 0)
+		return -1;
+
+	/* read result */
+	if (nxt_failed(nxt_write_dec(buf->buf, buf->limit, &r)))
+		return -1;
+
+	/* do some sanity checks */
+	if (r.size != size) {
+		fprintf(stderr, "error: writesize=%hu size=%hu\n", 
+				r.size, size);
+		return -1;
+	}
+	if (r.handle != handle) {
+		fprintf(stderr, "error: handles don't match\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read size bytes from handle. On success data is a view of the
+ * payload in the reply, valid until the next command is sent.
+ */
+static int nxt_cmd_read(NXT *self, unsigned char handle, Buf *data, unsigned short size) {
+	Buf *buf = self->buf;
+	nxt_read_reply r;
+
+	if (nxt_transact(self, nxt_read_enc(buf->buf, buf->size, 1, handle, size), "READ") != 0)
+		return -1;
+	
+	/* read result */
+	if (nxt_failed(nxt_read_dec(buf->buf, buf->limit, &r)))
+		return -1;
+	
+	/* do some sanity checks */
+	if (r.size != size || NXT_READ_REPLY_SIZE + size > buf->limit) {
+		fprintf(stderr, "nxt_cmd_read: error: readsize=%hu size=%hu\n", 
+				r.size, size);
+		return -1;
+	}
+	
+	/* hand out the actual data without copying it */
+	buf->offset = NXT_READ_REPLY_SIZE;
+	if (buf_slice(buf, data, size) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int nxt_cmd_open_read(NXT *self, 
+							 const char *filename, 
+							 unsigned char *handle,
+							 unsigned int  *filesize) {
+	Buf *buf = self->buf;
+	nxt_open_read_reply r;
+
+	if (nxt_transact(self, nxt_open_read_enc(buf->buf, buf->size, 1, filename),
+					 "OPEN_READ") != 0 ||
+		nxt_failed(nxt_open_read_dec(buf->buf, buf->limit, &r)))
+		return -1;
+	*handle = r.handle;
+	*filesize = r.filesize;
+	return 0;
+}
+
+static int nxt_cmd_open_write(NXT *self, 
+							  const char *filename, 
+							  unsigned int  filesize,
+							  unsigned char *handle) {
+	Buf *buf = self->buf;
+	nxt_open_write_reply r;
+
+	if (nxt_transact(self, nxt_open_write_enc(buf->buf, buf->size, 1, filename, filesize),
+					 "OPEN_WRITE") != 0 ||
+		nxt_failed(nxt_open_write_dec(buf->buf, buf->limit, &r)))
+		return -1;
+	*handle = r.handle;
+	return 0;
+}
+
+static int nxt_cmd_open_write_linear(NXT *self, 
+									 const char *filename, 
+									 unsigned int  filesize,
+									 unsigned char *handle) {
+	Buf *buf = self->buf;
+	nxt_open_write_linear_reply r;
+	int status;
+
+	if (nxt_transact(self, nxt_open_write_linear_enc(buf->buf, buf->size, 1, filename, filesize),
+					 "OPEN_WRITE_LINEAR") != 0)
+		return -1;
+	status = nxt_open_write_linear_dec(buf->buf, buf->limit, &r);
+	if (status == NXT_ERROR_NO_LINEAR_SPACE) {
+		fprintf(stderr, "error: no %u contiguous bytes of flash for %s, delete files to "
+				"defragment it\n", filesize, filename);
+		return -1;
+	}
+	if (nxt_failed(status))
+		return -1;
+	*handle = r.handle;
+	return 0;
+}
+
+static int nxt_cmd_open_write_data(NXT *self, 
+								   const char *filename, 
+								   unsigned int  filesize,
+								   unsigned char *handle) {
+	Buf *buf = self->buf;
+	nxt_open_write_data_reply r;
+
+	if (nxt_transact(self, nxt_open_write_data_enc(buf->buf, buf->size, 1, filename, filesize),
+					 "OPEN_WRITE_DATA") != 0 ||
+		nxt_failed(nxt_open_write_data_dec(buf->buf, buf->limit, &r)))
+		return -1;
+	*handle = r.handle;
+	return 0;
+}
+
+/*
+ * Returns the status of OPEN_APPEND_DATA, failures other than the
+ * transfer are left to the caller
+ */
+static int nxt_cmd_open_append_data(NXT *self, 
+									const char *filename, 
+									unsigned char *handle,
+									unsigned int  *available) {
+	Buf *buf = self->buf;
+	nxt_open_append_data_reply r;
+	int status;
+
+	if (nxt_transact(self, nxt_open_append_data_enc(buf->buf, buf->size, 1, filename),
+					 "OPEN_APPEND_DATA") != 0)
+		return -1;
+	status = nxt_open_append_data_dec(buf->buf, buf->limit, &r);
+	if (status == NXT_SUCCESS) {
+		*handle = r.handle;
+		*available = r.available;
+	}
+	return status;
+}
+
+static int nxt_cmd_close(NXT *self, unsigned char handle) {
+	Buf *buf = self->buf;
+	nxt_close_reply r;
+
+	if (nxt_transact(self, nxt_close_enc(buf->buf, buf->size, 1, handle), "CLOSE") != 0 ||
+		nxt_failed(nxt_close_dec(buf->buf, buf->limit, &r)))
+		return -1;
+	return 0;
+}
+
+static int nxt_cmd_delete(NXT *self, const char* filename) {
+	Buf *buf = self->buf;
+	nxt_delete_reply r;
+
+	if (nxt_transact(self, nxt_delete_enc(buf->buf, buf->size, 1, filename), "DELETE") != 0 ||
+		nxt_failed(nxt_delete_dec(buf->buf, buf->limit, &r)))
+		return -1;
+	return 0;
+}
+
+/*
+ * pattern:  if not null, find first file matching this pattern. if
+ *           null, find next file.
+ * handle:   on find first returns the handle, on find next has to be a
+ *           valid handle
+ * filename: return the found file. should have space for at least 20 characters
+ * filesize: returns the size of the file
+ *
+ * returns 0 on success and -1 on error and -2 on file not found
+ */
+static int nxt_cmd_find(NXT *self, 
+						const char *pattern, 
+						unsigned char *handle, 
+						char *filename, 
+						unsigned int *filesize) {
+	Buf *buf = self->buf;
+	union {
+		/* both replies have the same layout */
+		nxt_find_first_file_reply first;
+		nxt_find_next_file_reply next;
+	} r;
+	int status;
+
+	if (pattern) {
+		if (nxt_transact(self, nxt_find_first_file_enc(buf->buf, buf->size, 1, pattern),
+						 "FIND_FIRST_FILE") != 0)
+			return -1;
+		status = nxt_find_first_file_dec(buf->buf, buf->limit, &r.first);
+	} else {
+		if (nxt_transact(self, nxt_find_next_file_enc(buf->buf, buf->size, 1, *handle),
+						 "FIND_NEXT_FILE") != 0)
+			return -1;
+		status = nxt_find_next_file_dec(buf->buf, buf->limit, &r.next);
+	}
+
+	if (status == NXT_ERROR_FILE_NOT_FOUND)
+		return -2;
+	if (nxt_failed(status))
+		return -1;
+
+	*handle = r.first.handle;
+	if (filename)
+		memcpy(filename, r.first.filename, sizeof(r.first.filename));
+	if (filesize)
+		*filesize = r.first.filesize;
+
+	return 0;
+}
+
+static int nxt_cmd_firmware_version(NXT *self, nxt_get_firmware_version_reply *r) {
+	Buf *buf = self->buf;
+
+	if (nxt_transact(self, nxt_get_firmware_version_enc(buf->buf, buf->size, 1),
+					 "GET_FIRMWARE_VERSION") != 0 ||
+		nxt_failed(nxt_get_firmware_version_dec(buf->buf, buf->limit, r)))
+		return -1;
+	return 0;
+}
+
+static int nxt_cmd_boot(NXT *self) {
+	Buf *buf = self->buf;
+	nxt_boot_reply r;
+
+	if (nxt_transact(self, nxt_boot_enc(buf->buf, buf->size, 1, "Let's dance: SAMBA"),
+					 "BOOT") != 0 ||
+		nxt_failed(nxt_boot_dec(buf->buf, buf->limit, &r)))
+		return -1;
+	return 0;
 }
 
 /*************************************************************/
@@ -499,18 +1025,51 @@ NXT* nxt_new() {
 		fprintf(stderr, "malloc failed\n");
 		exit(1);
 	}
+	res->transport = NULL;
+	res->link = NULL;
+	if ((res->rtt = calloc(256, sizeof(NXTRtt))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	res->timeout = NXT_TIMEOUT_INIT;
+	res->dev = NULL;
+	res->handle = NULL;
+	res->sock = -1;
+	res->cache = NULL;
+	res->sync = FIO_SYNC_NONE;
 	res->buf = buf_new();
+	res->window = 1;
+	res->interval = 0;
+	res->resume = 0;
+	res->read_size = 0;
+	res->write_size = 0;
+	res->probe = 0;
+	res->linear = NXT_LINEAR_AUTO;
 	return res;
 }
 
-int nxt_init(NXT *self) {
-	libusb_init(NULL);
-	self->handle = libusb_open_device_with_vid_pid(NULL, LEGO_VENDOR_ID, LEGO_NXT_PRODUCT_ID);
-	if (self->handle == NULL) {
-		fprintf(stderr, "no NXT device found\n");
-		return -1;
-	}
+/*
+ * Monotonic time in seconds
+ */
+double nxt_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void nxt_print_rate(FILE *fp, const char *what, unsigned int bytes,
+						   const char *filename, double elapsed) {
+	fprintf(fp, "%u bytes %s %s", bytes, what, filename);
+	if (elapsed > 0)
+		fprintf(fp, " (%.1f KB/s)", bytes / elapsed / 1024);
+	fprintf(fp, "\n");
+}
 
+/*
+ * Reset, configure and claim an opened device handle
+ */
+static int nxt_setup(NXT *self) {
 	self->dev = libusb_get_device(self->handle);
 	if (! self->dev) {
 		fprintf(stderr, "failed to open device handle\n");
@@ -534,205 +1093,1763 @@ int nxt_init(NXT *self) {
 				err, USB_INTERFACE);
 		return -1;
 	}
+	self->transport = &nxt_usb_transport;
 	return 0;
 }
 
-int nxt_close(NXT *self) {
-	libusb_close(self->handle);
+/*
+ * Connect to a running nxtd listening on path, the default socket if
+ * path is NULL. Returns -1 if there is none.
+ */
+int nxt_init_daemon(NXT *self, const char *path) {
+	struct sockaddr_un sun;
+	uid_t uid;
+	int fd;
+
+	if (path == NULL)
+		path = nxt_socket_path();
+	if (path[0] == 0 || strlen(path) >= sizeof(sun.sun_path))
+		return -1;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		close(fd);
+		return -1;
+	}
+	/* anyone who could take over the socket path must not get our files */
+	if (nxt_peer_uid(fd, &uid) != 0 || uid != getuid()) {
+		fprintf(stderr, "warning: nxtd at %s belongs to another user, not used\n", path);
+		close(fd);
+		return -1;
+	}
+	if (vflag)
+		fprintf(stderr, "using nxtd at %s\n", path);
+	return nxt_init_socket(self, fd);
+}
+
+/*
+ * Talk the nxtd protocol over an already connected socket
+ */
+int nxt_init_socket(NXT *self, int fd) {
+	self->sock = fd;
+	self->transport = &nxt_daemon_transport;
 	return 0;
 }
 
+/*
+ * Connect as given by a transport spec: "usb", "nxtd[:path]",
+ * "serial:tty" or "emu[:options]", see emu_link_open for the options.
+ */
+int nxt_init_transport(NXT *self, const char *spec) {
+	if (strcmp(spec, "usb") == 0)
+		return nxt_init_usb(self);
+	if (strcmp(spec, "nxtd") == 0 || strncmp(spec, "nxtd:", 5) == 0) {
+		if (nxt_init_daemon(self, spec[4] ? spec + 5 : NULL) != 0) {
+			fprintf(stderr, "error: could not connect to nxtd\n");
+			return -1;
+		}
+		return 0;
+	}
+	if (strncmp(spec, "serial:", 7) == 0)
+		return serial_open(self, spec + 7);
+	if (strcmp(spec, "emu") == 0 || strncmp(spec, "emu:", 4) == 0)
+		return emu_link_open(self, spec[3] ? spec + 4 : "");
+	fprintf(stderr, "error: unknown transport %s\n", spec);
+	return -1;
+}
 
-int nxt_print_battery_level(NXT* self){
-	unsigned short mv;
+/*
+ * Use nxtd if it is running, otherwise open the first NXT via usb
+ */
+int nxt_init(NXT *self) {
+	if (nxt_init_daemon(self, NULL) == 0)
+		return 0;
+	return nxt_init_usb(self);
+}
+
+int nxt_init_usb(NXT *self) {
+	libusb_init(NULL);
+	self->handle = libusb_open_device_with_vid_pid(NULL, LEGO_VENDOR_ID, LEGO_NXT_PRODUCT_ID);
+	if (self->handle == NULL) {
+		fprintf(stderr, "no NXT device found\n");
+		return -1;
+	}
+	return nxt_setup(self);
+}
+
+/*
+ * Like nxt_init, but open the given device instead of the first NXT
+ */
+int nxt_init_device(NXT *self, struct libusb_device *dev) {
+	libusb_init(NULL);
+	if (libusb_open(dev, &self->handle) != 0) {
+		fprintf(stderr, "failed to open NXT device\n");
+		return -1;
+	}
+	return nxt_setup(self);
+}
+
+/*
+ * Return non-zero if dev is a NXT brick
+ */
+int nxt_is_device(struct libusb_device *dev) {
+	struct libusb_device_descriptor desc;
+
+	if (libusb_get_device_descriptor(dev, &desc) != 0)
+		return 0;
+	return desc.idVendor == LEGO_VENDOR_ID &&
+		desc.idProduct == LEGO_NXT_PRODUCT_ID;
+}
+
+int nxt_close(NXT *self) {
+	if (self->transport) {
+		self->transport->close(self);
+		self->transport = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Close the transport and free everything nxt_new allocated
+ */
+void nxt_free(NXT *self) {
+	nxt_close(self);
+	buf_free(self->buf);
+	free(self->rtt);
+	free(self);
+}
+
+/*
+ * Send the raw packet in buf to the brick and read the reply into buf
+ * unless the command does not want one. Returns 1 if a reply was read,
+ * 0 if none is expected and -1 on error. Used by nxtd.
+ */
+int nxt_relay(NXT *self, Buf *buf) {
+	if (buf->offset < 2)
+		return -1;
+	if (buf->buf[0] & 0x80)
+		return usb_write(self, buf, "relay");
+	if (usb_communicate(self, buf, "relay") != 0)
+		return -1;
+	return 1;
+}
+
+
+int nxt_print_battery_level(NXT* self){
+	Buf *buf = self->buf;
+	nxt_get_battery_level_reply r;
+
+	if (nxt_transact(self, nxt_get_battery_level_enc(buf->buf, buf->size, 1),
+					 "GET_BATTERY_LEVEL") != 0 ||
+		nxt_failed(nxt_get_battery_level_dec(buf->buf, buf->limit, &r)))
+		return -1;
+
+	printf("battery level: %dmV\n", r.millivolts);
+	return 0;
+}
+
+int nxt_print_firmware_version(NXT* self){
+	nxt_get_firmware_version_reply r;
+
+	if (nxt_cmd_firmware_version(self, &r) != 0)
+		return -1;
+
+	printf("protocol version: %hhu.%hhu\n", r.protocol_major, r.protocol_minor);
+	printf("firmware version: %hhu.%hhu\n", r.firmware_major, r.firmware_minor);
+
+	return 0;
+}
+
+int nxt_get_device_info(NXT* self, NXTInfo *info){
+	Buf *buf = self->buf;
+	nxt_get_device_info_reply r;
+
+	if (nxt_transact(self, nxt_get_device_info_enc(buf->buf, buf->size, 1),
+					 "GET_DEVICE_INFO") != 0 ||
+		nxt_failed(nxt_get_device_info_dec(buf->buf, buf->limit, &r)))
+		return -1;
+
+	memcpy(info->name, r.name, sizeof(info->name));
+	memcpy(info->btaddr, r.btaddr, sizeof(info->btaddr));
+	info->signal_strength = r.signal_strength;
+	info->free_space = r.free_space;
+
+	return 0;
+}
+
+/*
+ * Format bluetooth address as colon separated hex bytes
+ */
+void nxt_format_btaddr(const NXTInfo *info, char *s, size_t len) {
+	int i;
+	size_t n = 0;
+
+	if (len > 0)
+		s[0] = 0;
+	for (i = 0; i < sizeof(info->btaddr) && n + 3 < len; ++i) {
+		n += snprintf(s + n, len - n, "%s%02hhx",
+					  i > 0 ? ":" : "", info->btaddr[i]);
+	}
+}
+
+int nxt_print_device_info(NXT* self){
+	NXTInfo info;
+	char btaddr[32];
+
+	if (nxt_get_device_info(self, &info) == -1)
+		return -1;
+
+	nxt_format_btaddr(&info, btaddr, sizeof(btaddr));
+	printf("nxt name: %s\n", info.name);
+	printf("bluetooth address: %s\n", btaddr);
+	printf("bluetooth signal strength: %u\n", info.signal_strength);
+	printf("free user flash: %u\n", info.free_space);
+
+	return 0;
+}
+
+/*
+ * Call fn for every file on the brick matching pattern, in the order
+ * the brick reports them. Stops when fn returns non-zero.
+ */
+int nxt_list_files(NXT *self, const char *pattern, nxt_file_fn fn, void *arg) {
+	char filename[20];
+	int error = 0;
+	unsigned int filesize;
+	unsigned char handle;
+	unsigned char handle_valid = 0;
+
+	if (pattern && strlen(pattern) >= 20) {
+		fprintf(stderr, "error: pattern too long\n");
+		return -1;
+	}
+
+	if (! pattern) {
+		pattern = "*.*";
+	}
+
+	while (1) {
+		int res;
+		res = nxt_cmd_find(self, pattern, &handle, filename, &filesize);
+		/* file not found */
+		if (res == -2) {
+			break;
+		}
+		if (res != 0) {
+			error = 1;
+			break;
+		}
+
+		/* this makes nxt_cmd_find do "find next" instead of "find first" */
+		pattern = 0;
+		handle_valid = 1;
+		if (fn(filename, filesize, arg) != 0) {
+			break;
+		}
+	}
+
+	if (handle_valid) {
+		if (nxt_cmd_close(self, handle) != 0) {
+			error = 1;
+		}
+	}
+	
+	return (error ? -1 : 0);
+}
+
+static int nxt_print_file(const char *filename, unsigned int filesize, void *arg) {
+	printf("%6u %s\n", filesize, filename);
+	return 0;
+}
+
+int nxt_print_files(NXT *self, const char *pattern) {
+	if (self->cache) {
+		if (pattern && strlen(pattern) >= 20) {
+			fprintf(stderr, "error: pattern too long\n");
+			return -1;
+		}
+		return cache_list(self->cache, pattern ? pattern : "*.*",
+						  nxt_print_file, NULL);
+	}
+	return nxt_list_files(self, pattern, nxt_print_file, NULL);
+}
+
+int nxt_start_program(NXT* self, const char* filename){
+	Buf *buf = self->buf;
+	nxt_start_program_reply r;
+	int status;
+
+	if (!filename || strlen(filename) >= 20) {
+		fprintf(stderr, "error: filename missing or too long\n");
+		return -1;
+	}
+
+	if (nxt_transact(self, nxt_start_program_enc(buf->buf, buf->size, 1, filename),
+					 "START_PROGRAM") != 0) {
+		return -1;
+	}
+
+	status = nxt_start_program_dec(buf->buf, buf->limit, &r);
+
+	if (status == NXT_ERROR_OUT_OF_RANGE) {
+		/* seems to be error for file not found */
+		fprintf(stderr, "error: file not found\n");
+		return -1;
+	}
+
+	if (nxt_failed(status)) {
+			return -1;
+	}
+
+	return 0;
+}
+
+int nxt_stop_program(NXT* self){
+	Buf *buf = self->buf;
+	nxt_stop_program_reply r;
+
+	if (nxt_transact(self, nxt_stop_program_enc(buf->buf, buf->size, 1),
+					 "STOP_PROGRAM") != 0 ||
+		nxt_failed(nxt_stop_program_dec(buf->buf, buf->limit, &r)))
+		return -1;
+	return 0;
+}
+
+/***********************************************************************/
+/* mailboxes                                                           */
+/***********************************************************************/
+
+/*
+ * Build a MESSAGE_WRITE request for inbox in buf. The message goes
+ * out with its terminating NUL, like the firmware expects.
+ */
+static int nxt_message_enc(Buf *buf, int reply, int inbox, const char *message) {
+	size_t len = strlen(message) + 1;
+	unsigned char *data;
+
+	if (len > NXT_MESSAGE_MAX + 1) {
+		fprintf(stderr, "error: message longer than %d bytes\n", NXT_MESSAGE_MAX);
+		return -1;
+	}
+	if (inbox < 0 || inbox >= NXT_MAILBOXES) {
+		fprintf(stderr, "error: inbox %d out of range\n", inbox);
+		return -1;
+	}
+	buf_reset(buf);
+	if (buf_reserve(buf, NXT_MESSAGE_WRITE_REQ_SIZE) == NULL ||
+		(data = buf_reserve(buf, len)) == NULL ||
+		nxt_message_write_enc(buf->buf, NXT_MESSAGE_WRITE_REQ_SIZE, reply, inbox, len) < 0)
+		return -1;
+	memcpy(data, message, len);
+	return 0;
+}
+
+/*
+ * Write count messages to inbox of the running program. As with
+ * uploads, with self->interval > 0 only every interval-th message (and
+ * the last one) asks for a reply and the others go out back to back
+ * without waiting. Otherwise up to self->window checked messages are in
+ * flight. Note that the firmware keeps only a few messages per inbox
+ * and drops the oldest when the program does not keep up.
+ */
+int nxt_message_write(NXT *self, int inbox, char *const *messages, int count) {
+	nxt_message_write_reply r;
+	UsbPipe *pipe;
+	Buf *buf, reply_buf;
+	unsigned int seq;
+	int i, reply, error = 0;
+
+	if (self->window <= 1 || self->interval > 0) {
+		for (i = 0; i < count; i++) {
+			reply = self->interval == 0 || i == count - 1 ||
+				(i + 1) % self->interval == 0;
+			if (nxt_message_enc(self->buf, reply, inbox, messages[i]) != 0)
+				return -1;
+			if (!reply) {
+				if (usb_write(self, self->buf, "MESSAGE_WRITE") != 0)
+					return -1;
+				continue;
+			}
+			if (usb_communicate(self, self->buf, "MESSAGE_WRITE") != 0 ||
+				nxt_failed(nxt_message_write_dec(self->buf->buf, self->buf->limit, &r)))
+				return -1;
+		}
+		return 0;
+	}
+
+	if ((pipe = usb_pipe_open(self, self->window)) == NULL)
+		return -1;
+	i = 0;
+	while (!error && (i < count || pipe->reaped != pipe->submitted)) {
+		if (i < count && (buf = usb_pipe_request(pipe)) != NULL) {
+			if (nxt_message_enc(buf, 1, inbox, messages[i]) != 0 ||
+				usb_pipe_submit(pipe, "MESSAGE_WRITE") != 0)
+				error = 1;
+			i++;
+			continue;
+		}
+		if (usb_pipe_reap(pipe, &reply_buf, &seq, "MESSAGE_WRITE") != 0 ||
+			nxt_failed(nxt_message_write_dec(reply_buf.buf, reply_buf.limit, &r)))
+			error = 1;
+	}
+	usb_pipe_close(pipe);
+	return error ? -1 : 0;
+}
+
+/*
+ * Read one message from each of the count mailboxes in boxes (0-19)
+ * and pass them to fn with the trailing NUL stripped. All MESSAGE_READ
+ * requests are in flight at once, so a sweep over every mailbox costs
+ * about one round trip. Empty mailboxes are skipped. Returns the number
+ * of messages read or -1 on error.
+ */
+int nxt_message_poll(NXT *self, const int *boxes, int count, int remove,
+					 nxt_message_fn fn, void *arg) {
+	nxt_message_read_reply r;
+	UsbPipe *pipe;
+	Buf *buf, reply_buf;
+	unsigned int seq;
+	int i = 0, len, status, received = 0, error = 0;
+
+	if (count > NXT_MAX_WINDOW) {
+		fprintf(stderr, "error: too many mailboxes\n");
+		return -1;
+	}
+	if ((pipe = usb_pipe_open(self, count)) == NULL)
+		return -1;
+	for (i = 0; i < count && !error; i++) {
+		buf = usb_pipe_request(pipe);
+		if ((len = nxt_message_read_enc(buf->buf, buf->size, 1, boxes[i], 0, remove)) < 0) {
+			error = 1;
+			break;
+		}
+		buf->offset = len;
+		if (usb_pipe_submit(pipe, "MESSAGE_READ") != 0)
+			error = 1;
+	}
+	while (!error && pipe->reaped != pipe->submitted) {
+		if (usb_pipe_reap(pipe, &reply_buf, &seq, "MESSAGE_READ") != 0) {
+			error = 1;
+			break;
+		}
+		status = nxt_message_read_dec(reply_buf.buf, reply_buf.limit, &r);
+		if (status == NXT_ERROR_QUEUE_EMPTY)
+			continue;
+		if (nxt_failed(status)) {
+			error = 1;
+			break;
+		}
+		if (r.size > sizeof(r.message)) {
+			fprintf(stderr, "error: message size %d out of range\n", r.size);
+			error = 1;
+			break;
+		}
+		for (len = r.size; len > 0 && r.message[len - 1] == '\0'; len--)
+			;
+		received++;
+		if (fn(boxes[seq], (const char*) r.message, len, arg) != 0)
+			error = 1;
+	}
+	usb_pipe_close(pipe);
+	return error ? -1 : received;
+}
+
+/***********************************************************************/
+/* sensor sampling                                                     */
+/***********************************************************************/
+
+/*
+ * Sensors are sampled in rounds, one GET_INPUT_VALUES per analog
+ * sensor. A lowspeed (I2C) transaction takes a few msec on the brick,
+ * so a round reads the result of the LS_WRITE of the round before with
+ * LS_READ and then starts the next transaction. After the last round
+ * one more reads the outstanding results. Those samples carry the time
+ * and round of their LS_WRITE. Up to self->window requests, or
+ * NXT_SAMPLE_WINDOW if it is not set, are in flight, so a round costs about one round
+ * trip however many sensors there are, and the next round goes out
+ * while the replies of the last one are still on the way.
+ */
+
+#define NXT_SAMPLE_WINDOW 8
+
+/* I2C address of LEGO digital sensors */
+#define NXT_LS_ADDRESS 0x02
+
+enum {
+	SAMPLE_VALUES,
+	SAMPLE_LS_READ,
+	SAMPLE_LS_WRITE
+};
+
+typedef struct {
+	NXT *nxt;
+	const NXTSensor *sensors;
+	int count;
+	int item;				/* next request of the round */
+	int items;
+	struct {
+		int sensor;
+		int kind;
+	} round[2 * NXT_MAX_WINDOW];
+	double srtt;			/* smoothed round trip, 0 until measured */
+	struct {
+		int sensor;
+		int kind;
+		unsigned long round;
+		double sent;
+		int delayed;		/* reaped late, round trip unknown */
+	} tag[NXT_MAX_WINDOW];
+	struct {
+		unsigned long round;
+		double time;
+		double latency;
+	} ls[NXT_MAX_WINDOW];	/* last LS_WRITE per sensor */
+} NXTSampler;
+
+static int nxt_sample_enc(NXTSampler *sm, Buf *buf, int sensor, int kind) {
+	const NXTSensor *ss = &sm->sensors[sensor];
+	unsigned char *data;
+	int len;
+
+	switch (kind) {
+	case SAMPLE_VALUES:
+		len = nxt_get_input_values_enc(buf->buf, buf->size, 1, ss->port);
+		break;
+	case SAMPLE_LS_READ:
+		len = nxt_ls_read_enc(buf->buf, buf->size, 1, ss->port);
+		break;
+	default:
+		/* the payload is the address and register to read */
+		if (buf_reserve(buf, NXT_LS_WRITE_REQ_SIZE) == NULL ||
+			(data = buf_reserve(buf, 2)) == NULL ||
+			nxt_ls_write_enc(buf->buf, NXT_LS_WRITE_REQ_SIZE, 1, ss->port, 2, ss->ls_len) < 0)
+			return -1;
+		data[0] = NXT_LS_ADDRESS;
+		data[1] = ss->ls_register;
+		return 0;
+	}
+	if (len < 0)
+		return -1;
+	buf->offset = len;
+	return 0;
+}
+
+/*
+ * Requests of round r, the extra round after the last (final) only
+ * reads the lowspeed sensors
+ */
+static void nxt_sample_round(NXTSampler *sm, unsigned long r, int final) {
+	int i;
+
+	sm->item = sm->items = 0;
+	for (i = 0; i < sm->count; i++) {
+		if (sm->sensors[i].ls_len == 0) {
+			if (final)
+				continue;
+			sm->round[sm->items].sensor = i;
+			sm->round[sm->items++].kind = SAMPLE_VALUES;
+			continue;
+		}
+		if (r > 0) {
+			sm->round[sm->items].sensor = i;
+			sm->round[sm->items++].kind = SAMPLE_LS_READ;
+		}
+		if (!final) {
+			sm->round[sm->items].sensor = i;
+			sm->round[sm->items++].kind = SAMPLE_LS_WRITE;
+		}
+	}
+}
+
+/*
+ * Turn the reply to a tagged request into a sample. Failed reads are
+ * samples too, with the status of the reply.
+ */
+static int nxt_sample_reply(NXTSampler *sm, Buf *reply, unsigned int seq,
+							nxt_sample_fn fn, void *arg) {
+	nxt_get_input_values_reply v;
+	nxt_ls_read_reply l;
+	NXTSample sample;
+	double rtt = nxt_clock() - sm->tag[seq % NXT_MAX_WINDOW].sent;
+	int i, status, kind = sm->tag[seq % NXT_MAX_WINDOW].kind;
+
+	if (!sm->tag[seq % NXT_MAX_WINDOW].delayed)
+		sm->srtt = sm->srtt > 0 ? 0.875 * sm->srtt + 0.125 * rtt : rtt;
+	else if (sm->srtt > 0 && sm->srtt < rtt)
+		rtt = sm->srtt;
+	memset(&sample, 0, sizeof(sample));
+	sample.sensor = sm->tag[seq % NXT_MAX_WINDOW].sensor;
+	sample.round = sm->tag[seq % NXT_MAX_WINDOW].round;
+	sample.time = sm->tag[seq % NXT_MAX_WINDOW].sent + rtt / 2;
+	sample.latency = rtt / 2;
+	if (kind == SAMPLE_LS_WRITE) {
+		/* the sensor is read when the transaction runs, a failed one
+		 * shows up in the next LS_READ */
+		sm->ls[sample.sensor].round = sample.round;
+		sm->ls[sample.sensor].time = sample.time;
+		sm->ls[sample.sensor].latency = sample.latency;
+		return 0;
+	}
+	if (kind == SAMPLE_VALUES) {
+		if ((status = nxt_get_input_values_dec(reply->buf, reply->limit, &v)) < 0) {
+			fprintf(stderr, "error: malformed reply\n");
+			return -1;
+		}
+		sample.status = status;
+		if (status == NXT_SUCCESS) {
+			sample.valid = v.valid;
+			sample.calibrated = v.calibrated;
+			sample.raw = v.raw;
+			sample.normalized = v.normalized;
+			sample.scaled = v.scaled;
+			sample.calibrated_value = v.calibrated_value;
+		}
+	} else {
+		if ((status = nxt_ls_read_dec(reply->buf, reply->limit, &l)) < 0) {
+			fprintf(stderr, "error: malformed reply\n");
+			return -1;
+		}
+		sample.round = sm->ls[sample.sensor].round;
+		sample.time = sm->ls[sample.sensor].time;
+		sample.latency = sm->ls[sample.sensor].latency;
+		sample.status = status;
+		if (status == NXT_SUCCESS && l.bytes_read > 0 && l.bytes_read <= sizeof(l.data)) {
+			/* little endian like the sensors, as far as it fits */
+			sample.valid = 1;
+			sample.raw = l.data[0];
+			sample.normalized = l.bytes_read > 1 ? l.data[1] : 0;
+			for (i = l.bytes_read < 2 ? l.bytes_read : 2; i > 0; i--)
+				sample.scaled = (sample.scaled << 8) | l.data[i - 1];
+		}
+	}
+	return fn(&sample, arg);
+}
+
+static void nxt_sample_sleep(double sec) {
+	struct timespec ts;
+
+	if (sec <= 0)
+		return;
+	ts.tv_sec = sec;
+	ts.tv_nsec = (sec - ts.tv_sec) * 1e9;
+	nanosleep(&ts, NULL);	/* a signal ends the sleep early */
+}
+
+/*
+ * Configure the count sensors with SET_INPUT_MODE and sample them in
+ * rounds, rate rounds per second or as fast as the link allows if rate
+ * is 0, until rounds rounds are done or for ever if rounds is 0. Rounds
+ * that can not be sent in time are skipped, they are counted in
+ * *skipped. fn gets every sample and stops sampling by returning 1 or
+ * with an error by returning -1. A signal handler stops sampling by
+ * setting *interrupted, the replies in flight are still passed to fn.
+ * Returns 0 or -1 on error.
+ */
+int nxt_sample(NXT *self, const NXTSensor *sensors, int count, double rate,
+			   unsigned long rounds, unsigned long *skipped,
+			   volatile sig_atomic_t *interrupted, nxt_sample_fn fn, void *arg) {
+	nxt_set_input_mode_reply mr;
+	NXTSampler *sm;
+	UsbPipe *pipe;
+	Buf *buf, reply;
+	unsigned int seq;
+	unsigned long r = 0, late;
+	double period = rate > 0 ? 1 / rate : 0;
+	double next, now;
+	int i, final = 0, stop = 0, error = 0, res, window;
+
+	*skipped = 0;
+	if (count < 1 || count > NXT_MAX_WINDOW) {
+		fprintf(stderr, "error: between 1 and %d sensors can be sampled\n", NXT_MAX_WINDOW);
+		return -1;
+	}
+	if ((sm = calloc(1, sizeof(NXTSampler))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	sm->nxt = self;
+	sm->sensors = sensors;
+	sm->count = count;
+	/* -w 1 samples in lock-step */
+	window = self->window > 0 ? self->window : NXT_SAMPLE_WINDOW;
+	if ((pipe = usb_pipe_open(self, window)) == NULL) {
+		free(sm);
+		return -1;
+	}
+
+	/* a full window takes a reply before the next sensor is set up */
+	for (i = 0; !error && (i < count || pipe->reaped != pipe->submitted); ) {
+		if (i < count && (buf = usb_pipe_request(pipe)) != NULL) {
+			if ((res = nxt_set_input_mode_enc(buf->buf, buf->size, 1, sensors[i].port,
+											  sensors[i].type, sensors[i].mode)) < 0) {
+				error = 1;
+				break;
+			}
+			buf->offset = res;
+			if (usb_pipe_submit(pipe, "SET_INPUT_MODE") != 0)
+				error = 1;
+			i++;
+			continue;
+		}
+		if (usb_pipe_reap(pipe, &reply, &seq, "SET_INPUT_MODE") != 0 ||
+			nxt_failed(nxt_set_input_mode_dec(reply.buf, reply.limit, &mr)))
+			error = 1;
+	}
+
+	next = nxt_clock();
+	while (!error) {
+		if (interrupted && *interrupted)
+			stop = 1;
+		now = nxt_clock();
+		/* start the next round when it is due */
+		if (sm->item == sm->items && !stop && !final && now >= next) {
+			if (rounds > 0 && r == rounds)
+				final = 1;
+			if (period > 0 && now - next >= period) {
+				late = (now - next) / period;
+				*skipped += late;
+				next += late * period;
+			}
+			next += period;
+			nxt_sample_round(sm, r, final);
+			r++;
+		}
+		/* fill the window with the requests of the round */
+		if (sm->item < sm->items && !stop && (buf = usb_pipe_request(pipe)) != NULL) {
+			i = pipe->submitted % NXT_MAX_WINDOW;
+			sm->tag[i].sensor = sm->round[sm->item].sensor;
+			sm->tag[i].kind = sm->round[sm->item].kind;
+			sm->tag[i].round = r - 1;
+			sm->tag[i].sent = nxt_clock();
+			sm->tag[i].delayed = 0;
+			if (nxt_sample_enc(sm, buf, sm->tag[i].sensor, sm->tag[i].kind) != 0 ||
+				usb_pipe_submit(pipe, sm->tag[i].kind == SAMPLE_VALUES ? "GET_INPUT_VALUES" :
+								sm->tag[i].kind == SAMPLE_LS_READ ? "LS_READ" : "LS_WRITE") != 0)
+				error = 1;
+			sm->item++;
+			continue;
+		}
+		/* rather wait for the next round than for a reply due after it */
+		if (!stop && !final && pipe->reaped != pipe->submitted &&
+			pipe->submitted - pipe->reaped < (unsigned int) pipe->window &&
+			sm->srtt > 0 && next < sm->tag[pipe->reaped % NXT_MAX_WINDOW].sent + sm->srtt) {
+			for (seq = pipe->reaped; seq != pipe->submitted; seq++)
+				sm->tag[seq % NXT_MAX_WINDOW].delayed = 1;
+			nxt_sample_sleep(next - now);
+			continue;
+		}
+		if (pipe->reaped != pipe->submitted) {
+			if (usb_pipe_reap(pipe, &reply, &seq, "sample") != 0 ||
+				(res = nxt_sample_reply(sm, &reply, seq, fn, arg)) < 0)
+				error = 1;
+			else if (res > 0)
+				stop = 1;
+			continue;
+		}
+		if (stop || (final && sm->item == sm->items))
+			break;
+		/* idle until the next round */
+		nxt_sample_sleep(next - now);
+	}
+	usb_pipe_close(pipe);
+	free(sm);
+	return error ? -1 : 0;
+}
+
+/***********************************************************************/
+/* chunk sizes                                                         */
+/***********************************************************************/
+
+/*
+ * The payload of READ and WRITE is limited by the packet size the
+ * firmware and the link accept. The largest sizes that work are probed
+ * once with a scratch file and kept in ~/.nxtctl/chunks per transport
+ * and firmware version.
+ */
+
+#define NXT_PROBE_FILE "nxtctl-probe.tmp"
+
+/* packet sizes tried, largest first */
+static const unsigned int nxt_probe_packets[] = { NXT_PACKET_MAX, 128, NXT_PACKET_SIZE, 0 };
+
+/* payload sizes that fit a packet, from --chunk or the profile file */
+static int nxt_chunk_valid(unsigned int r, unsigned int w) {
+	return r >= 1 && r <= NXT_PACKET_MAX - NXT_READ_REPLY_SIZE &&
+		w >= 1 && w <= NXT_PACKET_MAX - NXT_WRITE_REQ_SIZE;
+}
+
+/*
+ * Parse a --chunk value "read,write" with the READ and WRITE payload
+ */
+int nxt_parse_chunk(const char *s, unsigned short *read_size, unsigned short *write_size) {
+	unsigned int r, w;
+	char c;
+
+	if (sscanf(s, "%u,%u%c", &r, &w, &c) != 2 || !nxt_chunk_valid(r, w))
+		return -1;
+	*read_size = r;
+	*write_size = w;
+	return 0;
+}
+
+/*
+ * usb transfers are single packets, nxtd relays over usb as well. Only
+ * the serial link and the emulator frame larger packets.
+ */
+static unsigned int nxt_packet_max(NXT *self) {
+	if (self->transport == &nxt_usb_transport || self->transport == &nxt_daemon_transport)
+		return NXT_PACKET_SIZE;
+	return NXT_PACKET_MAX;
+}
+
+/*
+ * One READ of size bytes from the start of the probe file, which holds
+ * data. Failures are expected, so only the outcome is reported.
+ */
+static int nxt_probe_read(NXT *self, const unsigned char *data, unsigned short size) {
+	Buf *buf = self->buf;
+	nxt_read_reply r;
+	unsigned char handle;
+	unsigned int filesize;
+	int res = -1;
+
+	if (nxt_cmd_open_read(self, NXT_PROBE_FILE, &handle, &filesize) != 0)
+		return -1;
+	if (nxt_transact(self, nxt_read_enc(buf->buf, buf->size, 1, handle, size), "READ") == 0 &&
+		nxt_read_dec(buf->buf, buf->limit, &r) == NXT_SUCCESS && r.size == size &&
+		NXT_READ_REPLY_SIZE + size <= buf->limit &&
+		memcmp(buf->buf + NXT_READ_REPLY_SIZE, data, size) == 0)
+		res = 0;
+	nxt_cmd_close(self, handle);
+	return res;
+}
+
+/*
+ * Create the probe file with a single WRITE of size bytes
+ */
+static int nxt_probe_write(NXT *self, const unsigned char *data, unsigned short size) {
+	Buf *buf = self->buf;
+	nxt_write_reply r;
+	unsigned char handle, *payload;
+	int res = -1;
+
+	if (nxt_cmd_open_write(self, NXT_PROBE_FILE, size, &handle) != 0)
+		return -1;
+	if ((payload = nxt_write_payload(self, size)) != NULL) {
+		memcpy(payload, data, size);
+		nxt_write_enc(buf->buf, NXT_WRITE_REQ_SIZE, 1, handle);
+		if (usb_communicate(self, buf, "WRITE") == 0 &&
+			nxt_write_dec(buf->buf, buf->limit, &r) == NXT_SUCCESS && r.size == size)
+			res = 0;
+	}
+	nxt_cmd_close(self, handle);
+	return res;
+}
+
+/*
+ * Find the largest READ and WRITE payloads that work. Returns -1 if the
+ * brick could not be probed at all, e.g. because the flash is full.
+ */
+static int nxt_probe_chunks(NXT *self, unsigned short *read_size, unsigned short *write_size) {
+	unsigned char data[NXT_PACKET_MAX];
+	unsigned char handle, *payload;
+	unsigned int i, packet, offset;
+	unsigned short chunksize;
+	int res = -1;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 7 + 1;
+	*read_size = NXT_READ_SIZE;
+	*write_size = NXT_WRITE_SIZE;
+
+	/* left over from an interrupted probe */
+	if (nxt_cmd_find(self, NXT_PROBE_FILE, &handle, NULL, NULL) == 0) {
+		nxt_cmd_close(self, handle);
+		nxt_cmd_delete(self, NXT_PROBE_FILE);
+	}
+
+	/* READ sizes, from a file written with safe chunks */
+	if (nxt_cmd_open_write(self, NXT_PROBE_FILE, sizeof(data), &handle) != 0)
+		return -1;
+	for (offset = 0; offset < sizeof(data); offset += chunksize) {
+		chunksize = sizeof(data) - offset < NXT_WRITE_SIZE ? sizeof(data) - offset : NXT_WRITE_SIZE;
+		if ((payload = nxt_write_payload(self, chunksize)) == NULL)
+			break;
+		memcpy(payload, data + offset, chunksize);
+		if (nxt_cmd_write(self, handle, chunksize, 1) != 0)
+			break;
+	}
+	if (nxt_cmd_close(self, handle) == 0 && offset == sizeof(data)) {
+		res = 0;
+		for (i = 0; (packet = nxt_probe_packets[i]); i++) {
+			if (packet > nxt_packet_max(self) ||
+				nxt_probe_read(self, data, packet - NXT_READ_REPLY_SIZE) != 0)
+				continue;
+			*read_size = packet - NXT_READ_REPLY_SIZE;
+			break;
+		}
+	}
+	if (nxt_cmd_delete(self, NXT_PROBE_FILE) != 0 || res != 0)
+		return -1;
+
+	/* WRITE sizes, each one creates the file again */
+	for (i = 0; (packet = nxt_probe_packets[i]); i++) {
+		if (packet > nxt_packet_max(self))
+			continue;
+		res = nxt_probe_write(self, data, packet - NXT_WRITE_REQ_SIZE);
+		if (nxt_cmd_delete(self, NXT_PROBE_FILE) != 0)
+			return -1;
+		if (res == 0) {
+			*write_size = packet - NXT_WRITE_REQ_SIZE;
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Look up the chunk sizes for key in the profile file path, an entry
+ * out of range counts as missing. With read_size NULL the entry for key
+ * is replaced by the given sizes; parallel bricks each write their own
+ * temporary file.
+ */
+static int nxt_chunk_profile(const char *path, const char *key,
+							 unsigned short *read_size, unsigned short *write_size,
+							 unsigned short new_read, unsigned short new_write) {
+	char line[128], tmp[PATH_MAX];
+	FILE *f, *out = NULL;
+	size_t n = strlen(key);
+	unsigned int r, w;
+	int fd, res = -1;
+
+	f = fopen(path, "r");
+	if (!read_size) {
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+		if ((fd = mkstemp(tmp)) < 0 || (out = fdopen(fd, "w")) == NULL) {
+			if (fd >= 0) {
+				close(fd);
+				unlink(tmp);
+			}
+			if (f)
+				fclose(f);
+			return -1;
+		}
+	}
+	while (f && fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, n) == 0 && line[n] == ' ') {
+			if (read_size && sscanf(line + n, "%u %u", &r, &w) == 2 && nxt_chunk_valid(r, w)) {
+				*read_size = r;
+				*write_size = w;
+				res = 0;
+				break;
+			}
+			continue;
+		}
+		if (out)
+			fputs(line, out);
+	}
+	if (f)
+		fclose(f);
+	if (out) {
+		fprintf(out, "%s %hu %hu\n", key, new_read, new_write);
+		if (fclose(out) == 0 && rename(tmp, path) == 0)
+			res = 0;
+		else
+			unlink(tmp);
+	}
+	return res;
+}
+
+/*
+ * Settle the READ and WRITE payload sizes before the first transfer:
+ * given with --chunk, cached for this firmware or probed. Without a
+ * working probe the conservative sizes are used.
+ */
+static void nxt_tune(NXT *self) {
+	nxt_get_firmware_version_reply r;
+	char path[PATH_MAX], key[64];
+	unsigned short read_size, write_size;
+
+	if (self->read_size && self->write_size)
+		return;
+	/* the probe itself transfers with these */
+	self->read_size = NXT_READ_SIZE;
+	self->write_size = NXT_WRITE_SIZE;
+
+	if (nxt_cmd_firmware_version(self, &r) != 0 ||
+		cache_dir(path, sizeof(path), "chunks", NULL) != 0)
+		return;
+	snprintf(key, sizeof(key), "%s %hhu.%hhu %hhu.%hhu", self->transport->name,
+			 r.protocol_major, r.protocol_minor, r.firmware_major, r.firmware_minor);
+	/* entries cached for more than the link takes are probed again */
+	if (self->probe || nxt_chunk_profile(path, key, &read_size, &write_size, 0, 0) != 0 ||
+		read_size > nxt_packet_max(self) - NXT_READ_REPLY_SIZE ||
+		write_size > nxt_packet_max(self) - NXT_WRITE_REQ_SIZE) {
+		if (nxt_probe_chunks(self, &read_size, &write_size) != 0) {
+			if (vflag)
+				fprintf(stderr, "chunk size probe failed, using read %hu, write %hu\n",
+						self->read_size, self->write_size);
+			return;
+		}
+		nxt_chunk_profile(path, key, NULL, NULL, read_size, write_size);
+	}
+	if (vflag)
+		fprintf(stderr, "chunk sizes for %s: read %hu, write %hu\n", key, read_size, write_size);
+	self->read_size = read_size;
+	self->write_size = write_size;
+}
+
+/*
+ * Read the remaining filesize bytes of an open file handle with up to
+ * self->window READ requests in flight. Returns the number of bytes
+ * written to sink or -1 on error.
+ */
+static long nxt_read_pipelined(NXT *self, unsigned char handle,
+							   unsigned int filesize, FileSink *sink) {
+	Buf *buf;
+	Buf reply_buf;
+	UsbPipe *pipe;
+	unsigned int requested = 0;
+	unsigned int received = 0;
+	unsigned int seq;
+	unsigned short chunksize;
+	nxt_read_reply r;
+	int len, error = 0;
+
+	if ((pipe = usb_pipe_open(self, self->window)) == NULL)
+		return -1;
+
+	while (received < filesize && !error) {
+		/* fill the window */
+		while (requested < filesize &&
+			   pipe->submitted - pipe->reaped < (unsigned int) pipe->window) {
+			if (filesize - requested >= self->read_size)
+				chunksize = self->read_size;
+			else
+				chunksize = filesize - requested;
+			buf = usb_pipe_request(pipe);
+			if ((len = nxt_read_enc(buf->buf, buf->size, 1, handle, chunksize)) < 0) {
+				error = 1;
+				break;
+			}
+			buf->offset = len;
+			if (usb_pipe_submit(pipe, "READ") != 0) {
+				error = 1;
+				break;
+			}
+			requested += chunksize;
+		}
+		if (error)
+			break;
+
+		/* replies come back in order, seq determines the file offset */
+		buf = &reply_buf;
+		if (usb_pipe_reap(pipe, buf, &seq, "READ") != 0) {
+			error = 1;
+			break;
+		}
+		if (filesize - seq * self->read_size >= self->read_size)
+			chunksize = self->read_size;
+		else
+			chunksize = filesize - seq * self->read_size;
+
+		if (nxt_failed(nxt_read_dec(buf->buf, buf->limit, &r))) {
+			error = 1;
+			break;
+		}
+		if (r.handle != handle || r.size != chunksize ||
+			NXT_READ_REPLY_SIZE + chunksize > buf->limit) {
+			fprintf(stderr, "nxt_read_pipelined: error: seq=%u readsize=%hu size=%hu\n",
+					seq, r.size, chunksize);
+			error = 1;
+			break;
+		}
+		if (fio_sink_write(sink, buf->buf + NXT_READ_REPLY_SIZE, chunksize) != 0) {
+			error = 1;
+			break;
+		}
+		received += chunksize;
+		stats_transfer_progress(received);
+	}
+
+	usb_pipe_close(pipe);
+	/* received is unsigned, -1 must not go through a conditional with it */
+	if (error)
+		return -1;
+	return received;
+}
+
+/*
+ * Recover from a failed READ at offset. The brick may or may not have
+ * advanced its file position, so the file is opened again and read up
+ * to offset. The new handle is stored in handle.
+ */
+static int nxt_reopen_read(NXT *self, const char *filename, unsigned char *handle,
+						   unsigned int filesize, unsigned int offset) {
+	Buf data;
+	unsigned int size;
+	unsigned short chunksize;
+
+	/* fails if the brick has dropped the handle already */
+	nxt_cmd_close(self, *handle);
+	if (nxt_cmd_open_read(self, filename, handle, &size) != 0)
+		return -1;
+	if (size != filesize) {
+		fprintf(stderr, "error: %s changed while reading\n", filename);
+		return -1;
+	}
+	while (offset > 0) {
+		chunksize = offset >= self->read_size ? self->read_size : offset;
+		if (nxt_cmd_read(self, *handle, &data, chunksize) != 0)
+			return -1;
+		offset -= chunksize;
+	}
+	return 0;
+}
+
+/*
+ * Download filename into sink. With expect >= 0 the remote file must
+ * have that size, archives write it out before the data.
+ */
+int nxt_get_file_sink(NXT *self, const char *filename, FileSink *sink, long expect) {
+	Buf data;
+	unsigned int filesize;
+	unsigned short chunksize;
+	unsigned int transferred = 0;
+	unsigned int total;
+	unsigned char handle;
+	int retries = 0, recovered;
+	double start;
+	long res;
+
+	nxt_tune(self);
+	start = nxt_clock();
+
+	/* open file handle */
+	if (nxt_cmd_open_read(self, filename, &handle, &filesize) != 0) {
+		return -1;
+	}
+	if (expect >= 0 && filesize != (unsigned long) expect) {
+		fprintf(stderr, "error: %s changed while reading\n", filename);
+		nxt_cmd_close(self, handle);
+		return -1;
+	}
+	total = filesize;
+	stats_transfer_begin(filename, filesize);
+
+	if (self->window > 1) {
+		/* keep several READ requests in flight */
+		if ((res = nxt_read_pipelined(self, handle, filesize, sink)) >= 0) {
+			transferred = res;
+			filesize = 0;
+		}
+	} else {
+		/* read data in lock-step */
+		while (filesize > 0) {
+			/* build command */
+			if (filesize >= self->read_size)
+				chunksize = self->read_size;
+			else
+				chunksize = filesize;
+
+			if (nxt_cmd_read(self, handle, &data, chunksize) != 0) {
+				recovered = 0;
+				while (!recovered && retries < NXT_RETRIES) {
+					nxt_retry(self, NXT_CMD_READ, retries++, "READ");
+					recovered = nxt_reopen_read(self, filename, &handle,
+												total, transferred) == 0;
+				}
+				if (!recovered)
+					break;
+				continue;
+			}
+
+			if (fio_sink_write(sink, data.buf, data.limit) != 0) {
+				break;
+			}
+			transferred += chunksize;
+			filesize -= chunksize;
+			retries = 0;
+			stats_transfer_progress(transferred);
+		}
+	}
+	stats_transfer_end();
+
+	if (nxt_cmd_close(self, handle) != 0) {
+		return -1;
+	}
+
+	if (filesize == 0) {
+		/* keep stdout clean when the data goes there */
+		nxt_print_rate(sink->fd == STDOUT_FILENO ? stderr : stdout,
+					   "transfered to", transferred, filename,
+					   nxt_clock() - start);
+		return 0;
+	} else {
+		return -1;
+	}
+}
+
+int nxt_get_file(NXT *self, const char *filename) {
+	return nxt_get_file_as(self, filename, filename);
+}
+
+/*
+ * Resumable downloads go to localname.part. localname.resume names the
+ * remote file and its size, so a later run only continues a part that
+ * belongs to the same file.
+ */
+static int nxt_journal_read(const char *path, char *filename, unsigned int *filesize) {
+	FILE *f;
+	int res;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	res = fscanf(f, "%19s %u", filename, filesize) == 2 ? 0 : -1;
+	fclose(f);
+	return res;
+}
+
+static int nxt_journal_write(const char *path, const char *filename, unsigned int filesize) {
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "error: could not write %s\n", path);
+		return -1;
+	}
+	fprintf(f, "%s %u\n", filename, filesize);
+	if (fclose(f) != 0) {
+		fprintf(stderr, "error: could not write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The protocol has no way to start a READ at an offset, so the part
+ * already on disk is read again and compared on the way, only the rest
+ * is written. That still saves the local writes and catches a remote
+ * file that changed in between.
+ */
+static int nxt_get_file_resume(NXT *self, const char *filename, const char *localname) {
+	char part[PATH_MAX], journal[PATH_MAX], name[20];
+	unsigned int filesize, size;
+	unsigned char handle;
+	FileSource have;
+	FileSink sink;
+	struct stat sb;
+	int res;
+
+	if (strcmp(localname, "-") == 0) {
+		fprintf(stderr, "error: can not resume a download to stdout\n");
+		return -1;
+	}
+	if (lstat(localname, &sb) == 0) {
+		fprintf(stderr, "error: local file %s exists\n", localname);
+		return -1;
+	}
+	if (snprintf(part, sizeof(part), "%s.part", localname) >= (int) sizeof(part) ||
+		snprintf(journal, sizeof(journal), "%s.resume", localname) >= (int) sizeof(journal)) {
+		fprintf(stderr, "error: local filename too long\n");
+		return -1;
+	}
+	if ((res = nxt_cmd_find(self, filename, &handle, NULL, &filesize)) != 0) {
+		if (res == -2)
+			fprintf(stderr, "error: %s not found\n", filename);
+		return -1;
+	}
+	nxt_cmd_close(self, handle);
+
+	memset(&have, 0, sizeof(have));
+	if (nxt_journal_read(journal, name, &size) == 0 &&
+		strcmp(name, filename) == 0 && size == filesize &&
+		stat(part, &sb) == 0 && (unsigned long) sb.st_size <= filesize) {
+		if (sb.st_size > 0 && fio_source_open(&have, part) != 0)
+			return -1;
+		if (have.size > 0)
+			printf("resuming %s at %lu of %u bytes\n", filename,
+				   (unsigned long) have.size, filesize);
+	} else if (nxt_journal_write(journal, filename, filesize) != 0) {
+		return -1;
+	}
+
+	if (fio_sink_open_resume(&sink, part, self->sync, have.data, have.size) != 0) {
+		fio_source_close(&have);
+		return -1;
+	}
+	res = nxt_get_file_sink(self, filename, &sink, -1);
+	if (fio_sink_close(&sink) != 0)
+		res = -1;
+	fio_source_close(&have);
+
+	if (res != 0) {
+		fprintf(stderr, "%s kept, run again with --resume to continue\n", part);
+		return -1;
+	}
+	/* link fails rather than replacing a file that showed up meanwhile */
+	if (link(part, localname) != 0) {
+		fprintf(stderr, "error: could not create local file %s\n", localname);
+		return -1;
+	}
+	unlink(part);
+	unlink(journal);
+	return 0;
+}
+
+/*
+ * Get remote file filename and store it in local file localname, "-"
+ * writes to stdout.
+ */
+int nxt_get_file_as(NXT *self, const char *filename, const char *localname) {
+	FileSink sink;
+	int res;
+
+	if (!filename) {
+		fprintf(stderr, "error: filename missing\n");
+		return -1;
+	}
+	if (strlen(filename) >= 20) {
+		fprintf(stderr, "error: filename too long\n");
+		return -1;
+	}
+	if (self->resume)
+		return nxt_get_file_resume(self, filename, localname);
+
+	if (fio_sink_open(&sink, localname, self->sync, 0777) != 0) {
+		return -1;
+	}
+	res = nxt_get_file_sink(self, filename, &sink, -1);
+	if (fio_sink_close(&sink) != 0) {
+		res = -1;
+	}
+
+	return res;
+}
+
+/*
+ * Upload src from offset on keeping up to self->window checked WRITE
+ * requests in flight. Returns the number of bytes written or -1.
+ */
+static long nxt_write_pipelined(NXT *self, unsigned char handle, FileSource *src,
+								unsigned int offset) {
+	Buf *buf;
+	Buf reply_buf;
+	UsbPipe *pipe;
+	unsigned char *data;
+	unsigned int sent = offset;
+	unsigned int acked = offset;
+	unsigned int seq;
+	unsigned short chunksize;
+	nxt_write_reply r;
+	int error = 0;
+
+	if ((pipe = usb_pipe_open(self, self->window)) == NULL)
+		return -1;
+
+	while (acked < src->size && !error) {
+		/* fill the window */
+		while (sent < src->size &&
+			   pipe->submitted - pipe->reaped < (unsigned int) pipe->window) {
+			if (src->size - sent >= self->write_size)
+				chunksize = self->write_size;
+			else
+				chunksize = src->size - sent;
+			/* build the request in the transfer buffer */
+			buf = usb_pipe_request(pipe);
+			if (nxt_write_enc(buf->buf, buf->size, 1, handle) < 0 ||
+				buf_reserve(buf, NXT_WRITE_REQ_SIZE) == NULL ||
+				(data = buf_reserve(buf, chunksize)) == NULL) {
+				error = 1;
+				break;
+			}
+			memcpy(data, src->data + sent, chunksize);
+			if (usb_pipe_submit(pipe, "WRITE") != 0) {
+				error = 1;
+				break;
+			}
+			sent += chunksize;
+		}
+		if (error)
+			break;
+
+		buf = &reply_buf;
+		if (usb_pipe_reap(pipe, buf, &seq, "WRITE") != 0) {
+			error = 1;
+			break;
+		}
+		if (src->size - offset - seq * self->write_size >= self->write_size)
+			chunksize = self->write_size;
+		else
+			chunksize = src->size - offset - seq * self->write_size;
+
+		if (nxt_failed(nxt_write_dec(buf->buf, buf->limit, &r))) {
+			error = 1;
+			break;
+		}
+		if (r.handle != handle || r.size != chunksize) {
+			fprintf(stderr, "nxt_write_pipelined: error: seq=%u writesize=%hu size=%hu\n",
+					seq, r.size, chunksize);
+			error = 1;
+			break;
+		}
+		acked += chunksize;
+		stats_transfer_progress(acked);
+	}
 
-	if (nxt_simple_command(self, "GET_BATTERY_LEVEL", "bb",
-						   NXT_DIRECT_COMMAND, NXT_CMD_GET_BATTERY_LEVEL) == -1)
+	usb_pipe_close(pipe);
+	/* acked is unsigned, keep -1 out of a conditional with it */
+	if (error)
 		return -1;
-	if (buf_read_short(self->buf, &mv) == -1) 
-		return -1;
-
-	printf("battery level: %dmV\n", mv);
-	return 0;
+	return acked - offset;
 }
 
-int nxt_print_firmware_version(NXT* self){
-	unsigned char pmajor, pminor;
-	unsigned char fmajor, fminor;
-
-	if (nxt_simple_command(self, "GET_FIRMWARE_VERSION", "bb", 
-						   NXT_SYSTEM_COMMAND, NXT_CMD_GET_FIRMWARE_VERSION) == -1)
-		return -1;
-
-	if (buf_unpack(self->buf, "bbbb", &pminor, &pmajor, &fminor, &fmajor) == -1)
-		return -1;
+/* programs, sounds and images are used in place, from contiguous flash */
+static const char *nxt_linear_types[] = { "rxe", "rpg", "rtm", "ric", "rso", NULL };
+static const char *nxt_system_types[] = { "sys", NULL };
 
-	printf("protocol version: %hhu.%hhu\n", pmajor, pminor);
-	printf("firmware version: %hhu.%hhu\n", fmajor, fminor);
+static int nxt_has_type(const char *filename, const char **types) {
+	const char *ext;
+	int i;
 
+	if ((ext = strrchr(filename, '.')) == NULL)
+		return 0;
+	for (i = 0; types[i]; i++)
+		if (strcasecmp(ext + 1, types[i]) == 0)
+			return 1;
 	return 0;
 }
 
-int nxt_print_device_info(NXT* self){
-	int i;
-	unsigned int signal_strength;
-	unsigned int free_space;
-	unsigned char btaddr[7];
-	char name[15];
+/*
+ * Whether an upload of filename uses OPEN_WRITE_LINEAR
+ */
+int nxt_is_linear(NXT *self, const char *filename) {
+	return self->linear == NXT_LINEAR_ALWAYS ||
+		(self->linear == NXT_LINEAR_AUTO && nxt_has_type(filename, nxt_linear_types));
+}
 
-	if (nxt_simple_command(self, "GET_DEVICE_INFO", "bb",
-						   NXT_SYSTEM_COMMAND, NXT_CMD_GET_DEVICE_INFO) == -1)
-		return -1;
+/*
+ * Only data files can be appended to, the firmware writes programs,
+ * sounds and images linearly in one go.
+ */
+static int nxt_is_data_file(const char *filename) {
+	return !nxt_has_type(filename, nxt_linear_types) &&
+		!nxt_has_type(filename, nxt_system_types);
+}
 
-	buf_read_string(self->buf, name, 15);
-	for (i = 0; i < sizeof(btaddr); ++i)
-		buf_read_byte(self->buf, &btaddr[i]);
-	buf_read_uint(self->buf, &signal_strength);
-	buf_read_uint(self->buf, &free_space);
+/*
+ * Linear files need filesize contiguous bytes of flash. The brick only
+ * reports the total free flash, so that is checked before the old file
+ * is deleted, fragmentation shows when OPEN_WRITE_LINEAR fails.
+ */
+static int nxt_check_space(NXT *self, const char *filename, unsigned int filesize) {
+	unsigned int oldsize = 0;
+	unsigned char handle;
+	NXTInfo info;
 
-	printf("nxt name: %s\n", name);
-	printf("bluetooth address: ");
-	for (i=0; i < sizeof(btaddr); ++i) {
-		if (i > 0)
-			printf(":");
-		printf("%02hhx", btaddr[i]);
+	if (nxt_get_device_info(self, &info) != 0)
+		return -1;
+	if (self->cache) {
+		cache_lookup(self->cache, filename, &oldsize);
+	} else if (nxt_cmd_find(self, filename, &handle, NULL, &oldsize) == 0) {
+		nxt_cmd_close(self, handle);
+	}
+	if (info.free_space + oldsize < filesize) {
+		fprintf(stderr, "error: %s needs %u bytes of flash, %u are free\n",
+				filename, filesize, info.free_space + oldsize);
+		return -1;
 	}
-	printf("\n");
-	printf("bluetooth signal strength: %u\n", signal_strength);
-	printf("free user flash: %u\n", free_space);
-
 	return 0;
 }
 
-int nxt_print_files(NXT *self, const char *pattern) {
-	char filename[20];
-	int error = 0;
-	unsigned int filesize;
-	unsigned char handle;
-	unsigned char handle_valid = 0;
+/*
+ * Flash address of a linear file. Returns 0 with address set, 1 if
+ * filename is not a linear file and -1 on error.
+ */
+int nxt_flash_address(NXT *self, const char *filename, unsigned long *address) {
+	Buf *buf = self->buf;
+	nxt_open_read_linear_reply r;
+	int status;
 
-	if (pattern && strlen(pattern) >= 20) {
-		fprintf(stderr, "error: pattern too long\n");
+	if (nxt_transact(self, nxt_open_read_linear_enc(buf->buf, buf->size, 1, filename),
+					 "OPEN_READ_LINEAR") != 0)
 		return -1;
-	}
-
-	if (! pattern) {
-		pattern = "*.*";
-	}
+	status = nxt_open_read_linear_dec(buf->buf, buf->limit, &r);
+	if (status == NXT_ERROR_NOT_A_LINEAR_FILE)
+		return 1;
+	if (nxt_failed(status))
+		return -1;
+	*address = r.address;
+	return 0;
+}
 
-	while (1) {
-		int res;
-		res = nxt_cmd_find(self, pattern, &handle, filename, &filesize);
-		/* file not found */
-		if (res == -2) {
+/*
+ * Ask the brick whether linear files of the given sizes fit into its
+ * flash in that order: they are created empty and deleted again.
+ * Returns 1 if they fit, 0 if not and -1 on error.
+ */
+int nxt_linear_fits(NXT *self, const unsigned int *sizes, int count) {
+	Buf *buf = self->buf;
+	nxt_open_write_linear_reply r;
+	char name[32];
+	int i, created, status, res = 1;
+
+	for (created = 0; created < count; created++) {
+		snprintf(name, sizeof(name), "nxtctl%d.tmp", created);
+		if (nxt_transact(self, nxt_open_write_linear_enc(buf->buf, buf->size, 1, name,
+														 sizes[created]),
+						 "OPEN_WRITE_LINEAR") != 0) {
+			res = -1;
 			break;
 		}
-		if (res != 0) {
-			error = 1;
+		status = nxt_open_write_linear_dec(buf->buf, buf->limit, &r);
+		if (status == NXT_ERROR_NO_LINEAR_SPACE || status == NXT_ERROR_NO_SPACE) {
+			res = 0;
 			break;
 		}
-
-		/* this makes nxt_cmd_find do "find next" instead of "find first" */
-		pattern = 0;
-		handle_valid = 1;
-		printf("%6u %s\n", filesize, filename);
-	}
-
-	if (handle_valid) {
-		if (nxt_cmd_close(self, handle) != 0) {
-			error = 1;
+		if (nxt_failed(status)) {
+			res = -1;
+			break;
+		}
+		if (nxt_cmd_close(self, r.handle) != 0) {
+			res = -1;
+			created++;
+			break;
 		}
 	}
-	
-	return (error ? -1 : 0);
+	for (i = 0; i < created; i++) {
+		snprintf(name, sizeof(name), "nxtctl%d.tmp", i);
+		if (nxt_cmd_delete(self, name) != 0)
+			res = -1;
+	}
+	return res;
 }
 
-int nxt_start_program(NXT* self, const char* filename){
-	Buf *buf;
-	unsigned char reply, command, status;
-
-	if (!filename || strlen(filename) >= 20) {
-		fprintf(stderr, "error: filename missing or too long\n");
-		return -1;
-	}
+/*
+ * A resumable upload is journaled in localfile.upload with the remote
+ * name and the size, hash and mtime of the local file. An upload only
+ * continues while the journal matches, a local file that changed in
+ * between is uploaded from the start.
+ */
+static void nxt_upload_stamp(const char *filename, const FileSource *src,
+							 char *stamp, size_t len) {
+	snprintf(stamp, len, "%s %lu %016" PRIx64 " %lld\n", filename,
+			 (unsigned long) src->size, fio_hash(FIO_HASH_INIT, src->data, src->size),
+			 (long long) src->mtime);
+}
 
-	buf = self->buf;
-	buf_reset(buf);
-	buf_pack(buf, "bbs", NXT_DIRECT_COMMAND, NXT_CMD_START_PROGRAM, filename, 20);
+static int nxt_upload_journaled(const char *journal, const char *stamp) {
+	char line[128];
+	FILE *f;
+	int res;
 
-	if (usb_communicate(self->handle, buf, "START_PROGRAM") != 0) {
-		return -1;
-	}
+	if ((f = fopen(journal, "r")) == NULL)
+		return 0;
+	res = fgets(line, sizeof(line), f) != NULL && strcmp(line, stamp) == 0;
+	fclose(f);
+	return res;
+}
 
-	buf_unpack(buf, "bbb", &reply, &command, &status);
+static int nxt_upload_journal(const char *journal, const char *stamp) {
+	FILE *f;
 
-	if (status == NXT_ERROR_OUT_OF_RANGE) {
-		/* seems to be error for file not found */
-		fprintf(stderr, "error: file not found\n");
+	if ((f = fopen(journal, "w")) == NULL || fputs(stamp, f) == EOF) {
+		fprintf(stderr, "error: could not write %s\n", journal);
+		if (f)
+			fclose(f);
 		return -1;
 	}
-
-	if (nxt_failed(status)) {
-			return -1;
+	if (fclose(f) != 0) {
+		fprintf(stderr, "error: could not write %s\n", journal);
+		return -1;
 	}
-
 	return 0;
 }
 
-int nxt_stop_program(NXT* self){
-	return nxt_simple_command(self, "STOP_PROGRAM", "bb", NXT_DIRECT_COMMAND, NXT_CMD_STOP_PROGRAM);
-}
+/*
+ * Continue an interrupted upload of filename. The remote file must have
+ * been created with OPEN_WRITE_DATA and the same size as the local one.
+ * Returns 1 with an open handle and the bytes already written in offset,
+ * 2 if the remote file is complete, 0 if it has to be written from the
+ * start and -1 on error.
+ */
+static int nxt_open_append(NXT *self, const char *filename, unsigned int filesize,
+						   unsigned char *handle, unsigned int *offset) {
+	unsigned int size, available;
+	int status;
+
+	if ((status = nxt_cmd_find(self, filename, handle, NULL, &size)) != 0)
+		return status == -2 ? 0 : -1;
+	nxt_cmd_close(self, *handle);
+	if (size != filesize)
+		return 0;
 
-/* max chunk size (64) - header (6) - one byte too much??? (1) */
-#define NXT_READ_SIZE 57 
+	status = nxt_cmd_open_append_data(self, filename, handle, &available);
+	if (status == NXT_ERROR_FILE_IS_FULL)
+		return 2;
+	if (status == NXT_ERROR_APPEND_NOT_POSSIBLE)
+		return 0;
+	if (status < 0 || nxt_failed(status))
+		return -1;
+	if (available > filesize) {
+		nxt_cmd_close(self, *handle);
+		return 0;
+	}
+	*offset = filesize - available;
+	return 1;
+}
 
-int nxt_get_file_fd(NXT *self, const char *filename, int fd) {
-	char data[BUFSIZ];
+/*
+ * With self->window > 1 the WRITEs are pipelined. Otherwise with
+ * self->interval > 0 only every interval-th chunk (and the last one)
+ * is sent as a checked WRITE, the others are sent without reply. The
+ * remote file size is verified after CLOSE in that case.
+ */
+int nxt_put_file_source(NXT* self, const char *filename, FileSource *src) {
+	char journal[PATH_MAX], stamp[128];
+	unsigned char *data;
 	unsigned int filesize;
+	unsigned int remotesize;
 	unsigned short chunksize;
-	unsigned int transferred = 0;
+	unsigned int byteswritten = 0;
+	unsigned int chunk = 0;
 	unsigned char handle;
+	int error = 0;
+	int reply;
+	int linear, resume, resumed = 0;
+	long res;
+	double start;
+
+	nxt_tune(self);
+	filesize = src->size;
+	start = nxt_clock();
+	linear = nxt_is_linear(self, filename);
+	/* only a named local file can be journaled */
+	resume = self->resume && !linear && nxt_is_data_file(filename) && src->mtime != 0;
+	if (resume) {
+		if (snprintf(journal, sizeof(journal), "%s.upload", src->name) >= (int) sizeof(journal)) {
+			fprintf(stderr, "error: local filename too long\n");
+			return -1;
+		}
+		nxt_upload_stamp(filename, src, stamp, sizeof(stamp));
+	}
 
-	/* open file handle */
-	if (nxt_cmd_open_read(self, filename, &handle, &filesize) != 0) {
-		return -1;
+	if (resume && nxt_upload_journaled(journal, stamp) &&
+		(resumed = nxt_open_append(self, filename, filesize, &handle, &byteswritten)) != 0) {
+		if (resumed < 0)
+			return -1;
+		if (resumed == 2) {
+			printf("%s is uploaded already\n", filename);
+			unlink(journal);
+			return 0;
+		}
+		printf("resuming %s at %u of %u bytes\n", filename, byteswritten, filesize);
+		filesize -= byteswritten;
+	} else {
+		if (linear && nxt_check_space(self, filename, filesize) != 0)
+			return -1;
+		if (self->cache) {
+			/* no round trips needed for the existence check */
+			if (cache_lookup(self->cache, filename, NULL) == 0)
+				nxt_cmd_delete(self, filename);
+		} else if (nxt_cmd_find(self, filename, &handle, 0, 0) == 0) {
+			nxt_cmd_close(self, handle);
+			nxt_cmd_delete(self, filename);
+		}
+		cache_remove(self->cache, filename);
+		if (resume && nxt_upload_journal(journal, stamp) != 0)
+			return -1;
+
+		/* data files can be appended to if the upload is cut short */
+		if (linear)
+			res = nxt_cmd_open_write_linear(self, filename, filesize, &handle);
+		else if (resume)
+			res = nxt_cmd_open_write_data(self, filename, filesize, &handle);
+		else
+			res = nxt_cmd_open_write(self, filename, filesize, &handle);
+		if (res != 0)
+			return -1;
+	}
+	stats_transfer_begin(filename, src->size);
+	stats_transfer_progress(byteswritten);
+
+	if (self->window > 1) {
+		if ((res = nxt_write_pipelined(self, handle, src, byteswritten)) >= 0) {
+			byteswritten += res;
+			filesize = 0;
+		} else {
+			error = 1;
+		}
 	}
 
-	/* read data */
-	while (filesize > 0) {
-		/* build command */
-		if (filesize >= NXT_READ_SIZE)
-			chunksize = NXT_READ_SIZE;
+	while (filesize > 0 && !error) {
+		if (filesize >= self->write_size)
+			chunksize = self->write_size;
 		else
 			chunksize = filesize;
 
-		if (nxt_cmd_read(self, handle, data, chunksize) != 0) {
+		/* copy straight from the mapped file into the request */
+		if ((data = nxt_write_payload(self, chunksize)) == NULL) {
+			error = 1;
 			break;
 		}
-
-		if (vflag) 
-			fprintf(stderr, "nxt_get_file_fd: filesize=%d, chunksize=%d\n", filesize, chunksize);
-
-		write(fd, data, chunksize);
-		transferred += chunksize;
+		memcpy(data, src->data + byteswritten, chunksize);
+		chunk++;
+		reply = self->interval == 0 || chunksize == filesize ||
+			chunk % self->interval == 0;
+		if (nxt_cmd_write(self, handle, chunksize, reply) != 0) {
+			error = 1;
+			break;
+		}
+		byteswritten += chunksize;
 		filesize -= chunksize;
+		stats_transfer_progress(byteswritten);
 	}
-
-	if (nxt_cmd_close(self, handle) != 0) {
+	stats_transfer_end();
+
+	if (nxt_cmd_close(self, handle) != 0 || error) {
+		/* a partial file may be left on the brick */
+		cache_invalidate(self->cache);
+		if (resume)
+			fprintf(stderr, "%s is partly uploaded, run again with --resume to continue\n",
+					filename);
 		return -1;
 	}
 
-	if (filesize == 0) {
-		printf("%u bytes transfered to %s\n", transferred, filename);
-		return 0;
-	} else {
-		return -1;
+	if (self->interval > 0 && self->window <= 1) {
+		if (nxt_cmd_find(self, filename, &handle, 0, &remotesize) != 0) {
+			fprintf(stderr, "error: uploaded file %s not found\n", filename);
+			return -1;
+		}
+		nxt_cmd_close(self, handle);
+		if (remotesize != byteswritten) {
+			fprintf(stderr, "error: remote size %u does not match %u\n",
+					remotesize, byteswritten);
+			return -1;
+		}
 	}
+
+	if (resume)
+		unlink(journal);
+	cache_update(self->cache, filename, byteswritten);
+	nxt_print_rate(stdout, "uploaded to", byteswritten, filename, nxt_clock() - start);
+	return 0;
 }
 
-int nxt_get_file(NXT *self, const char *filename) {
+int nxt_put_file(NXT* self, const char* filename){
+	return nxt_put_file_as(self, filename, filename);
+}
+
+/*
+ * Upload local file localname as remote file filename, "-" reads from
+ * stdin.
+ */
+int nxt_put_file_as(NXT *self, const char *filename, const char *localname) {
+	FileSource src;
 	int res;
-	int fd;
 
 	if (!filename) {
 		fprintf(stderr, "error: filename missing\n");
@@ -743,92 +2860,476 @@ int nxt_get_file(NXT *self, const char *filename) {
 		return -1;
 	}
 
-	fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0777);
-	if (fd < 0) {
-		fprintf(stderr, "error: could not open local file %s\n", filename);
+	if (fio_source_open(&src, localname) != 0) {
 		return -1;
 	}
-	res = nxt_get_file_fd(self, filename, fd);
-	close(fd);
+	res = nxt_put_file_source(self, filename, &src);
+	fio_source_close(&src);
 
 	return res;
 }
 
-/* max chunk size (64) - header (3) - one byte too much??? (1) */
-#define NXT_WRITE_SIZE 60 
+/***********************************************************************/
+/* multi-file transfers                                                */
+/***********************************************************************/
+
+/*
+ * Many files are moved over one pipe at once: the OPEN, READ or WRITE
+ * and CLOSE requests of up to NXT_MAX_HANDLES files are interleaved, so
+ * the link stays busy instead of waiting for one file at a time. The
+ * replies come back in order, so every request is tagged with its file
+ * and chunk size by sequence number.
+ */
 
-static int nxt_put_file_fd(NXT* self, const char *filename, int fd) {
-	char data[BUFSIZ];
-	struct stat sb;
-	ssize_t nr;
-	unsigned int filesize;
-	unsigned short chunksize;
-	unsigned short byteswritten = 0;
+/* files the firmware can have open at once */
+#define NXT_MAX_HANDLES 16
+
+enum {
+	XFER_WAITING,	/* not opened yet */
+	XFER_OPENING,
+	XFER_OPEN,
+	XFER_CLOSING,
+	XFER_DONE
+};
+
+typedef struct {
+	char name[20];			/* remote file */
+	char local[PATH_MAX];
+	unsigned int size;
+	unsigned int sent;		/* bytes requested or written */
+	unsigned int done;		/* bytes acknowledged */
 	unsigned char handle;
+	int state;
+	int inflight;			/* requests without reply */
+	int local_open;
+	int failed;
+	FileSink sink;
+	FileSource src;
+} NXTXfer;
+
+typedef struct {
+	NXT *nxt;
+	int put;
+	NXTXfer *files;
+	int count;
+	int open;				/* files holding a handle */
+	int max_open;
+	int next;				/* round robin position */
+	int finished;
+	int failed;
+	unsigned long total;
+	unsigned long done;
+	struct {
+		int file;
+		unsigned short size;
+	} tag[NXT_MAX_WINDOW];
+} NXTMulti;
+
+static NXTXfer* nxt_multi_add(NXTMulti *m) {
+	if ((m->files = realloc(m->files, (m->count + 1) * sizeof(NXTXfer))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	memset(&m->files[m->count], 0, sizeof(NXTXfer));
+	return &m->files[m->count++];
+}
 
-	if (fstat(fd, &sb) != 0) {
-		fprintf(stderr, "error: could not get file size %s\n", filename);
-		return -1;
+static int nxt_multi_send(NXTMulti *m, UsbPipe *pipe, int i, unsigned short size,
+						  const char *desc) {
+	m->tag[pipe->submitted % NXT_MAX_WINDOW].file = i;
+	m->tag[pipe->submitted % NXT_MAX_WINDOW].size = size;
+	m->files[i].inflight++;
+	return usb_pipe_submit(pipe, desc);
+}
+
+static void nxt_multi_fail(NXTMulti *m, NXTXfer *x) {
+	x->failed = 1;
+	if (x->state == XFER_WAITING || x->state == XFER_OPENING) {
+		if (x->state == XFER_OPENING)
+			m->open--;
+		if (!m->put && x->local_open) {
+			fio_sink_close(&x->sink);
+			x->local_open = 0;
+		}
+		x->state = XFER_DONE;
+		m->finished++;
+		m->failed++;
+	}
+}
+
+/*
+ * Queue the next request: CLOSE files that are through, then the next
+ * chunk round robin, then OPEN more files. Returns 1 if a request was
+ * queued, 0 if there is nothing to do now and -1 on error.
+ */
+static int nxt_multi_next(NXTMulti *m, UsbPipe *pipe) {
+	NXT *self = m->nxt;
+	unsigned short chunksize;
+	unsigned char *data;
+	NXTXfer *x;
+	Buf *buf;
+	int i, j, len, linear;
+
+	for (i = 0; i < m->count; i++) {
+		x = &m->files[i];
+		if (x->state == XFER_OPEN && x->inflight == 0 && (x->failed || x->done == x->size)) {
+			buf = usb_pipe_request(pipe);
+			if ((len = nxt_close_enc(buf->buf, buf->size, 1, x->handle)) < 0)
+				return -1;
+			buf->offset = len;
+			x->state = XFER_CLOSING;
+			return nxt_multi_send(m, pipe, i, 0, "CLOSE") == 0 ? 1 : -1;
+		}
 	}
-	filesize = sb.st_size;
 
-	if (nxt_cmd_find(self, filename, &handle, 0, 0) == 0) {
-		nxt_cmd_close(self, handle);
-		nxt_cmd_delete(self, filename);
+	for (j = 0; j < m->count; j++) {
+		i = (m->next + j) % m->count;
+		x = &m->files[i];
+		if (x->state != XFER_OPEN || x->failed || x->sent == x->size)
+			continue;
+		m->next = i + 1;
+		buf = usb_pipe_request(pipe);
+		if (m->put) {
+			chunksize = x->size - x->sent < self->write_size ? x->size - x->sent : self->write_size;
+			if (nxt_write_enc(buf->buf, buf->size, 1, x->handle) < 0 ||
+				buf_reserve(buf, NXT_WRITE_REQ_SIZE) == NULL ||
+				(data = buf_reserve(buf, chunksize)) == NULL)
+				return -1;
+			memcpy(data, x->src.data + x->sent, chunksize);
+		} else {
+			chunksize = x->size - x->sent < self->read_size ? x->size - x->sent : self->read_size;
+			if ((len = nxt_read_enc(buf->buf, buf->size, 1, x->handle, chunksize)) < 0)
+				return -1;
+			buf->offset = len;
+		}
+		x->sent += chunksize;
+		return nxt_multi_send(m, pipe, i, chunksize, m->put ? "WRITE" : "READ") == 0 ? 1 : -1;
 	}
 
-	if (nxt_cmd_open_write(self, filename, filesize, &handle) != 0) {
-		return -1;
+	if (m->open >= m->max_open)
+		return 0;
+	for (i = 0; i < m->count; i++) {
+		x = &m->files[i];
+		if (x->state != XFER_WAITING)
+			continue;
+		if (m->put) {
+			/* DELETE and OPEN_WRITE go together */
+			if (pipe->submitted - pipe->reaped + 2 > (unsigned int) pipe->window)
+				return 0;
+			buf = usb_pipe_request(pipe);
+			if ((len = nxt_delete_enc(buf->buf, buf->size, 1, x->name)) < 0)
+				return -1;
+			buf->offset = len;
+			if (nxt_multi_send(m, pipe, i, 0, "DELETE") != 0)
+				return -1;
+			cache_remove(self->cache, x->name);
+			linear = nxt_is_linear(self, x->name);
+			buf = usb_pipe_request(pipe);
+			len = linear ?
+				nxt_open_write_linear_enc(buf->buf, buf->size, 1, x->name, x->size) :
+				nxt_open_write_enc(buf->buf, buf->size, 1, x->name, x->size);
+		} else {
+			if (!x->local_open) {
+				if (fio_sink_open(&x->sink, x->local, self->sync, 0777) != 0) {
+					nxt_multi_fail(m, x);
+					continue;
+				}
+				x->local_open = 1;
+			}
+			buf = usb_pipe_request(pipe);
+			len = nxt_open_read_enc(buf->buf, buf->size, 1, x->name);
+		}
+		if (len < 0)
+			return -1;
+		buf->offset = len;
+		x->state = XFER_OPENING;
+		m->open++;
+		return nxt_multi_send(m, pipe, i, 0, m->put ? "OPEN_WRITE" : "OPEN_READ") == 0 ? 1 : -1;
 	}
+	return 0;
+}
 
-	while (filesize > 0) {
-		if (filesize >= NXT_WRITE_SIZE)
-			chunksize = NXT_WRITE_SIZE;
+static void nxt_multi_opened(NXTMulti *m, NXTXfer *x, int status, unsigned char handle) {
+	if (status == NXT_SUCCESS) {
+		x->handle = handle;
+		x->state = XFER_OPEN;
+	} else if (status == NXT_ERROR_NO_MORE_HANDLES && m->open > 1) {
+		/* found the limit, try again when a handle is free */
+		m->open--;
+		m->max_open = m->open;
+		x->state = XFER_WAITING;
+	} else {
+		if (status < 0)
+			fprintf(stderr, "error: invalid reply opening %s\n", x->name);
 		else
-			chunksize = filesize;
+			fprintf(stderr, "error: %s: %s (0x%02x)\n", x->name, nxt_strerror(status), status);
+		nxt_multi_fail(m, x);
+	}
+}
 
-		if ((nr = read(fd, data, chunksize)) != chunksize) {
-			fprintf(stderr, "nxt_put_file: read failed. chunksize=%hd, nr=%zd\n", chunksize, nr);
-			break;
+/*
+ * Handle the reply to request seq. Returns -1 if the reply does not
+ * fit the request, the transfer can not go on then.
+ */
+static int nxt_multi_reply(NXTMulti *m, Buf *buf, unsigned int seq) {
+	int i = m->tag[seq % NXT_MAX_WINDOW].file;
+	unsigned short size = m->tag[seq % NXT_MAX_WINDOW].size;
+	NXTXfer *x = &m->files[i];
+	union {
+		nxt_open_read_reply open_read;
+		nxt_open_write_reply open_write;
+		nxt_open_write_linear_reply open_write_linear;
+		nxt_read_reply read;
+		nxt_write_reply write;
+		nxt_close_reply close;
+	} r;
+	int status;
+
+	x->inflight--;
+	if (buf->limit < 3)
+		return -1;
+	switch (buf->buf[1]) {
+	case NXT_CMD_DELETE:
+		/* mostly FILE_NOT_FOUND, OPEN_WRITE tells if it matters */
+		return 0;
+	/* the handle is only decoded on success */
+	case NXT_CMD_OPEN_READ:
+		status = nxt_open_read_dec(buf->buf, buf->limit, &r.open_read);
+		if (status == NXT_SUCCESS) {
+			m->total += r.open_read.filesize;
+			m->total -= x->size;
+			x->size = r.open_read.filesize;
 		}
-		if (nxt_cmd_write(self, handle, data, chunksize) != 0) {
-			break;
+		nxt_multi_opened(m, x, status, status == NXT_SUCCESS ? r.open_read.handle : 0xff);
+		return 0;
+	case NXT_CMD_OPEN_WRITE:
+		status = nxt_open_write_dec(buf->buf, buf->limit, &r.open_write);
+		nxt_multi_opened(m, x, status, status == NXT_SUCCESS ? r.open_write.handle : 0xff);
+		return 0;
+	case NXT_CMD_OPEN_WRITE_LINEAR:
+		status = nxt_open_write_linear_dec(buf->buf, buf->limit, &r.open_write_linear);
+		nxt_multi_opened(m, x, status,
+						 status == NXT_SUCCESS ? r.open_write_linear.handle : 0xff);
+		return 0;
+	case NXT_CMD_READ:
+		status = nxt_read_dec(buf->buf, buf->limit, &r.read);
+		if (x->failed)
+			return 0;
+		if (nxt_failed(status) || r.read.size != size ||
+			NXT_READ_REPLY_SIZE + size > buf->limit ||
+			fio_sink_write(&x->sink, buf->buf + NXT_READ_REPLY_SIZE, size) != 0) {
+			fprintf(stderr, "error: reading %s failed\n", x->name);
+			x->failed = 1;
+			return 0;
 		}
-		if (vflag) 
-			fprintf(stderr, "nxt_put_file: filesize=%u, chunksize=%hd\n", filesize, chunksize);
-		byteswritten += chunksize;
-		filesize -= chunksize;
+		break;
+	case NXT_CMD_WRITE:
+		status = nxt_write_dec(buf->buf, buf->limit, &r.write);
+		if (x->failed)
+			return 0;
+		if (nxt_failed(status) || r.write.size != size) {
+			fprintf(stderr, "error: writing %s failed\n", x->name);
+			x->failed = 1;
+			return 0;
+		}
+		break;
+	case NXT_CMD_CLOSE:
+		nxt_failed(nxt_close_dec(buf->buf, buf->limit, &r.close));
+		x->state = XFER_DONE;
+		m->open--;
+		m->finished++;
+		if (!m->put) {
+			if (fio_sink_close(&x->sink) != 0)
+				x->failed = 1;
+			x->local_open = 0;
+		}
+		if (x->failed) {
+			m->failed++;
+			cache_invalidate(m->nxt->cache);
+		} else {
+			if (m->put)
+				cache_update(m->nxt->cache, x->name, x->size);
+			printf("%u bytes %s %s\n", x->size, m->put ? "uploaded to" : "transfered to",
+				   x->name);
+		}
+		return 0;
+	default:
+		return -1;
 	}
+	x->done += size;
+	m->done += size;
+	stats_transfer_progress(m->done);
+	return 0;
+}
 
-	if (nxt_cmd_close(self, handle) != 0) {
+/*
+ * Run the queued transfers of m and print the total rate. Returns the
+ * number of failed files or -1 if the link failed.
+ */
+static int nxt_multi_run(NXTMulti *m, const char *what) {
+	NXT *self = m->nxt;
+	UsbPipe *pipe;
+	Buf reply;
+	unsigned int seq;
+	double start;
+	int i, res = 0;
+
+	nxt_tune(self);
+	m->max_open = NXT_MAX_HANDLES;
+	start = nxt_clock();
+	if ((pipe = usb_pipe_open(self, self->window > 1 ? self->window : NXT_MAX_HANDLES)) == NULL)
+		return -1;
+	stats_transfer_begin(what, m->total);
+	while (m->finished < m->count) {
+		while (pipe->submitted - pipe->reaped < (unsigned int) pipe->window &&
+			   (res = nxt_multi_next(m, pipe)) > 0)
+			;
+		if (res < 0 || pipe->submitted == pipe->reaped)
+			break;
+		if (usb_pipe_reap(pipe, &reply, &seq, what) != 0 ||
+			nxt_multi_reply(m, &reply, seq) != 0) {
+			res = -1;
+			break;
+		}
+	}
+	stats_transfer_end();
+	/* replies still in flight carry the handles of files being opened */
+	while (m->finished < m->count && pipe->reaped != pipe->submitted &&
+		   usb_pipe_reap(pipe, &reply, &seq, "drain") == 0)
+		nxt_multi_reply(m, &reply, seq);
+	usb_pipe_close(pipe);
+
+	if (m->finished < m->count) {
+		/* the link failed, give back every handle that was opened */
+		for (i = 0; i < m->count; i++) {
+			if (m->files[i].state == XFER_OPEN || m->files[i].state == XFER_CLOSING)
+				nxt_cmd_close(self, m->files[i].handle);
+			else if (m->files[i].state == XFER_OPENING)
+				fprintf(stderr, "warning: %s may be left open on the brick\n",
+						m->files[i].name);
+			if (!m->put && m->files[i].local_open)
+				fio_sink_close(&m->files[i].sink);
+		}
+		cache_invalidate(self->cache);
+		fprintf(stderr, "error: %d of %d files not transfered\n", m->count - m->finished,
+				m->count);
 		return -1;
 	}
+	printf("%lu bytes in %d files %s (%.1f KB/s)\n", m->done, m->count - m->failed,
+		   m->put ? "uploaded" : "transfered", m->done / (nxt_clock() - start) / 1024);
+	if (m->failed)
+		fprintf(stderr, "error: %d of %d files failed\n", m->failed, m->count);
+	return m->failed;
+}
+
+static int nxt_multi_list(const char *filename, unsigned int filesize, void *arg) {
+	NXTMulti *m = arg;
+	NXTXfer *x;
 
-	printf("%hu bytes uploaded to %s\n", byteswritten, filename);
+	x = nxt_multi_add(m);
+	strcpy(x->name, filename);
+	x->size = filesize;
+	m->total += filesize;
 	return 0;
 }
 
-int nxt_put_file(NXT* self, const char* filename){
-	int res;
-	int fd;
+/*
+ * Get all remote files matching pattern, into directory dir if not
+ * NULL. Local files are never overwritten.
+ */
+int nxt_get_files(NXT *self, const char *pattern, const char *dir) {
+	NXTMulti m;
+	int i, res;
 
-	if (!filename) {
-		fprintf(stderr, "error: filename missing\n");
+	if (strlen(pattern) >= 20) {
+		fprintf(stderr, "error: pattern too long\n");
 		return -1;
 	}
-	if (strlen(filename) >= 20) {
-		fprintf(stderr, "error: filename too long\n");
+	memset(&m, 0, sizeof(m));
+	m.nxt = self;
+	if ((self->cache ? cache_list(self->cache, pattern, nxt_multi_list, &m) :
+		 nxt_list_files(self, pattern, nxt_multi_list, &m)) != 0) {
+		free(m.files);
 		return -1;
 	}
-
-	fd = open(filename, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "error: could not open local file %s\n", filename);
+	if (m.count == 0) {
+		fprintf(stderr, "error: no files match %s\n", pattern);
 		return -1;
 	}
-	res = nxt_put_file_fd(self, filename, fd);
-	close(fd);
+	for (i = 0; i < m.count; i++) {
+		if (dir)
+			snprintf(m.files[i].local, PATH_MAX, "%s/%s", dir, m.files[i].name);
+		else
+			strcpy(m.files[i].local, m.files[i].name);
+	}
+	res = nxt_multi_run(&m, pattern);
+	free(m.files);
+	return res == 0 ? 0 : -1;
+}
+
+static int nxt_multi_replaced(const char *filename, unsigned int filesize, void *arg) {
+	NXTMulti *m = arg;
+	int i;
+
+	for (i = 0; i < m->count; i++) {
+		if (strcmp(m->files[i].name, filename) == 0) {
+			m->total -= filesize < m->total ? filesize : m->total;
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Upload the local files, each under its base name. Nothing is deleted
+ * unless there is flash for all of them.
+ */
+int nxt_put_files(NXT *self, char *const *localnames, int count) {
+	unsigned long need;
+	NXTInfo info;
+	NXTMulti m;
+	NXTXfer *x;
+	const char *base;
+	int i, res = -1;
+
+	memset(&m, 0, sizeof(m));
+	m.nxt = self;
+	m.put = 1;
+	for (i = 0; i < count; i++) {
+		x = nxt_multi_add(&m);
+		base = strrchr(localnames[i], '/') ? strrchr(localnames[i], '/') + 1 : localnames[i];
+		if (strlen(base) >= sizeof(x->name)) {
+			fprintf(stderr, "error: filename %s too long\n", base);
+			goto out;
+		}
+		strcpy(x->name, base);
+		if (fio_source_open(&x->src, localnames[i]) != 0)
+			goto out;
+		x->local_open = 1;
+		x->size = x->src.size;
+		m.total += x->size;
+	}
 
+	/* only list the brick if the free flash alone is not enough */
+	need = m.total;
+	if (nxt_get_device_info(self, &info) != 0)
+		goto out;
+	if (m.total > info.free_space &&
+		(self->cache ? cache_list(self->cache, "*.*", nxt_multi_replaced, &m) :
+		 nxt_list_files(self, "*.*", nxt_multi_replaced, &m)) != 0)
+		goto out;
+	if (m.total > info.free_space) {
+		fprintf(stderr, "error: %lu bytes do not fit into %u bytes of free flash\n",
+				need, info.free_space);
+		goto out;
+	}
+	m.total = need;
+	res = nxt_multi_run(&m, "upload") == 0 ? 0 : -1;
+out:
+	for (i = 0; i < m.count; i++)
+		if (m.files[i].local_open)
+			fio_source_close(&m.files[i].src);
+	free(m.files);
 	return res;
 }
 
@@ -840,6 +3341,7 @@ int nxt_delete_file(NXT* self, const char* filename){
 		fprintf(stderr, "error: could delete remote file %s\n", filename);
 	} else {
 		fprintf(stderr, "file deleted: %s\n", filename);
+		cache_remove(self->cache, filename);
 	}
 
 	return res;
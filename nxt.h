@@ -18,30 +18,186 @@
 #ifndef NXT_H
 #define NXT_H
 
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stddef.h>
 #include "buf.h"
+#include "fio.h"
+
+struct libusb_device;
+struct cache;
+
+/* largest packet relayed through nxtd */
+#define NXT_FRAME_MAX 1024
+
+/* returned by NXTTransport.read when no reply came in time */
+#define NXT_TIMEOUT (-2)
+
+/* bounds of the adaptive transfer timeouts in msec */
+#define NXT_TIMEOUT_INIT 1000
+#define NXT_TIMEOUT_MIN  250
+#define NXT_TIMEOUT_MAX  2000
+
+/* READ and WRITE payloads known to work with every firmware: a 64 byte
+ * USB packet minus the header (6 and 3) minus one byte */
+#define NXT_READ_SIZE    57
+#define NXT_WRITE_SIZE   60
 
+/* largest packet the chunk size probe tries on links other than usb */
+#define NXT_PACKET_MAX   256
+
+/* user flash: files take whole pages, OPEN_READ_LINEAR returns the
+ * address of linear files, counted from the first file page */
+#define NXT_FLASH_PAGE   256
+#define NXT_FLASH_BASE   0x00108000
+
+/* MESSAGE_WRITE carries up to 59 bytes including the NUL, a program
+ * reads inboxes 0-9 and answers through mailboxes 10-19 */
+#define NXT_MESSAGE_MAX  58
+#define NXT_MAILBOXES    10
+
+/* retries of a failed transfer, the delay doubles with each one */
+#define NXT_RETRIES      3
+#define NXT_RETRY_DELAY  10		/* msec */
+
+/* round trip time estimate of one command, like TCP (RFC 6298) */
 typedef struct {
+	float srtt;		/* smoothed rtt in msec, 0 until the first sample */
+	float rttvar;	/* rtt variation in msec */
+	int backoff;	/* timeouts since the last sample */
+} NXTRtt;
+
+/* how uploads choose OPEN_WRITE_LINEAR */
+enum {
+	NXT_LINEAR_AUTO,	/* programs, sounds and images */
+	NXT_LINEAR_ALWAYS,
+	NXT_LINEAR_NEVER
+};
+
+typedef struct nxt NXT;
+
+/*
+ * A transport moves whole packets between nxtctl and a brick. read
+ * returns the replies in the order the requests were written, so
+ * several requests may be written before the first reply is read.
+ * write and read return 0 on success and -1 on error, read returns
+ * NXT_TIMEOUT if the brick did not answer within self->timeout.
+ */
+typedef struct nxt_transport {
+	const char *name;
+	int (*write)(NXT *self, const unsigned char *data, size_t len);
+	int (*read)(NXT *self, unsigned char *data, size_t size, size_t *len);
+	void (*close)(NXT *self);
+} NXTTransport;
+
+extern const NXTTransport nxt_usb_transport;
+extern const NXTTransport nxt_daemon_transport;
+
+struct nxt {
+	const NXTTransport *transport;	/* NULL until connected */
+	void *link;		/* private state of the transport */
 	struct libusb_device *dev;
 	struct libusb_device_handle *handle;
+	int sock;		/* nxtd connection */
+	NXTRtt *rtt;	/* estimates per opcode */
+	unsigned int timeout;	/* msec for the next transfer */
+	struct cache *cache;	/* listing cache, NULL if disabled */
 	Buf *buf;
-} NXT;
+	int window;		/* max requests in flight, 0 if not set */
+	int interval;	/* checked WRITE every n chunks, 0: always */
+	long sync;		/* fsync policy for downloads, see fio.h */
+	int resume;		/* continue interrupted transfers */
+	unsigned short read_size;	/* READ payload, 0 until tuned */
+	unsigned short write_size;	/* WRITE payload, 0 until tuned */
+	int probe;		/* probe the chunk sizes even if they are cached */
+	int linear;		/* NXT_LINEAR_* */
+};
+
+typedef int (*nxt_file_fn)(const char *filename, unsigned int filesize, void *arg);
+typedef int (*nxt_message_fn)(int box, const char *message, size_t len, void *arg);
 
+/* a sensor port for nxt_sample */
+typedef struct {
+	unsigned char port;			/* 0-3 */
+	unsigned char type;			/* for SET_INPUT_MODE */
+	unsigned char mode;
+	unsigned char ls_register;	/* lowspeed sensors: register read */
+	unsigned char ls_len;		/* bytes read, 0 for analog sensors */
+} NXTSensor;
+
+/* one reading, lowspeed sensors have their first two bytes in raw and
+ * normalized and both as little endian number in scaled */
+typedef struct {
+	double time;		/* host clock, between request and reply */
+	double latency;		/* half the round trip */
+	unsigned long round;
+	int sensor;			/* index in the sensors sampled */
+	int status;			/* of the reply */
+	int valid;
+	int calibrated;
+	unsigned short raw;
+	unsigned short normalized;
+	short scaled;
+	short calibrated_value;
+} NXTSample;
+
+typedef int (*nxt_sample_fn)(const NXTSample *sample, void *arg);
+
+typedef struct {
+	char name[15];
+	unsigned char btaddr[7];
+	unsigned int signal_strength;
+	unsigned int free_space;
+} NXTInfo;
 
 NXT* nxt_new(); 
 int nxt_init(NXT *self);
+int nxt_init_usb(NXT *self);
+int nxt_init_daemon(NXT *self, const char *path);
+int nxt_init_socket(NXT *self, int fd);
+int nxt_init_transport(NXT *self, const char *spec);
+int nxt_init_device(NXT *self, struct libusb_device *dev);
+int nxt_is_device(struct libusb_device *dev);
+int nxt_get_device_info(NXT *self, NXTInfo *info);
+void nxt_format_btaddr(const NXTInfo *info, char *s, size_t len);
 int nxt_print_battery_level(NXT *self);
 int nxt_print_firmware_version(NXT *self);
 int nxt_print_device_info(NXT *self);
 int nxt_print_files(NXT *self, const char *pattern);
+int nxt_list_files(NXT *self, const char *pattern, nxt_file_fn fn, void *arg);
 int nxt_start_program(NXT *self, const char *filename);
 int nxt_stop_program(NXT *self);
+int nxt_message_write(NXT *self, int inbox, char *const *messages, int count);
+int nxt_message_poll(NXT *self, const int *boxes, int count, int remove,
+					 nxt_message_fn fn, void *arg);
+int nxt_sample(NXT *self, const NXTSensor *sensors, int count, double rate,
+			   unsigned long rounds, unsigned long *skipped,
+			   volatile sig_atomic_t *interrupted, nxt_sample_fn fn, void *arg);
 int nxt_get_file(NXT *self, const char *filename);
+int nxt_get_file_as(NXT *self, const char *filename, const char *localname);
 int nxt_put_file(NXT *self, const char *filename);
+int nxt_put_file_as(NXT *self, const char *filename, const char *localname);
+int nxt_get_file_sink(NXT *self, const char *filename, FileSink *sink, long expect);
+int nxt_put_file_source(NXT *self, const char *filename, FileSource *src);
+int nxt_is_linear(NXT *self, const char *filename);
+int nxt_flash_address(NXT *self, const char *filename, unsigned long *address);
+int nxt_linear_fits(NXT *self, const unsigned int *sizes, int count);
+int nxt_get_files(NXT *self, const char *pattern, const char *dir);
+int nxt_put_files(NXT *self, char *const *localnames, int count);
 int nxt_delete_file(NXT *self, const char *filename);
 int nxt_close(NXT *self);
+void nxt_free(NXT *self);
 int nxt_boot(NXT *self);
 int nxt_print_infos();
 int nxt_upload(char *fname);
 int nxt_download(char *fname);
+double nxt_clock(void);
+int nxt_parse_chunk(const char *s, unsigned short *read_size, unsigned short *write_size);
+int nxt_relay(NXT *self, Buf *buf);
+int nxt_frame_write(int fd, const unsigned char *data, size_t len);
+int nxt_frame_read(int fd, unsigned char *data, size_t size, size_t *len);
+const char* nxt_socket_path(void);
+int nxt_peer_uid(int fd, uid_t *uid);
 
 #endif
@@ -0,0 +1,459 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef NXTCMD_H
+#define NXTCMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "buf.h"
+
+/*
+ * Wire format of all NXT direct and system commands, as defined in
+ * Appendix 1 and 2 of the LEGO Bluetooth Developer Kit.
+ *
+ * NXT_COMMANDS lists every command as X(NAME, name, type, opcode).
+ * NXT_REQ_<NAME> and NXT_REPLY_<NAME> describe the fields following
+ * the type/opcode and reply/opcode/status bytes as F(type, name, size).
+ * From this, the macros at the end generate for every command:
+ *
+ *   NXT_CMD_<NAME>               opcode
+ *   NXT_<NAME>_REQ_SIZE          size of the request
+ *   NXT_<NAME>_REPLY_SIZE        size of the reply
+ *   nxt_<name>_reply             struct with status and reply fields
+ *   nxt_<name>_enc(p, size, reply, fields...)
+ *                                encode a request into p, returns its
+ *                                length or -1
+ *   nxt_<name>_dec(p, len, r)    decode a reply into r, returns the
+ *                                status or -1 for a malformed reply
+ *
+ * and for the brick side, used by the emulator:
+ *
+ *   nxt_<name>_request           struct with packet_type and request fields
+ *   nxt_<name>_req_dec(p, len, q)
+ *                                decode a request, 0 or -1
+ *   nxt_<name>_reply_enc(p, size, r)
+ *                                encode a reply, returns its length or -1
+ *
+ * Both do a single bounds check per packet. Commands with a variable
+ * payload (WRITE, MESSAGE_WRITE, LS_WRITE, WRITE_IO_MAP requests and
+ * READ, READ_IO_MAP replies) only describe the fixed part, the payload
+ * follows at offset NXT_<NAME>_REQ_SIZE or NXT_<NAME>_REPLY_SIZE.
+ */
+
+#define NXT_DIRECT_COMMAND 0x00
+#define NXT_SYSTEM_COMMAND 0x01
+#define NXT_REPLY_COMMAND  0x02
+#define NXT_DIRECT_COMMAND_NOREPLY 0x80
+#define NXT_SYSTEM_COMMAND_NOREPLY 0x81
+
+#define NXT_COMMANDS(X)													\
+	X(START_PROGRAM,            start_program,            DIRECT, 0x00)	\
+	X(STOP_PROGRAM,             stop_program,             DIRECT, 0x01)	\
+	X(PLAY_SOUND_FILE,          play_sound_file,          DIRECT, 0x02)	\
+	X(PLAY_TONE,                play_tone,                DIRECT, 0x03)	\
+	X(SET_OUTPUT_STATE,         set_output_state,         DIRECT, 0x04)	\
+	X(SET_INPUT_MODE,           set_input_mode,           DIRECT, 0x05)	\
+	X(GET_OUTPUT_STATE,         get_output_state,         DIRECT, 0x06)	\
+	X(GET_INPUT_VALUES,         get_input_values,         DIRECT, 0x07)	\
+	X(RESET_INPUT_SCALED_VALUE, reset_input_scaled_value, DIRECT, 0x08)	\
+	X(MESSAGE_WRITE,            message_write,            DIRECT, 0x09)	\
+	X(RESET_MOTOR_POSITION,     reset_motor_position,     DIRECT, 0x0a)	\
+	X(GET_BATTERY_LEVEL,        get_battery_level,        DIRECT, 0x0b)	\
+	X(STOP_SOUND_PLAYBACK,      stop_sound_playback,      DIRECT, 0x0c)	\
+	X(KEEP_ALIVE,               keep_alive,               DIRECT, 0x0d)	\
+	X(LS_GET_STATUS,            ls_get_status,            DIRECT, 0x0e)	\
+	X(LS_WRITE,                 ls_write,                 DIRECT, 0x0f)	\
+	X(LS_READ,                  ls_read,                  DIRECT, 0x10)	\
+	X(GET_CURRENT_PROGRAM_NAME, get_current_program_name, DIRECT, 0x11)	\
+	X(MESSAGE_READ,             message_read,             DIRECT, 0x13)	\
+	X(OPEN_READ,                open_read,                SYSTEM, 0x80)	\
+	X(OPEN_WRITE,               open_write,               SYSTEM, 0x81)	\
+	X(READ,                     read,                     SYSTEM, 0x82)	\
+	X(WRITE,                    write,                    SYSTEM, 0x83)	\
+	X(CLOSE,                    close,                    SYSTEM, 0x84)	\
+	X(DELETE,                   delete,                   SYSTEM, 0x85)	\
+	X(FIND_FIRST_FILE,          find_first_file,          SYSTEM, 0x86)	\
+	X(FIND_NEXT_FILE,           find_next_file,           SYSTEM, 0x87)	\
+	X(GET_FIRMWARE_VERSION,     get_firmware_version,     SYSTEM, 0x88)	\
+	X(OPEN_WRITE_LINEAR,        open_write_linear,        SYSTEM, 0x89)	\
+	X(OPEN_READ_LINEAR,         open_read_linear,         SYSTEM, 0x8a)	\
+	X(OPEN_WRITE_DATA,          open_write_data,          SYSTEM, 0x8b)	\
+	X(OPEN_APPEND_DATA,         open_append_data,         SYSTEM, 0x8c)	\
+	X(FIND_FIRST_MODULE,        find_first_module,        SYSTEM, 0x90)	\
+	X(FIND_NEXT_MODULE,         find_next_module,         SYSTEM, 0x91)	\
+	X(CLOSE_MODULE_HANDLE,      close_module_handle,      SYSTEM, 0x92)	\
+	X(READ_IO_MAP,              read_io_map,              SYSTEM, 0x94)	\
+	X(WRITE_IO_MAP,             write_io_map,             SYSTEM, 0x95)	\
+	X(BOOT,                     boot,                     SYSTEM, 0x97)	\
+	X(SET_BRICK_NAME,           set_brick_name,           SYSTEM, 0x98)	\
+	X(GET_DEVICE_INFO,          get_device_info,          SYSTEM, 0x9b)	\
+	X(DELETE_USER_FLASH,        delete_user_flash,        SYSTEM, 0xa0)	\
+	X(POLL_COMMAND_LENGTH,      poll_command_length,      SYSTEM, 0xa1)	\
+	X(POLL_COMMAND,             poll_command,             SYSTEM, 0xa2)	\
+	X(BLUETOOTH_FACTORY_RESET,  bluetooth_factory_reset,  SYSTEM, 0xa4)
+
+/* direct commands */
+#define NXT_REQ_START_PROGRAM(F)	F(STR, filename, 20)
+#define NXT_REPLY_START_PROGRAM(F)
+#define NXT_REQ_STOP_PROGRAM(F)
+#define NXT_REPLY_STOP_PROGRAM(F)
+#define NXT_REQ_PLAY_SOUND_FILE(F)	F(U8, loop, 1) F(STR, filename, 20)
+#define NXT_REPLY_PLAY_SOUND_FILE(F)
+#define NXT_REQ_PLAY_TONE(F)		F(U16, frequency, 2) F(U16, duration, 2)
+#define NXT_REPLY_PLAY_TONE(F)
+#define NXT_REQ_SET_OUTPUT_STATE(F)										\
+	F(U8, port, 1) F(S8, power, 1) F(U8, mode, 1) F(U8, regulation, 1)	\
+	F(S8, turn_ratio, 1) F(U8, run_state, 1) F(U32, tacho_limit, 4)
+#define NXT_REPLY_SET_OUTPUT_STATE(F)
+#define NXT_REQ_SET_INPUT_MODE(F)	F(U8, port, 1) F(U8, type, 1) F(U8, mode, 1)
+#define NXT_REPLY_SET_INPUT_MODE(F)
+#define NXT_REQ_GET_OUTPUT_STATE(F)	F(U8, port, 1)
+#define NXT_REPLY_GET_OUTPUT_STATE(F)									\
+	F(U8, port, 1) F(S8, power, 1) F(U8, mode, 1) F(U8, regulation, 1)	\
+	F(S8, turn_ratio, 1) F(U8, run_state, 1) F(U32, tacho_limit, 4)		\
+	F(S32, tacho_count, 4) F(S32, block_tacho_count, 4)					\
+	F(S32, rotation_count, 4)
+#define NXT_REQ_GET_INPUT_VALUES(F)	F(U8, port, 1)
+#define NXT_REPLY_GET_INPUT_VALUES(F)									\
+	F(U8, port, 1) F(U8, valid, 1) F(U8, calibrated, 1) F(U8, type, 1)	\
+	F(U8, mode, 1) F(U16, raw, 2) F(U16, normalized, 2)					\
+	F(S16, scaled, 2) F(S16, calibrated_value, 2)
+#define NXT_REQ_RESET_INPUT_SCALED_VALUE(F)	F(U8, port, 1)
+#define NXT_REPLY_RESET_INPUT_SCALED_VALUE(F)
+#define NXT_REQ_MESSAGE_WRITE(F)	F(U8, inbox, 1) F(U8, size, 1)
+#define NXT_REPLY_MESSAGE_WRITE(F)
+#define NXT_REQ_RESET_MOTOR_POSITION(F)	F(U8, port, 1) F(U8, relative, 1)
+#define NXT_REPLY_RESET_MOTOR_POSITION(F)
+#define NXT_REQ_GET_BATTERY_LEVEL(F)
+#define NXT_REPLY_GET_BATTERY_LEVEL(F)	F(U16, millivolts, 2)
+#define NXT_REQ_STOP_SOUND_PLAYBACK(F)
+#define NXT_REPLY_STOP_SOUND_PLAYBACK(F)
+#define NXT_REQ_KEEP_ALIVE(F)
+#define NXT_REPLY_KEEP_ALIVE(F)		F(U32, sleep_time, 4)
+#define NXT_REQ_LS_GET_STATUS(F)	F(U8, port, 1)
+#define NXT_REPLY_LS_GET_STATUS(F)	F(U8, bytes_ready, 1)
+#define NXT_REQ_LS_WRITE(F)			F(U8, port, 1) F(U8, tx_len, 1) F(U8, rx_len, 1)
+#define NXT_REPLY_LS_WRITE(F)
+#define NXT_REQ_LS_READ(F)			F(U8, port, 1)
+#define NXT_REPLY_LS_READ(F)		F(U8, bytes_read, 1) F(BYTES, data, 16)
+#define NXT_REQ_GET_CURRENT_PROGRAM_NAME(F)
+#define NXT_REPLY_GET_CURRENT_PROGRAM_NAME(F)	F(STR, filename, 20)
+#define NXT_REQ_MESSAGE_READ(F)											\
+	F(U8, remote_inbox, 1) F(U8, local_inbox, 1) F(U8, remove, 1)
+#define NXT_REPLY_MESSAGE_READ(F)										\
+	F(U8, local_inbox, 1) F(U8, size, 1) F(BYTES, message, 59)
+
+/* system commands */
+#define NXT_REQ_OPEN_READ(F)		F(STR, filename, 20)
+#define NXT_REPLY_OPEN_READ(F)		F(U8, handle, 1) F(U32, filesize, 4)
+#define NXT_REQ_OPEN_WRITE(F)		F(STR, filename, 20) F(U32, filesize, 4)
+#define NXT_REPLY_OPEN_WRITE(F)		F(U8, handle, 1)
+#define NXT_REQ_READ(F)				F(U8, handle, 1) F(U16, size, 2)
+#define NXT_REPLY_READ(F)			F(U8, handle, 1) F(U16, size, 2)
+#define NXT_REQ_WRITE(F)			F(U8, handle, 1)
+#define NXT_REPLY_WRITE(F)			F(U8, handle, 1) F(U16, size, 2)
+#define NXT_REQ_CLOSE(F)			F(U8, handle, 1)
+#define NXT_REPLY_CLOSE(F)			F(U8, handle, 1)
+#define NXT_REQ_DELETE(F)			F(STR, filename, 20)
+#define NXT_REPLY_DELETE(F)			F(STR, filename, 20)
+#define NXT_REQ_FIND_FIRST_FILE(F)	F(STR, pattern, 20)
+#define NXT_REPLY_FIND_FIRST_FILE(F)									\
+	F(U8, handle, 1) F(STR, filename, 20) F(U32, filesize, 4)
+#define NXT_REQ_FIND_NEXT_FILE(F)	F(U8, handle, 1)
+#define NXT_REPLY_FIND_NEXT_FILE(F)	NXT_REPLY_FIND_FIRST_FILE(F)
+#define NXT_REQ_GET_FIRMWARE_VERSION(F)
+#define NXT_REPLY_GET_FIRMWARE_VERSION(F)								\
+	F(U8, protocol_minor, 1) F(U8, protocol_major, 1)					\
+	F(U8, firmware_minor, 1) F(U8, firmware_major, 1)
+#define NXT_REQ_OPEN_WRITE_LINEAR(F)	NXT_REQ_OPEN_WRITE(F)
+#define NXT_REPLY_OPEN_WRITE_LINEAR(F)	F(U8, handle, 1)
+#define NXT_REQ_OPEN_READ_LINEAR(F)		F(STR, filename, 20)
+#define NXT_REPLY_OPEN_READ_LINEAR(F)	F(U32, address, 4)
+#define NXT_REQ_OPEN_WRITE_DATA(F)		NXT_REQ_OPEN_WRITE(F)
+#define NXT_REPLY_OPEN_WRITE_DATA(F)	F(U8, handle, 1)
+#define NXT_REQ_OPEN_APPEND_DATA(F)		F(STR, filename, 20)
+#define NXT_REPLY_OPEN_APPEND_DATA(F)	F(U8, handle, 1) F(U32, available, 4)
+#define NXT_REQ_FIND_FIRST_MODULE(F)	F(STR, pattern, 20)
+#define NXT_REPLY_FIND_FIRST_MODULE(F)									\
+	F(U8, handle, 1) F(STR, name, 20) F(U32, id, 4) F(U32, size, 4)		\
+	F(U16, io_map_size, 2)
+#define NXT_REQ_FIND_NEXT_MODULE(F)		F(U8, handle, 1)
+#define NXT_REPLY_FIND_NEXT_MODULE(F)	NXT_REPLY_FIND_FIRST_MODULE(F)
+#define NXT_REQ_CLOSE_MODULE_HANDLE(F)	F(U8, handle, 1)
+#define NXT_REPLY_CLOSE_MODULE_HANDLE(F)	F(U8, handle, 1)
+#define NXT_REQ_READ_IO_MAP(F)			F(U32, id, 4) F(U16, offset, 2) F(U16, count, 2)
+#define NXT_REPLY_READ_IO_MAP(F)		F(U32, id, 4) F(U16, count, 2)
+#define NXT_REQ_WRITE_IO_MAP(F)			F(U32, id, 4) F(U16, offset, 2) F(U16, count, 2)
+#define NXT_REPLY_WRITE_IO_MAP(F)		F(U32, id, 4) F(U16, count, 2)
+#define NXT_REQ_BOOT(F)					F(STR, magic, 19)
+#define NXT_REPLY_BOOT(F)				F(BYTES, result, 4)
+#define NXT_REQ_SET_BRICK_NAME(F)		F(STR, name, 16)
+#define NXT_REPLY_SET_BRICK_NAME(F)
+#define NXT_REQ_GET_DEVICE_INFO(F)
+#define NXT_REPLY_GET_DEVICE_INFO(F)									\
+	F(STR, name, 15) F(BYTES, btaddr, 7) F(U32, signal_strength, 4)		\
+	F(U32, free_space, 4)
+#define NXT_REQ_DELETE_USER_FLASH(F)
+#define NXT_REPLY_DELETE_USER_FLASH(F)
+#define NXT_REQ_POLL_COMMAND_LENGTH(F)	F(U8, buffer, 1)
+#define NXT_REPLY_POLL_COMMAND_LENGTH(F)	F(U8, buffer, 1) F(U8, length, 1)
+#define NXT_REQ_POLL_COMMAND(F)			F(U8, buffer, 1) F(U8, length, 1)
+#define NXT_REPLY_POLL_COMMAND(F)										\
+	F(U8, buffer, 1) F(U8, length, 1) F(BYTES, command, 60)
+#define NXT_REQ_BLUETOOTH_FACTORY_RESET(F)
+#define NXT_REPLY_BLUETOOTH_FACTORY_RESET(F)
+
+/*
+ * Error codes as X(NAME, code, message), see nxt_strerror
+ */
+#define NXT_ERRORS(X)													\
+	X(PENDING_TRANSACTION,    0x20, "Pending communication transaction in progress") \
+	X(QUEUE_EMPTY,            0x40, "Specified mailbox queue is empty")	\
+	X(NO_MORE_HANDLES,        0x81, "No more handles")					\
+	X(NO_SPACE,               0x82, "No space")							\
+	X(NO_MORE_FILES,          0x83, "No more files")					\
+	X(END_OF_FILE_EXPECTED,   0x84, "End of file expected")				\
+	X(END_OF_FILE,            0x85, "End of file")						\
+	X(NOT_A_LINEAR_FILE,      0x86, "Not a linear file")				\
+	X(FILE_NOT_FOUND,         0x87, "File not found")					\
+	X(HANDLE_ALREADY_CLOSED,  0x88, "Handle all ready closed")			\
+	X(NO_LINEAR_SPACE,        0x89, "No linear space")					\
+	X(UNDEFINED_ERROR,        0x8a, "Undefined error")					\
+	X(FILE_IS_BUSY,           0x8b, "File is busy")						\
+	X(NO_WRITE_BUFFERS,       0x8c, "No write buffers")					\
+	X(APPEND_NOT_POSSIBLE,    0x8d, "Append not possible")				\
+	X(FILE_IS_FULL,           0x8e, "File is full")						\
+	X(FILE_EXISTS,            0x8f, "File exists")						\
+	X(MODULE_NOT_FOUND,       0x90, "Module not found")					\
+	X(OUT_OF_BOUNDARY,        0x91, "Out of boundary")					\
+	X(ILLEGAL_FILE_NAME,      0x92, "Illegal file name")				\
+	X(ILLEGAL_HANDLE,         0x93, "Illegal handle")					\
+	X(REQUEST_FAILED,         0xbd, "Request failed (i.e. specified file not found)") \
+	X(UNKNOWN_COMMAND_OPCODE, 0xbe, "Unknown command opcode")			\
+	X(INSANE_PACKET,          0xbf, "Insane packet")					\
+	X(OUT_OF_RANGE,           0xc0, "Data contains out-of-range values") \
+	X(BUS_ERROR,              0xdd, "Communication bus error")			\
+	X(COMM_OUT_OF_MEMORY,     0xde, "No free memory in communication buffer") \
+	X(CHANNEL_INVALID,        0xdf, "Specified channel/connection is not valid") \
+	X(CHANNEL_BUSY,           0xe0, "Specified channel/connection not configured or busy") \
+	X(NO_ACTIVE_PROGRAM,      0xec, "No active program")				\
+	X(ILLEGAL_SIZE,           0xed, "Illegal size specified")			\
+	X(ILLEGAL_QUEUE,          0xee, "Illegal mailbox queue ID specified") \
+	X(INVALID_FIELD,          0xef, "Attempted to access invalid field of a structure") \
+	X(BAD_INPUT_OUTPUT,       0xf0, "Bad input or output specified")	\
+	X(INSUFFICIENT_MEMORY,    0xfb, "Insufficient memory available")	\
+	X(BAD_ARGUMENTS,          0xff, "Bad arguments")
+
+/*
+ * Sensor types and modes of SET_INPUT_MODE as X(NAME, code, name), the
+ * names are the ones nxtctl sample takes
+ */
+#define NXT_SENSOR_TYPES(X)												\
+	X(NO_SENSOR,              0x00, "none")								\
+	X(SWITCH,                 0x01, "switch")							\
+	X(TEMPERATURE,            0x02, "temperature")						\
+	X(REFLECTION,             0x03, "reflection")						\
+	X(ANGLE,                  0x04, "angle")							\
+	X(LIGHT_ACTIVE,           0x05, "light")							\
+	X(LIGHT_INACTIVE,         0x06, "light_inactive")					\
+	X(SOUND_DB,               0x07, "sound")							\
+	X(SOUND_DBA,              0x08, "sound_dba")						\
+	X(CUSTOM,                 0x09, "custom")							\
+	X(LOWSPEED,               0x0a, "lowspeed")							\
+	X(LOWSPEED_9V,            0x0b, "lowspeed_9v")
+
+#define NXT_SENSOR_MODES(X)												\
+	X(RAW,                    0x00, "raw")								\
+	X(BOOLEAN,                0x20, "boolean")							\
+	X(TRANSITIONS,            0x40, "transitions")						\
+	X(PERIODS,                0x60, "periods")							\
+	X(PERCENT,                0x80, "percent")							\
+	X(CELSIUS,                0xa0, "celsius")							\
+	X(FAHRENHEIT,             0xc0, "fahrenheit")						\
+	X(ANGLE_STEPS,            0xe0, "angle")
+
+/***********************************************************************/
+/* generated code                                                      */
+/***********************************************************************/
+
+#define NXT_SUCCESS 0x00
+
+#define NXT_ERROR_ENUM(NAME, code, msg) NXT_ERROR_##NAME = code,
+enum { NXT_ERRORS(NXT_ERROR_ENUM) };
+#undef NXT_ERROR_ENUM
+
+#define NXT_SENSOR_ENUM(NAME, code, name) NXT_SENSOR_##NAME = code,
+enum { NXT_SENSOR_TYPES(NXT_SENSOR_ENUM) };
+#undef NXT_SENSOR_ENUM
+
+#define NXT_MODE_ENUM(NAME, code, name) NXT_MODE_##NAME = code,
+enum { NXT_SENSOR_MODES(NXT_MODE_ENUM) };
+#undef NXT_MODE_ENUM
+
+#define NXT_CMD_ENUM(NAME, name, type, opcode) NXT_CMD_##NAME = opcode,
+enum { NXT_COMMANDS(NXT_CMD_ENUM) };
+#undef NXT_CMD_ENUM
+
+/* zero padded string that has to fit into n bytes including the 0 */
+static inline unsigned char* nxt_put_str(unsigned char *p, const char *s, size_t n) {
+	size_t len = strnlen(s, n);
+
+	if (len >= n)
+		return NULL;
+	memcpy(p, s, len);
+	memset(p + len, 0, n - len);
+	return p + n;
+}
+
+/* C types of the field types */
+#define NXT_CTYPE_U8	uint8_t
+#define NXT_CTYPE_S8	int8_t
+#define NXT_CTYPE_U16	uint16_t
+#define NXT_CTYPE_S16	int16_t
+#define NXT_CTYPE_U32	uint32_t
+#define NXT_CTYPE_S32	int32_t
+
+#define NXT_FIELD_SIZE(T, name, n) + n
+
+/* encoder parameters */
+#define NXT_PARAM_U8(name, n)		, NXT_CTYPE_U8 name
+#define NXT_PARAM_S8(name, n)		, NXT_CTYPE_S8 name
+#define NXT_PARAM_U16(name, n)		, NXT_CTYPE_U16 name
+#define NXT_PARAM_S16(name, n)		, NXT_CTYPE_S16 name
+#define NXT_PARAM_U32(name, n)		, NXT_CTYPE_U32 name
+#define NXT_PARAM_S32(name, n)		, NXT_CTYPE_S32 name
+#define NXT_PARAM_STR(name, n)		, const char *name
+#define NXT_PARAM_BYTES(name, n)	, const uint8_t *name
+#define NXT_FIELD_PARAM(T, name, n) NXT_PARAM_##T(name, n)
+
+/* reply struct members */
+#define NXT_MEMBER_U8(name, n)		NXT_CTYPE_U8 name;
+#define NXT_MEMBER_S8(name, n)		NXT_CTYPE_S8 name;
+#define NXT_MEMBER_U16(name, n)		NXT_CTYPE_U16 name;
+#define NXT_MEMBER_S16(name, n)		NXT_CTYPE_S16 name;
+#define NXT_MEMBER_U32(name, n)		NXT_CTYPE_U32 name;
+#define NXT_MEMBER_S32(name, n)		NXT_CTYPE_S32 name;
+#define NXT_MEMBER_STR(name, n)		char name[n];
+#define NXT_MEMBER_BYTES(name, n)	uint8_t name[n];
+#define NXT_FIELD_MEMBER(T, name, n) NXT_MEMBER_##T(name, n)
+
+/* encode one field at nxt_p */
+#define NXT_PUT_U8(name, n)		*nxt_p++ = name;
+#define NXT_PUT_S8(name, n)		*nxt_p++ = name;
+#define NXT_PUT_U16(name, n)	buf_put_le16(nxt_p, name); nxt_p += 2;
+#define NXT_PUT_S16(name, n)	buf_put_le16(nxt_p, name); nxt_p += 2;
+#define NXT_PUT_U32(name, n)	buf_put_le32(nxt_p, name); nxt_p += 4;
+#define NXT_PUT_S32(name, n)	buf_put_le32(nxt_p, name); nxt_p += 4;
+#define NXT_PUT_STR(name, n)								\
+	if ((nxt_p = nxt_put_str(nxt_p, name, n)) == NULL)	\
+		return -1;
+#define NXT_PUT_BYTES(name, n)	memcpy(nxt_p, name, n); nxt_p += n;
+#define NXT_FIELD_PUT(T, name, n) NXT_PUT_##T(name, n)
+
+/* decode one field at nxt_p into nxt_r */
+#define NXT_GET_U8(name, n)		nxt_r->name = *nxt_p++;
+#define NXT_GET_S8(name, n)		nxt_r->name = *nxt_p++;
+#define NXT_GET_U16(name, n)	nxt_r->name = buf_get_le16(nxt_p); nxt_p += 2;
+#define NXT_GET_S16(name, n)	nxt_r->name = buf_get_le16(nxt_p); nxt_p += 2;
+#define NXT_GET_U32(name, n)	nxt_r->name = buf_get_le32(nxt_p); nxt_p += 4;
+#define NXT_GET_S32(name, n)	nxt_r->name = buf_get_le32(nxt_p); nxt_p += 4;
+#define NXT_GET_STR(name, n)								\
+	memcpy(nxt_r->name, nxt_p, n); nxt_r->name[n - 1] = 0; nxt_p += n;
+#define NXT_GET_BYTES(name, n)	memcpy(nxt_r->name, nxt_p, n); nxt_p += n;
+#define NXT_FIELD_GET(T, name, n) NXT_GET_##T(name, n)
+
+/* encode one field of struct nxt_r at nxt_p */
+#define NXT_RPUT_U8(name, n)	*nxt_p++ = nxt_r->name;
+#define NXT_RPUT_S8(name, n)	*nxt_p++ = nxt_r->name;
+#define NXT_RPUT_U16(name, n)	buf_put_le16(nxt_p, nxt_r->name); nxt_p += 2;
+#define NXT_RPUT_S16(name, n)	buf_put_le16(nxt_p, nxt_r->name); nxt_p += 2;
+#define NXT_RPUT_U32(name, n)	buf_put_le32(nxt_p, nxt_r->name); nxt_p += 4;
+#define NXT_RPUT_S32(name, n)	buf_put_le32(nxt_p, nxt_r->name); nxt_p += 4;
+#define NXT_RPUT_STR(name, n)	memcpy(nxt_p, nxt_r->name, n); nxt_p[n - 1] = 0; nxt_p += n;
+#define NXT_RPUT_BYTES(name, n)	memcpy(nxt_p, nxt_r->name, n); nxt_p += n;
+#define NXT_FIELD_RPUT(T, name, n) NXT_RPUT_##T(name, n)
+
+#define NXT_CMD_CODEC(NAME, name, type, opcode)							\
+	enum {																\
+		NXT_##NAME##_REQ_SIZE = 2 NXT_REQ_##NAME(NXT_FIELD_SIZE),		\
+		NXT_##NAME##_REPLY_SIZE = 3 NXT_REPLY_##NAME(NXT_FIELD_SIZE)	\
+	};																	\
+	typedef struct {													\
+		uint8_t status;													\
+		NXT_REPLY_##NAME(NXT_FIELD_MEMBER)								\
+	} nxt_##name##_reply;												\
+	static inline int nxt_##name##_enc(unsigned char *nxt_p, size_t nxt_size, \
+									   int nxt_reply						\
+									   NXT_REQ_##NAME(NXT_FIELD_PARAM)) { \
+		if (nxt_size < NXT_##NAME##_REQ_SIZE)							\
+			return -1;													\
+		*nxt_p++ = NXT_##type##_COMMAND | (nxt_reply ? 0 : 0x80);		\
+		*nxt_p++ = opcode;												\
+		NXT_REQ_##NAME(NXT_FIELD_PUT)									\
+		return NXT_##NAME##_REQ_SIZE;									\
+	}																	\
+	static inline int nxt_##name##_dec(const unsigned char *nxt_p, size_t nxt_len, \
+									   nxt_##name##_reply *nxt_r) {		\
+		if (nxt_len < 3 || nxt_p[0] != NXT_REPLY_COMMAND || nxt_p[1] != opcode) \
+			return -1;													\
+		nxt_r->status = nxt_p[2];										\
+		if (nxt_r->status != NXT_SUCCESS)								\
+			return nxt_r->status;										\
+		if (nxt_len < NXT_##NAME##_REPLY_SIZE)							\
+			return -1;													\
+		nxt_p += 3;														\
+		NXT_REPLY_##NAME(NXT_FIELD_GET)									\
+		return NXT_SUCCESS;												\
+	}																	\
+	typedef struct {													\
+		uint8_t packet_type;											\
+		NXT_REQ_##NAME(NXT_FIELD_MEMBER)								\
+	} nxt_##name##_request;												\
+	static inline int nxt_##name##_req_dec(const unsigned char *nxt_p, size_t nxt_len, \
+										   nxt_##name##_request *nxt_r) { \
+		if (nxt_len < NXT_##NAME##_REQ_SIZE || nxt_p[1] != opcode)		\
+			return -1;													\
+		nxt_r->packet_type = nxt_p[0];									\
+		nxt_p += 2;														\
+		NXT_REQ_##NAME(NXT_FIELD_GET)									\
+		return 0;														\
+	}																	\
+	static inline int nxt_##name##_reply_enc(unsigned char *nxt_p, size_t nxt_size, \
+											 const nxt_##name##_reply *nxt_r) { \
+		if (nxt_size < NXT_##NAME##_REPLY_SIZE)							\
+			return -1;													\
+		*nxt_p++ = NXT_REPLY_COMMAND;									\
+		*nxt_p++ = opcode;												\
+		*nxt_p++ = nxt_r->status;										\
+		NXT_REPLY_##NAME(NXT_FIELD_RPUT)								\
+		return NXT_##NAME##_REPLY_SIZE;									\
+	}
+
+NXT_COMMANDS(NXT_CMD_CODEC)
+
+#define NXT_CMD_NAME(NAME, name, type, opcode) case opcode: return #NAME;
+static inline const char* nxt_command_name(int opcode) {
+	switch (opcode) {
+	NXT_COMMANDS(NXT_CMD_NAME)
+	default: return NULL;
+	}
+}
+#undef NXT_CMD_NAME
+
+#endif
@@ -0,0 +1,289 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * nxtd keeps the usb interface of a NXT claimed and relays packets
+ * from nxtctl clients over a UNIX domain socket, so that a command
+ * costs a single usb round trip instead of a full device setup.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nxt.h"
+#include "trace.h"
+
+int vflag;
+int dflag;
+
+static const char *path;
+static const char *tracefile;
+static volatile sig_atomic_t quit;
+
+static void nxtd_signal(int sig) {
+	quit = 1;
+}
+
+/* SIGUSR1 writes the trace ring, trace_dump is async signal safe */
+static void nxtd_dump(int sig) {
+	if (tracefile)
+		trace_dump(tracefile);
+}
+
+/*
+ * The default socket lives in a directory of its own, refuse it unless
+ * only we can write there.
+ */
+static int nxtd_private_dir(const char *path) {
+	char dir[PATH_MAX];
+	struct stat st;
+	char *p;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	if ((p = strrchr(dir, '/')) == NULL || p == dir)
+		return 0;
+	*p = 0;
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		perror(dir);
+		return -1;
+	}
+	if (lstat(dir, &st) != 0) {
+		perror(dir);
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+		fprintf(stderr, "error: %s is not a private directory\n", dir);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * daemon() changes to /, relative paths given on the command line must
+ * be made absolute before that.
+ */
+static const char* nxtd_absolute(const char *name) {
+	char cwd[PATH_MAX];
+	char *abs;
+
+	if (name[0] == '/')
+		return name;
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("getcwd");
+		exit(1);
+	}
+	if ((abs = malloc(strlen(cwd) + strlen(name) + 2)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	sprintf(abs, "%s/%s", cwd, name);
+	return abs;
+}
+
+static int nxtd_listen(const char *path) {
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "error: socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+	/* refuse to steal the socket of a running daemon */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+		fprintf(stderr, "error: nxtd already running on %s\n", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	mask = umask(0077);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+		perror("bind");
+		umask(mask);
+		close(fd);
+		return -1;
+	}
+	umask(mask);
+	if (listen(fd, 8) != 0) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Reopen the brick after a failed transaction, e.g. when it was
+ * unplugged or switched off in the meantime.
+ */
+static int nxtd_reopen(NXT *nxt) {
+	nxt_close(nxt);
+	return nxt_init_usb(nxt);
+}
+
+/*
+ * Relay packets of one client until it disconnects. Clients are
+ * served one at a time, so their requests never interleave.
+ */
+static void nxtd_serve(NXT *nxt, int fd) {
+	Buf *buf = nxt->buf;
+	size_t len;
+	int res;
+
+	while (!quit) {
+		buf_reset(buf);
+		if (nxt_frame_read(fd, buf->buf, buf->size, &len) != 0)
+			break;
+		buf->offset = len;
+		if (vflag)
+			fprintf(stderr, "nxtd: request len=%zu cmd=0x%02x\n",
+					len, len > 1 ? buf->buf[1] : 0);
+
+		res = nxt_relay(nxt, buf);
+		if (res < 0) {
+			/* no reply at all would leave the client hanging */
+			if (len > 0 && !(buf->buf[0] & 0x80))
+				nxt_frame_write(fd, buf->buf, 0);
+			if (tracefile)
+				trace_dump(tracefile);
+			if (nxtd_reopen(nxt) != 0)
+				fprintf(stderr, "nxtd: brick not available\n");
+			continue;
+		}
+		if (res > 0 && nxt_frame_write(fd, buf->buf, buf->limit) != 0)
+			break;
+	}
+	close(fd);
+}
+
+static void usage(void) {
+	(void)fprintf(stderr,
+				  "usage: nxtd [-dv] [-s socket] [-T tracefile]\n"
+				  "        -d             do not detach, stay in foreground\n"
+				  "        -s [socket]    socket path (default %s)\n"
+				  "        -T [tracefile] write the transport trace to tracefile on\n"
+				  "                       failed transfers, SIGUSR1 and exit\n"
+				  "        -v             log each request to stderr, needs -d\n",
+				  nxt_socket_path());
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct sigaction sa;
+	NXT *nxt;
+	int ch, lfd, fd, sflag = 0;
+	uid_t uid;
+
+	path = nxt_socket_path();
+	while ((ch = getopt(argc, argv, "dhs:T:v")) != -1) {
+		switch (ch) {
+		case 'd':
+			dflag = 1;
+			break;
+		case 's':
+			path = optarg;
+			sflag = 1;
+			break;
+		case 'T':
+			tracefile = optarg;
+			break;
+		case 'v':
+			vflag++;
+			break;
+		case 'h':
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	path = nxtd_absolute(path);
+	if (tracefile)
+		tracefile = nxtd_absolute(tracefile);
+
+	nxt = nxt_new();
+	if (nxt_init_usb(nxt) != 0)
+		exit(1);
+
+	if (!sflag && getenv("NXTD_SOCKET") == NULL && nxtd_private_dir(path) != 0)
+		exit(1);
+	if ((lfd = nxtd_listen(path)) < 0)
+		exit(1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = nxtd_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = nxtd_dump;
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!dflag && daemon(0, 0) != 0) {
+		perror("daemon");
+		exit(1);
+	}
+
+	while (!quit) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+		/* the brick is only lent to our own user */
+		if (nxt_peer_uid(fd, &uid) != 0 || uid != getuid()) {
+			if (vflag)
+				fprintf(stderr, "nxtd: rejected client of another user\n");
+			close(fd);
+			continue;
+		}
+		nxtd_serve(nxt, fd);
+	}
+
+	close(lfd);
+	unlink(path);
+	nxt_close(nxt);
+	if (tracefile)
+		trace_dump(tracefile);
+	return 0;
+}
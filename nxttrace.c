@@ -0,0 +1,122 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * nxttrace turns a trace ring dump written by nxtctl -T, nxtd -T or
+ * after a failed nxtctl run into readable text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nxtcmd.h"
+#include "trace.h"
+
+static const char* opname(uint8_t opcode) {
+	static char unknown[8];
+	const char *name;
+
+	if ((name = nxt_command_name(opcode)) != NULL)
+		return name;
+	snprintf(unknown, sizeof(unknown), "0x%02x", opcode);
+	return unknown;
+}
+
+/*
+ * Print one event per line: time since the first event, delta to the
+ * previous one and the decoded packet. Replies also show the round
+ * trip time to the request with the same sequence number.
+ */
+static int decode(FILE *fp, const char *path) {
+	TraceHeader hdr;
+	TraceEvent ev;
+	uint64_t first = 0, prev = 0, sent[256];
+	uint32_t i;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+		fprintf(stderr, "error: %s is not a trace dump\n", path);
+		return -1;
+	}
+	if (hdr.version != TRACE_VERSION) {
+		fprintf(stderr, "error: %s has unsupported version %u\n", path, hdr.version);
+		return -1;
+	}
+
+	memset(sent, 0, sizeof(sent));
+	for (i = 0; i < hdr.count; i++) {
+		if (fread(&ev, sizeof(ev), 1, fp) != 1) {
+			fprintf(stderr, "error: %s truncated after %u events\n", path, i);
+			return -1;
+		}
+		if (i == 0)
+			first = prev = ev.usec;
+		printf("%10.6f +%9.6f ", (ev.usec - first) / 1e6, (ev.usec - prev) / 1e6);
+		prev = ev.usec;
+
+		switch (ev.event) {
+		case TRACE_REQUEST:
+			sent[ev.seq & 0xff] = ev.usec;
+			printf("> %-24s %s%s len=%u",
+				   opname(ev.opcode),
+				   (ev.type & 0x7f) == NXT_SYSTEM_COMMAND ? "sys" : "dir",
+				   (ev.type & 0x80) ? " noreply" : "",
+				   ev.len);
+			break;
+		case TRACE_REPLY:
+			printf("< %-24s status=0x%02x len=%u", opname(ev.opcode), ev.status, ev.len);
+			if (sent[ev.seq & 0xff])
+				printf(" rtt=%lluus", (unsigned long long) (ev.usec - sent[ev.seq & 0xff]));
+			break;
+		case TRACE_FAILED:
+			printf("! transport error %d", -(int) ev.status);
+			break;
+		default:
+			printf("? event %u", ev.event);
+		}
+		if (ev.handle != 0xff)
+			printf(" handle=%u", ev.handle);
+		if (ev.seq)
+			printf(" seq=%u", ev.seq);
+		printf("\n");
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	FILE *fp;
+	int i, status = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: nxttrace dumpfile ...\n");
+		exit(1);
+	}
+	for (i = 1; i < argc; i++) {
+		if ((fp = fopen(argv[i], "r")) == NULL) {
+			fprintf(stderr, "error: could not open %s\n", argv[i]);
+			status = 1;
+			continue;
+		}
+		if (argc > 2)
+			printf("%s:\n", argv[i]);
+		if (decode(fp, argv[i]) != 0)
+			status = 1;
+		fclose(fp);
+	}
+	return status;
+}
@@ -0,0 +1,529 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Flash planner. Linear files need a contiguous run of flash pages, so
+ * uploads fail with NO_LINEAR_SPACE once deletes have fragmented the
+ * flash. The planner models the flash from the listing, the free flash
+ * and the address of every linear file (OPEN_READ_LINEAR). Data files
+ * can sit in any pages and their place is not known. If the upload does
+ * not fit as it is, the planner looks for the smallest run of adjacent
+ * linear files which, moved together with the data files, makes room:
+ * they are pulled, deleted and written again with the new files,
+ * linear files largest first. Like the emulator the model assumes that
+ * the firmware hands out the first free pages.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "plan.h"
+
+typedef struct {
+	char name[20];
+	const char *local;		/* uploaded from this local file */
+	unsigned int size;		/* size when written */
+	int linear;				/* needs contiguous pages when written */
+	int remote;				/* exists on the brick */
+	unsigned int remotesize;
+	int first;				/* first page of a remote linear file, -1 if none */
+	int remotelinear;		/* the file on the brick is linear */
+	int move;				/* pulled, deleted and written again */
+	int deleted;
+} PlanFile;
+
+typedef struct {
+	PlanFile *files;
+	int count;
+	unsigned int npages;	/* of the user flash */
+	int known;				/* the pages of all remote linear files are known */
+	int compact;			/* nothing to upload: make the free pages one run */
+	int probed;				/* temporary files were created on the brick */
+	unsigned char *map;		/* page map of the model */
+} Plan;
+
+static unsigned int plan_pages(unsigned int size) {
+	return (size + NXT_FLASH_PAGE - 1) / NXT_FLASH_PAGE;
+}
+
+static PlanFile* plan_file(Plan *plan, const char *name) {
+	PlanFile *file;
+	int i;
+
+	for (i = 0; i < plan->count; i++) {
+		if (strcmp(plan->files[i].name, name) == 0)
+			return &plan->files[i];
+	}
+	plan->files = realloc(plan->files, (plan->count + 1) * sizeof(PlanFile));
+	if (plan->files == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	file = &plan->files[plan->count++];
+	memset(file, 0, sizeof(*file));
+	strncpy(file->name, name, sizeof(file->name) - 1);
+	file->first = -1;
+	return file;
+}
+
+static int plan_remote_cb(const char *name, unsigned int size, void *arg) {
+	PlanFile *file = plan_file(arg, name);
+
+	file->remote = 1;
+	file->remotesize = size;
+	file->size = size;
+	return 0;
+}
+
+/* brick files that keep their place */
+static int plan_stays(const PlanFile *file) {
+	return file->remote && !file->local && !file->move;
+}
+
+static int plan_written(const PlanFile *file) {
+	return file->local || file->move;
+}
+
+/*
+ * Linear files first, the largest first, the order the files are
+ * written in
+ */
+static int plan_order(const void *a, const void *b) {
+	const PlanFile *fa = *(PlanFile * const *) a, *fb = *(PlanFile * const *) b;
+
+	if (fa->linear != fb->linear)
+		return fb->linear - fa->linear;
+	if (fa->size != fb->size)
+		return fa->size < fb->size ? 1 : -1;
+	return strcmp(fa->name, fb->name);
+}
+
+static PlanFile** plan_sorted(Plan *plan, int (*select)(const PlanFile *), int *count) {
+	PlanFile **list;
+	int i;
+
+	if ((list = malloc((plan->count + 1) * sizeof(PlanFile *))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (*count = 0, i = 0; i < plan->count; i++)
+		if (select(&plan->files[i]))
+			list[(*count)++] = &plan->files[i];
+	qsort(list, *count, sizeof(PlanFile *), plan_order);
+	return list;
+}
+
+/*
+ * Read the listing and the place of the linear files. The size of the
+ * user flash follows from the free flash and the files in it.
+ */
+static int plan_load(Plan *plan, NXT *nxt, NXTInfo *info) {
+	unsigned long capacity, address;
+	PlanFile *file;
+	unsigned int i, page, n;
+	int j, res;
+
+	if (nxt_get_device_info(nxt, info) != 0 ||
+		nxt_list_files(nxt, "*.*", plan_remote_cb, plan) != 0)
+		return -1;
+	capacity = info->free_space;
+	for (j = 0; j < plan->count; j++)	/* files take whole pages */
+		capacity += plan_pages(plan->files[j].remotesize) * NXT_FLASH_PAGE;
+	plan->npages = capacity / NXT_FLASH_PAGE;
+	if ((plan->map = calloc(plan->npages + 1, 1)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+
+	plan->known = 1;
+	for (j = 0; j < plan->count; j++) {
+		file = &plan->files[j];
+		if ((res = nxt_flash_address(nxt, file->name, &address)) < 0)
+			return -1;
+		if (res == 1)
+			continue;
+		file->linear = 1;
+		file->remotelinear = 1;
+		n = plan_pages(file->remotesize);
+		page = (address - NXT_FLASH_BASE) / NXT_FLASH_PAGE;
+		if (address < NXT_FLASH_BASE || (address - NXT_FLASH_BASE) % NXT_FLASH_PAGE ||
+			page >= plan->npages || n > plan->npages - page) {
+			plan->known = 0;
+			continue;
+		}
+		for (i = page; i < page + n; i++) {
+			if (plan->map[i])
+				plan->known = 0;
+			plan->map[i] = 1;
+		}
+		file->first = page;
+	}
+	return 0;
+}
+
+/*
+ * Write the files to be written into a model of the flash holding only
+ * the linear files that stay: linear files into the first run of free
+ * pages that fits, then data files into any free pages. All data files
+ * on the brick have to be moved since their pages are not known.
+ * Returns 1 if everything fits.
+ */
+static int plan_simulate(Plan *plan) {
+	PlanFile **order, *file;
+	unsigned int i, run, n, avail;
+	int j, count, fits = 1;
+
+	memset(plan->map, 0, plan->npages);
+	for (j = 0; j < plan->count; j++) {
+		file = &plan->files[j];
+		if (plan_stays(file) && !file->linear)
+			return 0;
+		if (plan_stays(file))
+			memset(plan->map + file->first, 1, plan_pages(file->remotesize));
+	}
+
+	order = plan_sorted(plan, plan_written, &count);
+	for (j = 0; j < count && fits; j++) {
+		n = plan_pages(order[j]->size);
+		if (order[j]->linear) {
+			for (i = 0, run = 0; i < plan->npages && run < n; i++)
+				run = plan->map[i] ? 0 : run + 1;
+			if (run < n)
+				fits = 0;
+			else
+				memset(plan->map + i - n, 1, n);
+		} else {
+			for (i = 0, avail = 0; i < plan->npages && avail < n; i++) {
+				if (!plan->map[i]) {
+					plan->map[i] = 1;
+					avail++;
+				}
+			}
+			if (avail < n)
+				fits = 0;
+		}
+	}
+	free(order);
+
+	/* without uploads the goal is a single run of free pages */
+	for (i = 0, run = 0; fits && plan->compact && i < plan->npages; i++) {
+		if (!plan->map[i] && (i == 0 || plan->map[i - 1]))
+			run++;
+	}
+	if (fits && plan->compact && run > 1)
+		fits = 0;
+	return fits;
+}
+
+/*
+ * Does the upload fit without moving files? The model only knows the
+ * answer if there are no data files on the brick, otherwise the brick
+ * is asked by creating and deleting empty linear files.
+ */
+static int plan_fits(Plan *plan, NXT *nxt) {
+	PlanFile **order;
+	unsigned int *sizes;
+	unsigned int used = 0;
+	int i, count, res;
+
+	for (i = 0; i < plan->count; i++) {
+		if (plan_stays(&plan->files[i]) && !plan->files[i].linear)
+			break;
+	}
+	if (i == plan->count && plan->known)
+		return plan_simulate(plan);
+
+	order = plan_sorted(plan, plan_written, &count);
+	if ((sizes = malloc((count + 1) * sizeof(unsigned int))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (i = 0; i < count && order[i]->linear; i++)
+		sizes[i] = order[i]->size;
+	if (plan->compact) {
+		/* one linear file taking all free pages */
+		for (i = 0; i < plan->count; i++)
+			used += plan_pages(plan->files[i].remotesize);
+		sizes[0] = (plan->npages - used) * NXT_FLASH_PAGE;
+		i = sizes[0] > 0;
+	}
+	plan->probed = i > 0;
+	res = i > 0 ? nxt_linear_fits(nxt, sizes, i) : 1;
+	free(sizes);
+	free(order);
+	return res;
+}
+
+/*
+ * Find the cheapest set of files to move: all data files and a run of
+ * linear files adjacent in flash, possibly empty. Without the place of
+ * the linear files everything is moved. Returns 1 if a plan was found.
+ */
+static int plan_search(Plan *plan) {
+	PlanFile **linear, *file;
+	unsigned long cost, best = ~0UL;
+	int i, j, k, count, besti = -1, bestj = -1;
+
+	for (i = 0; i < plan->count; i++) {
+		file = &plan->files[i];
+		file->move = file->remote && !file->local && (!file->linear || !plan->known);
+	}
+	if (!plan->known)
+		return plan_simulate(plan);
+
+	/* remote linear files in flash order */
+	if ((linear = malloc((plan->count + 1) * sizeof(PlanFile *))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (count = 0, i = 0; i < plan->count; i++) {
+		if (plan_stays(&plan->files[i])) {
+			for (j = count; j > 0 && linear[j - 1]->first > plan->files[i].first; j--)
+				linear[j] = linear[j - 1];
+			linear[j] = &plan->files[i];
+			count++;
+		}
+	}
+
+	for (i = 0; i <= count; i++) {
+		for (j = i; j <= count; j++) {
+			for (k = 0, cost = 0; k < count; k++) {
+				linear[k]->move = k >= i && k < j;
+				if (linear[k]->move)
+					cost += linear[k]->remotesize;
+			}
+			if (cost < best && plan_simulate(plan)) {
+				best = cost;
+				besti = i;
+				bestj = j;
+			}
+		}
+	}
+	for (k = 0; k < count; k++)
+		linear[k]->move = k >= besti && k < bestj;
+	free(linear);
+	return besti >= 0;
+}
+
+static void plan_print(Plan *plan, NXTInfo *info, int fits) {
+	PlanFile **order;
+	unsigned long bytes = 0;
+	int i, count, moved = 0;
+
+	printf("flash: %u pages of %d bytes, %u bytes free\n",
+		   plan->npages, NXT_FLASH_PAGE, info->free_space);
+	if (!plan->known)
+		printf("flash: place of the linear files not known, all files are moved\n");
+	if (plan->probed)
+		printf("flash: free runs checked by creating and deleting nxtctlN.tmp on the brick\n");
+	for (i = 0; i < plan->count; i++) {
+		if (plan->files[i].local)
+			printf("upload %s (%u bytes, %s%s)\n", plan->files[i].name, plan->files[i].size,
+				   plan->files[i].linear ? "linear" : "data",
+				   plan->files[i].remote ? ", replaces the file on the brick" : "");
+		if (plan->files[i].move) {
+			moved++;
+			bytes += plan->files[i].remotesize;
+		}
+	}
+	if (fits) {
+		printf("plan: %s without moving files\n", plan->compact ?
+			   "the free flash is contiguous" : "fits");
+		return;
+	}
+	printf("plan: move %d files (%lu bytes):", moved, bytes);
+	for (i = 0; i < plan->count; i++)
+		if (plan->files[i].move)
+			printf(" %s", plan->files[i].name);
+	printf("\nplan: write");
+	order = plan_sorted(plan, plan_written, &count);
+	for (i = 0; i < count; i++)
+		printf(" %s", order[i]->name);
+	printf("\n");
+	free(order);
+}
+
+/* write the pulled copy of file back, as the kind of file it was */
+static int plan_restore(NXT *nxt, PlanFile *file, const char *path) {
+	int linear = nxt->linear, res;
+
+	nxt->linear = file->remotelinear ? NXT_LINEAR_ALWAYS : NXT_LINEAR_NEVER;
+	if ((res = nxt_put_file_as(nxt, file->name, path)) == 0)
+		unlink(path);
+	nxt->linear = linear;
+	return res;
+}
+
+/*
+ * Move the planned files through dir, which keeps them until they are
+ * on the brick again, and upload the local files. The files the local
+ * ones replace are pulled as well and written back if the upload fails.
+ */
+static int plan_execute(Plan *plan, NXT *nxt, const NXTInfo *info, int fits) {
+	char dir[PATH_MAX], path[PATH_MAX + 20];
+	PlanFile **order, *file;
+	int i, count, failed = 0, moved = 0, uploaded = 0;
+	int resume = nxt->resume;
+	double start;
+
+	start = nxt_clock();
+	if (!fits) {
+		if (cache_dir(dir, sizeof(dir), ".defrag", info) != 0)
+			return -1;
+		/* an empty one is reused */
+		if (mkdir(dir, 0700) != 0 && (errno != EEXIST || rmdir(dir) != 0 ||
+									   mkdir(dir, 0700) != 0)) {
+			fprintf(stderr, "error: %s is left from an earlier defrag, "
+					"upload its files or remove it\n", dir);
+			return -1;
+		}
+
+		/* nothing is deleted before all files are pulled */
+		nxt->resume = 0;
+		for (i = 0; i < plan->count; i++) {
+			file = &plan->files[i];
+			snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+			if (file->remote && plan_written(file) &&
+				nxt_get_file_as(nxt, file->name, path) != 0) {
+				nxt->resume = resume;
+				for (i = 0; i < plan->count; i++) {
+					snprintf(path, sizeof(path), "%s/%s", dir, plan->files[i].name);
+					unlink(path);
+				}
+				rmdir(dir);
+				return -1;
+			}
+		}
+		nxt->resume = resume;
+
+		for (i = 0; i < plan->count; i++) {
+			file = &plan->files[i];
+			if (file->remote && plan_written(file)) {
+				if (nxt_delete_file(nxt, file->name) != 0)
+					break;
+				file->deleted = 1;
+			}
+		}
+	}
+
+	order = plan_sorted(plan, plan_written, &count);
+	for (i = 0; i < count; i++) {
+		file = order[i];
+		if (file->local) {
+			if (nxt_put_file_as(nxt, file->name, file->local) != 0) {
+				failed++;
+				if (!fits && file->remote) {
+					snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+					if (plan_restore(nxt, file, path) == 0)
+						printf("defrag: %s restored\n", file->name);
+				}
+			} else {
+				uploaded++;
+				if (!fits && file->remote) {
+					snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+					unlink(path);
+				}
+			}
+		} else if (file->deleted) {
+			snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+			if (plan_restore(nxt, file, path) != 0)
+				failed++;
+			else
+				moved++;
+		} else if (file->move) {
+			/* the delete failed, it is still on the brick */
+			snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+			unlink(path);
+		}
+	}
+	free(order);
+
+	if (!fits && rmdir(dir) != 0)
+		fprintf(stderr, "error: files that could not be written back are kept in %s\n", dir);
+	printf("defrag: %d files moved, %d uploaded, %d failed, %.2f s\n",
+		   moved, uploaded, failed, nxt_clock() - start);
+	return failed ? -1 : 0;
+}
+
+/*
+ * Plan the upload of the local files, or with none the compaction of
+ * the free flash, print the plan and with execute set carry it out
+ */
+int plan_run(NXT *nxt, char *const *localnames, int count, int execute) {
+	NXTInfo info;
+	Plan plan;
+	PlanFile *file;
+	struct stat sb;
+	const char *base;
+	unsigned long need, avail;
+	int i, fits, res = -1;
+
+	memset(&plan, 0, sizeof(plan));
+	if (plan_load(&plan, nxt, &info) != 0)
+		goto out;
+	for (i = 0; i < count; i++) {
+		base = strrchr(localnames[i], '/') ? strrchr(localnames[i], '/') + 1 : localnames[i];
+		if (strlen(base) >= sizeof(file->name)) {
+			fprintf(stderr, "error: filename %s too long\n", base);
+			goto out;
+		}
+		if (stat(localnames[i], &sb) != 0 || !S_ISREG(sb.st_mode)) {
+			fprintf(stderr, "error: could not open local file %s\n", localnames[i]);
+			goto out;
+		}
+		file = plan_file(&plan, base);
+		file->local = localnames[i];
+		file->size = sb.st_size;
+		file->linear = nxt_is_linear(nxt, base);
+	}
+	plan.compact = count == 0;
+
+	for (i = 0, need = 0, avail = plan.npages; i < plan.count; i++) {
+		file = &plan.files[i];
+		if (file->local)
+			need += plan_pages(file->size);
+		else if (file->remote)
+			avail -= plan_pages(file->remotesize) < avail ?
+				plan_pages(file->remotesize) : avail;
+	}
+	if (need > avail) {
+		fprintf(stderr, "error: the files need %lu pages of flash, %lu are free\n",
+				need, avail);
+		goto out;
+	}
+
+	if ((fits = plan_fits(&plan, nxt)) < 0)
+		goto out;
+	if (!fits && !plan_search(&plan)) {
+		fprintf(stderr, "error: the files do not fit into the flash even when it is compacted\n");
+		goto out;
+	}
+	plan_print(&plan, &info, fits);
+	res = execute ? plan_execute(&plan, nxt, &info, fits) : 0;
+out:
+	free(plan.files);
+	free(plan.map);
+	return res;
+}
@@ -0,0 +1,344 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Sensor sampling. The ports are given as port:type[:mode] with the
+ * port numbered 1-4 like on the brick, e.g. 1:switch, 3:light:raw or
+ * 4:ultrasonic. Lowspeed sensors take register[/bytes] instead of a
+ * mode, ultrasonic is lowspeed_9v reading register 0x42. Options go in
+ * front of the ports as rate=hz,count=rounds,time=sec,format=csv|bin.
+ *
+ * Every sample becomes a CSV line or a fixed binary record of
+ * SAMPLE_RECORD bytes, little endian:
+ *
+ *   0  u64  time in nsec since the start, between request and reply
+ *   8  u32  latency estimate in usec, half the round trip
+ *  12  u32  round
+ *  16  u8   port 1-4
+ *  17  u8   status of the reply, 0 if fine
+ *  18  u8   flags: 1 valid, 2 calibrated
+ *  19  u8   sensor type
+ *  20  u16  raw
+ *  22  u16  normalized
+ *  24  s16  scaled
+ *  26  s16  calibrated
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "nxtcmd.h"
+#include "sample.h"
+
+#define SAMPLE_RECORD 28
+#define SAMPLE_PORTS  4
+
+static const char sample_header[] =
+	"time,latency,round,port,type,status,valid,calibrated,raw,normalized,scaled,calibrated_value\n";
+
+/* LEGO ultrasonic sensor: distance in cm */
+#define SAMPLE_US_REGISTER 0x42
+
+typedef struct {
+	NXTSensor sensors[SAMPLE_PORTS];
+	int count;
+	double rate;			/* rounds per second, 0: as fast as possible */
+	unsigned long rounds;	/* 0: until interrupted */
+	double time;			/* sec, 0: no limit */
+	int binary;
+	FileSink sink;
+	double start;
+	unsigned long samples;
+	unsigned long failed;
+	double latency;			/* sum */
+} Sampler;
+
+static volatile sig_atomic_t sample_stop;
+
+static void sample_signal(int sig) {
+	sample_stop = 1;
+}
+
+#define SAMPLE_NAME(NAME, code, name) { name, code },
+static const struct {
+	const char *name;
+	int code;
+} sample_types[] = {
+	NXT_SENSOR_TYPES(SAMPLE_NAME)
+	{ NULL, 0 }
+}, sample_modes[] = {
+	NXT_SENSOR_MODES(SAMPLE_NAME)
+	{ NULL, 0 }
+};
+#undef SAMPLE_NAME
+
+static int sample_lookup(const char *name, int types, int *code) {
+	unsigned long n;
+	char *end;
+	int i;
+
+	for (i = 0; types ? sample_types[i].name != NULL : sample_modes[i].name != NULL; i++) {
+		if (strcmp(name, types ? sample_types[i].name : sample_modes[i].name) == 0) {
+			*code = types ? sample_types[i].code : sample_modes[i].code;
+			return 0;
+		}
+	}
+	n = strtoul(name, &end, 0);
+	if (name[0] == 0 || *end || n > 0xff) {
+		fprintf(stderr, "error: unknown sensor %s %s\n", types ? "type" : "mode", name);
+		return -1;
+	}
+	*code = n;
+	return 0;
+}
+
+/*
+ * Analog sensors read the unit they are made for unless told otherwise
+ */
+static int sample_default_mode(int type) {
+	switch (type) {
+	case NXT_SENSOR_SWITCH:
+		return NXT_MODE_BOOLEAN;
+	case NXT_SENSOR_TEMPERATURE:
+		return NXT_MODE_CELSIUS;
+	case NXT_SENSOR_ANGLE:
+		return NXT_MODE_ANGLE_STEPS;
+	case NXT_SENSOR_REFLECTION:
+	case NXT_SENSOR_LIGHT_ACTIVE:
+	case NXT_SENSOR_LIGHT_INACTIVE:
+	case NXT_SENSOR_SOUND_DB:
+	case NXT_SENSOR_SOUND_DBA:
+		return NXT_MODE_PERCENT;
+	default:
+		return NXT_MODE_RAW;
+	}
+}
+
+static int sample_port(const char *spec, NXTSensor *s) {
+	char copy[64], *type, *mode, *end;
+	unsigned long reg, len = 1;
+	int code;
+
+	if (strlen(spec) >= sizeof(copy)) {
+		fprintf(stderr, "error: invalid port %s\n", spec);
+		return -1;
+	}
+	strcpy(copy, spec);
+	memset(s, 0, sizeof(*s));
+	if ((type = strchr(copy, ':')) == NULL || copy[0] < '1' || copy[0] > '4' ||
+		type != copy + 1) {
+		fprintf(stderr, "error: port %s is not port:type[:mode] with port 1-4\n", spec);
+		return -1;
+	}
+	*type++ = 0;
+	if ((mode = strchr(type, ':')) != NULL)
+		*mode++ = 0;
+	s->port = copy[0] - '1';
+
+	if (strcmp(type, "ultrasonic") == 0) {
+		code = NXT_SENSOR_LOWSPEED_9V;
+		if (!mode)
+			mode = "0x42";
+	} else if (sample_lookup(type, 1, &code) != 0) {
+		return -1;
+	}
+	s->type = code;
+	if (code != NXT_SENSOR_LOWSPEED && code != NXT_SENSOR_LOWSPEED_9V) {
+		if (!mode)
+			s->mode = sample_default_mode(code);
+		else if (sample_lookup(mode, 0, &code) != 0)
+			return -1;
+		else
+			s->mode = code;
+		return 0;
+	}
+
+	/* the raw, normalized and scaled fields hold two bytes */
+	reg = mode ? strtoul(mode, &end, 0) : SAMPLE_US_REGISTER;
+	if (mode && *end == '/')
+		len = strtoul(end + 1, &end, 0);
+	if ((mode && (mode[0] == 0 || *end)) || reg > 0xff || len < 1 || len > 2) {
+		fprintf(stderr, "error: port %s: lowspeed sensors read register[/1-2 bytes]\n", spec);
+		return -1;
+	}
+	s->mode = NXT_MODE_RAW;
+	s->ls_register = reg;
+	s->ls_len = len;
+	return 0;
+}
+
+static int sample_options(Sampler *sp, const char *options) {
+	char *copy, *opt, *val, *end, *last;
+	int res = 0;
+	double n;
+
+	if ((copy = strdup(options)) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	for (opt = strtok_r(copy, ",", &last); opt; opt = strtok_r(NULL, ",", &last)) {
+		if ((val = strchr(opt, '=')) == NULL) {
+			fprintf(stderr, "error: sample option %s has no value\n", opt);
+			res = -1;
+			break;
+		}
+		*val++ = 0;
+		if (strcmp(opt, "format") == 0 && strcmp(val, "csv") == 0) {
+			sp->binary = 0;
+			continue;
+		}
+		if (strcmp(opt, "format") == 0 && strcmp(val, "bin") == 0) {
+			sp->binary = 1;
+			continue;
+		}
+		n = strtod(val, &end);
+		if (val[0] == 0 || *end || n < 0) {
+			fprintf(stderr, "error: invalid value %s for sample option %s\n", val, opt);
+			res = -1;
+			break;
+		}
+		if (strcmp(opt, "rate") == 0)
+			sp->rate = n;
+		else if (strcmp(opt, "count") == 0)
+			sp->rounds = n;
+		else if (strcmp(opt, "time") == 0)
+			sp->time = n;
+		else {
+			fprintf(stderr, "error: invalid sample option %s=%s\n", opt, val);
+			res = -1;
+			break;
+		}
+	}
+	free(copy);
+	return res;
+}
+
+static int sample_write(const NXTSample *sample, void *arg) {
+	Sampler *sp = arg;
+	const NXTSensor *s = &sp->sensors[sample->sensor];
+	unsigned char rec[SAMPLE_RECORD];
+	uint64_t ns;
+	char line[128];
+	int len;
+
+	ns = (sample->time - sp->start) * 1e9;
+	if (sp->binary) {
+		buf_put_le32(rec, ns);
+		buf_put_le32(rec + 4, ns >> 32);
+		buf_put_le32(rec + 8, sample->latency * 1e6);
+		buf_put_le32(rec + 12, sample->round);
+		rec[16] = s->port + 1;
+		rec[17] = sample->status;
+		rec[18] = (sample->valid ? 1 : 0) | (sample->calibrated ? 2 : 0);
+		rec[19] = s->type;
+		buf_put_le16(rec + 20, sample->raw);
+		buf_put_le16(rec + 22, sample->normalized);
+		buf_put_le16(rec + 24, sample->scaled);
+		buf_put_le16(rec + 26, sample->calibrated_value);
+		if (fio_sink_write(&sp->sink, rec, sizeof(rec)) != 0)
+			return -1;
+	} else {
+		len = snprintf(line, sizeof(line), "%.6f,%.3f,%lu,%d,%d,%d,%d,%d,%hu,%hu,%hd,%hd\n",
+					   ns / 1e9, sample->latency * 1e3, sample->round, s->port + 1, s->type,
+					   sample->status, sample->valid, sample->calibrated, sample->raw,
+					   sample->normalized, sample->scaled, sample->calibrated_value);
+		if (fio_sink_write(&sp->sink, line, len) != 0)
+			return -1;
+	}
+	/* pipes get every sample right away */
+	if (!sp->sink.regular && fio_sink_flush(&sp->sink) != 0)
+		return -1;
+	sp->samples++;
+	sp->failed += sample->status != NXT_SUCCESS;
+	sp->latency += sample->latency;
+	return sample_stop || (sp->time > 0 && sample->time - sp->start >= sp->time);
+}
+
+/*
+ * Sample the sensors given as [options] port:type[:mode] ... into the
+ * local file output, "-" for stdout, until the count or time is reached
+ * or SIGINT.
+ */
+int sample_run(NXT *nxt, char *const *argv, int argc, const char *output) {
+	struct sigaction sa, old;
+	unsigned long skipped;
+	double elapsed;
+	Sampler *sp;
+	int i, j, res;
+
+	if ((sp = calloc(1, sizeof(Sampler))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	res = -1;
+	if (argc > 0 && strchr(argv[0], '=') && sample_options(sp, argv[0]) == 0) {
+		argv++;
+		argc--;
+	} else if (argc > 0 && strchr(argv[0], '=')) {
+		goto out;
+	}
+	if (argc < 1 || argc > SAMPLE_PORTS) {
+		fprintf(stderr, "error: usage: sample [options] port:type[:mode] ...\n");
+		goto out;
+	}
+	for (i = 0; i < argc; i++) {
+		if (sample_port(argv[i], &sp->sensors[i]) != 0)
+			goto out;
+		for (j = 0; j < i; j++) {
+			if (sp->sensors[j].port == sp->sensors[i].port) {
+				fprintf(stderr, "error: port %d given twice\n", sp->sensors[i].port + 1);
+				goto out;
+			}
+		}
+	}
+	sp->count = argc;
+	if (sp->binary && strcmp(output, "-") == 0 && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "error: not writing binary samples to a terminal\n");
+		goto out;
+	}
+	if (fio_sink_open(&sp->sink, output, nxt->sync, 0666) != 0)
+		goto out;
+	if (!sp->binary &&
+		fio_sink_write(&sp->sink, sample_header, sizeof(sample_header) - 1) != 0) {
+		fio_sink_close(&sp->sink);
+		goto out;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sample_signal;
+	sigaction(SIGINT, &sa, &old);
+	sample_stop = 0;
+	sp->start = nxt_clock();
+	res = nxt_sample(nxt, sp->sensors, sp->count, sp->rate, sp->rounds, &skipped,
+					 &sample_stop, sample_write, sp);
+	elapsed = nxt_clock() - sp->start;
+	sigaction(SIGINT, &old, NULL);
+	if (fio_sink_close(&sp->sink) != 0)
+		res = -1;
+
+	fprintf(stderr, "%lu samples, %lu failed in %.2f s (%.1f samples/s), "
+			"%.2f ms latency, %lu rounds skipped\n",
+			sp->samples, sp->failed, elapsed, elapsed > 0 ? sp->samples / elapsed : 0.0,
+			sp->samples ? sp->latency / sp->samples * 1e3 : 0.0, skipped);
+out:
+	free(sp);
+	return res;
+}
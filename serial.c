@@ -0,0 +1,205 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "nxt.h"
+#include "serial.h"
+#include "trace.h"
+
+extern int vflag;
+
+typedef struct {
+	int fd;
+	int broken;		/* a frame was cut short, the stream is out of step */
+	size_t len;
+	unsigned char batch[SERIAL_BATCH];
+} SerialLink;
+
+/*
+ * Write out the collected requests. Requests without reply in a failed
+ * batch were already reported as sent and the brick may have seen half
+ * a frame, so the link fails every later transfer instead of going on
+ * out of step.
+ */
+static int serial_flush(SerialLink *link) {
+	unsigned char *p = link->batch;
+	ssize_t nw;
+
+	if (link->broken)
+		return -1;
+	while (link->len > 0) {
+		nw = write(link->fd, p, link->len);
+		if (nw < 0 && errno == EINTR)
+			continue;
+		if (nw <= 0) {
+			fprintf(stderr, "error: serial link failed, requests lost\n");
+			link->len = 0;
+			link->broken = 1;
+			return -1;
+		}
+		p += nw;
+		link->len -= nw;
+	}
+	return 0;
+}
+
+/*
+ * Read exactly len bytes, giving up with NXT_TIMEOUT after timeout
+ * msec without data
+ */
+static int serial_read_full(SerialLink *link, unsigned char *data, size_t len,
+							unsigned int timeout) {
+	struct pollfd pfd;
+	ssize_t nr;
+	int res;
+
+	pfd.fd = link->fd;
+	pfd.events = POLLIN;
+	while (len > 0) {
+		if ((res = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+			continue;
+		if (res == 0)
+			return NXT_TIMEOUT;
+		if (res < 0)
+			return -1;
+		nr = read(link->fd, data, len);
+		if (nr < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (nr <= 0)
+			return -1;
+		data += nr;
+		len -= nr;
+	}
+	return 0;
+}
+
+static int serial_write(NXT *self, const unsigned char *data, size_t len) {
+	SerialLink *link = self->link;
+
+	if (link->broken || len > sizeof(link->batch) - 2)
+		return -1;
+	if (link->len + 2 + len > sizeof(link->batch) && serial_flush(link) != 0) {
+		TRACE_ERROR(-1, 0);
+		return -1;
+	}
+	link->batch[link->len++] = len;
+	link->batch[link->len++] = len >> 8;
+	memcpy(link->batch + link->len, data, len);
+	link->len += len;
+	return 0;
+}
+
+static int serial_read(NXT *self, unsigned char *data, size_t size, size_t *len) {
+	SerialLink *link = self->link;
+	unsigned char hdr[2];
+	int res;
+
+	if (serial_flush(link) != 0) {
+		TRACE_ERROR(-1, 0);
+		return -1;
+	}
+	if ((res = serial_read_full(link, hdr, 1, self->timeout)) != 0) {
+		TRACE_ERROR(res, 0);
+		return res;
+	}
+	if ((res = serial_read_full(link, hdr + 1, 1, self->timeout)) != 0) {
+		TRACE_ERROR(res, 0);
+		link->broken = 1;
+		return res;
+	}
+	*len = hdr[0] | hdr[1] << 8;
+	/* the rest of a frame would be taken for the next length prefix */
+	if (*len == 0 || *len > size) {
+		TRACE_ERROR(-1, 0);
+		link->broken = 1;
+		return -1;
+	}
+	if ((res = serial_read_full(link, data, *len, self->timeout)) != 0) {
+		TRACE_ERROR(res, 0);
+		link->broken = 1;
+		return res;
+	}
+	return 0;
+}
+
+static void serial_close(NXT *self) {
+	SerialLink *link = self->link;
+
+	if (!link->broken)
+		serial_flush(link);
+	close(link->fd);
+	free(link);
+	self->link = NULL;
+}
+
+static const NXTTransport serial_transport = {
+	"serial", serial_write, serial_read, serial_close
+};
+
+/*
+ * Open the tty at path in raw mode and use it as transport for nxt
+ */
+int serial_open(NXT *nxt, const char *path) {
+	struct termios tio;
+	SerialLink *link;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_NOCTTY)) < 0) {
+		fprintf(stderr, "error: could not open %s\n", path);
+		return -1;
+	}
+	if (isatty(fd)) {
+		if (tcgetattr(fd, &tio) != 0) {
+			fprintf(stderr, "error: could not get attributes of %s\n", path);
+			close(fd);
+			return -1;
+		}
+		cfmakeraw(&tio);
+		/* RFCOMM ignores the speed, a real serial port needs it */
+		cfsetispeed(&tio, B115200);
+		cfsetospeed(&tio, B115200);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tio.c_cc[VMIN] = 1;
+		tio.c_cc[VTIME] = 0;
+		if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+			fprintf(stderr, "error: could not set attributes of %s\n", path);
+			close(fd);
+			return -1;
+		}
+		tcflush(fd, TCIOFLUSH);
+	}
+	if ((link = calloc(1, sizeof(SerialLink))) == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	link->fd = fd;
+	if (vflag)
+		fprintf(stderr, "using serial link %s\n", path);
+	nxt->link = link;
+	nxt->transport = &serial_transport;
+	return 0;
+}
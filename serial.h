@@ -0,0 +1,39 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+/*
+ * Serial transport for the bluetooth link of the brick, e.g. a bound
+ * RFCOMM tty. Every packet is sent with the 2 byte little endian
+ * length prefix of the bluetooth protocol.
+ *
+ * Bluetooth turnaround is tens of milliseconds, so requests are not
+ * sent one by one: they are collected and written in one go when a
+ * reply is read or the batch is full. Requests without reply then cost
+ * no round trip, and pipelined transfers put a whole window of
+ * requests on the link at once.
+ */
+
+#define SERIAL_BATCH   1024		/* bytes collected before writing */
+
+struct nxt;
+
+int serial_open(struct nxt *nxt, const char *path);
+
+#endif
@@ -0,0 +1,243 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nxt.h"
+#include "nxtcmd.h"
+#include "stats.h"
+
+typedef struct {
+	unsigned long count;	/* all requests, with and without reply */
+	unsigned long replies;	/* requests in the histogram */
+	unsigned long bytes;
+	unsigned long errors;
+	unsigned long timeouts;
+	unsigned long retries;
+	unsigned long max;		/* usec */
+	uint32_t hist[STATS_BUCKETS];
+} OpStats;
+
+int stats_mode;
+
+static OpStats ops[256];
+static double started;
+static int progress;
+
+/* the transfer shown by the progress line */
+static const char *xfer_name;
+static unsigned long xfer_total;
+static double xfer_start, xfer_shown;
+static int xfer_printed;
+
+void stats_start(int mode, int show_progress) {
+	stats_mode = mode;
+	progress = show_progress && isatty(STDERR_FILENO);
+	started = nxt_clock();
+}
+
+/*
+ * Bucket of a latency: 0-3 usec map to themselves, above that every
+ * power of two is split into four buckets
+ */
+static int stats_bucket(unsigned long usec) {
+	int b;
+
+	if (usec < 4)
+		return usec;
+	for (b = 2; b < 63 && (usec >> (b + 1)) != 0; b++)
+		;
+	b = 4 * (b - 1) + ((usec >> (b - 2)) & 3);
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+/* largest latency falling into bucket i */
+static unsigned long stats_bucket_max(int i) {
+	int b;
+
+	if (i < 3)
+		return i;
+	i++;
+	b = i / 4 + 1;
+	return ((unsigned long) (4 + i % 4) << (b - 2)) - 1;
+}
+
+/*
+ * Record a request of opcode with bytes sent and received. latency is
+ * the time to the reply in seconds, negative if no reply was wanted.
+ */
+void stats_record(int opcode, size_t bytes, double latency) {
+	OpStats *op = &ops[opcode & 0xff];
+	unsigned long usec, max;
+
+	if (!stats_mode)
+		return;
+	__sync_fetch_and_add(&op->count, 1);
+	__sync_fetch_and_add(&op->bytes, bytes);
+	if (latency < 0)
+		return;
+	usec = latency * 1e6;
+	__sync_fetch_and_add(&op->replies, 1);
+	__sync_fetch_and_add(&op->hist[stats_bucket(usec)], 1);
+	while ((max = op->max) < usec && !__sync_bool_compare_and_swap(&op->max, max, usec))
+		;
+}
+
+void stats_error(int opcode, int timeout) {
+	if (!stats_mode)
+		return;
+	__sync_fetch_and_add(&ops[opcode & 0xff].errors, 1);
+	if (timeout)
+		__sync_fetch_and_add(&ops[opcode & 0xff].timeouts, 1);
+}
+
+void stats_retry(int opcode) {
+	if (stats_mode)
+		__sync_fetch_and_add(&ops[opcode & 0xff].retries, 1);
+}
+
+static unsigned long stats_percentile(OpStats *op, double p) {
+	unsigned long rank, seen = 0;
+	int i;
+
+	if (op->replies == 0)
+		return 0;
+	rank = p * op->replies;
+	if (rank < p * op->replies || rank == 0)
+		rank++;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += op->hist[i];
+		if (seen >= rank)
+			return stats_bucket_max(i) < op->max ? stats_bucket_max(i) : op->max;
+	}
+	return op->max;
+}
+
+static const char* stats_name(int opcode, char *buf, size_t size) {
+	const char *name;
+
+	if ((name = nxt_command_name(opcode)) != NULL)
+		return name;
+	snprintf(buf, size, "0x%02x", opcode);
+	return buf;
+}
+
+/*
+ * Print the statistics as a table or as JSON, depending on stats_mode
+ */
+void stats_print(FILE *fp) {
+	unsigned long bytes = 0, errors = 0, timeouts = 0, retries = 0;
+	double elapsed = nxt_clock() - started;
+	char buf[8];
+	const char *name;
+	OpStats *op;
+	int i, first = 1;
+
+	if (!stats_mode)
+		return;
+	/* keep the report after the regular output */
+	fflush(stdout);
+	for (i = 0; i < 256; i++) {
+		bytes += ops[i].bytes;
+		errors += ops[i].errors;
+		timeouts += ops[i].timeouts;
+		retries += ops[i].retries;
+	}
+
+	if (stats_mode == STATS_JSON) {
+		fprintf(fp, "{\"elapsed\": %.6f, \"bytes\": %lu, \"errors\": %lu, "
+				"\"timeouts\": %lu, \"retries\": %lu, \"commands\": [",
+				elapsed, bytes, errors, timeouts, retries);
+		for (i = 0; i < 256; i++) {
+			op = &ops[i];
+			if (op->count == 0 && op->errors == 0)
+				continue;
+			name = stats_name(i, buf, sizeof(buf));
+			fprintf(fp, "%s\n  {\"name\": \"%s\", \"opcode\": %d, \"count\": %lu, "
+					"\"replies\": %lu, \"bytes\": %lu, \"errors\": %lu, "
+					"\"timeouts\": %lu, \"retries\": %lu, \"p50_us\": %lu, "
+					"\"p90_us\": %lu, \"p99_us\": %lu, \"max_us\": %lu}",
+					first ? "" : ",", name, i, op->count, op->replies, op->bytes,
+					op->errors, op->timeouts, op->retries,
+					stats_percentile(op, 0.5), stats_percentile(op, 0.9),
+					stats_percentile(op, 0.99), op->max);
+			first = 0;
+		}
+		fprintf(fp, "\n]}\n");
+		return;
+	}
+
+	fprintf(fp, "%-24s %7s %9s %6s %8s %8s %8s %8s\n", "command", "count",
+			"bytes", "errors", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	for (i = 0; i < 256; i++) {
+		op = &ops[i];
+		if (op->count == 0 && op->errors == 0)
+			continue;
+		fprintf(fp, "%-24s %7lu %9lu %6lu %8.2f %8.2f %8.2f %8.2f\n",
+				stats_name(i, buf, sizeof(buf)), op->count, op->bytes, op->errors,
+				stats_percentile(op, 0.5) / 1e3, stats_percentile(op, 0.9) / 1e3,
+				stats_percentile(op, 0.99) / 1e3, op->max / 1e3);
+	}
+	fprintf(fp, "%lu bytes in %.2f s", bytes, elapsed);
+	if (elapsed > 0)
+		fprintf(fp, " (%.1f KB/s)", bytes / elapsed / 1024);
+	fprintf(fp, ", %lu errors, %lu timeouts, %lu retries\n", errors, timeouts, retries);
+}
+
+/***********************************************************************/
+/* progress of long transfers                                          */
+/***********************************************************************/
+
+void stats_transfer_begin(const char *filename, unsigned long total) {
+	if (!progress)
+		return;
+	xfer_name = filename;
+	xfer_total = total;
+	xfer_start = xfer_shown = nxt_clock();
+	xfer_printed = 0;
+}
+
+/*
+ * Show rate and ETA on stderr, only for transfers that run longer than
+ * a second and at most four times a second
+ */
+void stats_transfer_progress(unsigned long done) {
+	double now, rate;
+
+	if (!progress || !xfer_name)
+		return;
+	now = nxt_clock();
+	if (now - xfer_start < 1 || now - xfer_shown < 0.25)
+		return;
+	xfer_shown = now;
+	rate = done / (now - xfer_start);
+	fprintf(stderr, "\r%s: %lu/%lu bytes %.1f KB/s", xfer_name, done, xfer_total,
+			rate / 1024);
+	if (rate > 0 && done < xfer_total)
+		fprintf(stderr, " ETA %.0fs ", (xfer_total - done) / rate);
+	xfer_printed = 1;
+}
+
+void stats_transfer_end(void) {
+	if (xfer_printed)
+		fprintf(stderr, "\n");
+	xfer_name = NULL;
+	xfer_printed = 0;
+}
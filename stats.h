@@ -0,0 +1,50 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Opt-in per opcode statistics: call count, bytes on the wire and a
+ * latency histogram of request to reply time, plus transport errors,
+ * timeouts and retries. The histogram has four buckets per power of
+ * two microseconds, so percentiles are exact to 25% in fixed memory.
+ * Counters are updated atomically, fleet mode threads share them.
+ */
+
+#define STATS_BUCKETS 128
+
+enum {
+	STATS_TABLE = 1,
+	STATS_JSON
+};
+
+extern int stats_mode;		/* 0: disabled, STATS_TABLE or STATS_JSON */
+
+void stats_start(int mode, int progress);
+void stats_record(int opcode, size_t bytes, double latency);
+void stats_error(int opcode, int timeout);
+void stats_retry(int opcode);
+void stats_transfer_begin(const char *filename, unsigned long total);
+void stats_transfer_progress(unsigned long done);
+void stats_transfer_end(void);
+void stats_print(FILE *fp);
+
+#endif
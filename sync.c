@@ -0,0 +1,264 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Incremental upload of a local directory. A file is uploaded if it is
+ * missing on the brick, if its size differs, or if its content hash
+ * differs from the one recorded in the manifest of the brick
+ * (~/.nxtctl/<bluetooth address>.manifest) when it was last uploaded.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "fio.h"
+#include "sync.h"
+
+typedef struct {
+	char name[20];
+	unsigned int size;
+	uint64_t hash;
+	int local;		/* exists in the local directory */
+	int remote;		/* exists on the brick */
+	unsigned int remotesize;
+	int known;		/* hash is in the manifest */
+	uint64_t known_hash;
+} SyncFile;
+
+typedef struct {
+	SyncFile *files;
+	int count;
+} SyncList;
+
+static SyncFile* sync_file(SyncList *list, const char *name) {
+	SyncFile *file;
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		if (strcmp(list->files[i].name, name) == 0)
+			return &list->files[i];
+	}
+	list->files = realloc(list->files, (list->count + 1) * sizeof(SyncFile));
+	if (list->files == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(1);
+	}
+	file = &list->files[list->count++];
+	memset(file, 0, sizeof(*file));
+	strncpy(file->name, name, sizeof(file->name) - 1);
+	return file;
+}
+
+/*
+ * 64 bit FNV-1a hash of the file content
+ */
+static int sync_hash(const char *path, uint64_t *hash) {
+	unsigned char data[BUFSIZ];
+	ssize_t nr;
+	uint64_t h = FIO_HASH_INIT;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	while ((nr = read(fd, data, sizeof(data))) > 0)
+		h = fio_hash(h, data, nr);
+	close(fd);
+	if (nr < 0)
+		return -1;
+	*hash = h;
+	return 0;
+}
+
+static int sync_scan_local(SyncList *list, const char *dir, const char *pattern) {
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat sb;
+	SyncFile *file;
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL) {
+		fprintf(stderr, "error: could not open directory %s\n", dir);
+		return -1;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		if (de->d_name[0] == '.' || strlen(de->d_name) >= 20 ||
+			fnmatch(pattern, de->d_name, 0) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (stat(path, &sb) != 0 || !S_ISREG(sb.st_mode))
+			continue;
+		file = sync_file(list, de->d_name);
+		if (sync_hash(path, &file->hash) != 0) {
+			fprintf(stderr, "error: could not read %s\n", path);
+			closedir(dp);
+			return -1;
+		}
+		file->local = 1;
+		file->size = sb.st_size;
+	}
+	closedir(dp);
+	return 0;
+}
+
+static int sync_remote_cb(const char *name, unsigned int size, void *arg) {
+	SyncFile *file = sync_file(arg, name);
+
+	file->remote = 1;
+	file->remotesize = size;
+	return 0;
+}
+
+static void sync_load_manifest(SyncList *list, const char *path) {
+	char line[BUFSIZ];
+	char name[20];
+	uint64_t hash;
+	SyncFile *file;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%" SCNx64 " %19s", &hash, name) != 2)
+			continue;
+		file = sync_file(list, name);
+		file->known = 1;
+		file->known_hash = hash;
+	}
+	fclose(fp);
+}
+
+/*
+ * Entries outside of pattern were not looked at and are kept as they are
+ */
+static int sync_save_manifest(SyncList *list, const char *path, const char *pattern) {
+	char tmp[PATH_MAX + 4];
+	FILE *fp;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "error: could not write %s\n", tmp);
+		return -1;
+	}
+	for (i = 0; i < list->count; i++) {
+		if (list->files[i].known &&
+			(list->files[i].remote || fnmatch(pattern, list->files[i].name, 0) != 0))
+			fprintf(fp, "%016" PRIx64 " %s\n",
+					list->files[i].known_hash, list->files[i].name);
+	}
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "error: could not write %s\n", path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Upload new and changed files from dir matching pattern. With delete
+ * set, remote files matching pattern that do not exist in dir are
+ * deleted.
+ */
+int sync_run(NXT *nxt, const char *dir, const char *pattern, int delete) {
+	char manifest[PATH_MAX];
+	char path[PATH_MAX];
+	NXTInfo info;
+	SyncList list;
+	SyncFile *file;
+	const char *why;
+	unsigned int bytes = 0;
+	int uploaded = 0, unchanged = 0, deleted = 0, failed = 0;
+	int i, res;
+	double start;
+
+	start = nxt_clock();
+	memset(&list, 0, sizeof(list));
+	if (!pattern)
+		pattern = "*.*";
+
+	if (nxt_get_device_info(nxt, &info) != 0 ||
+		cache_dir(manifest, sizeof(manifest), ".manifest", &info) != 0)
+		return -1;
+	if (sync_scan_local(&list, dir, pattern) != 0)
+		return -1;
+	if (nxt->cache)
+		res = cache_list(nxt->cache, pattern, sync_remote_cb, &list);
+	else
+		res = nxt_list_files(nxt, pattern, sync_remote_cb, &list);
+	if (res != 0)
+		return -1;
+	sync_load_manifest(&list, manifest);
+
+	for (i = 0; i < list.count; i++) {
+		file = &list.files[i];
+		if (file->local) {
+			if (!file->remote)
+				why = "new";
+			else if (file->remotesize != file->size)
+				why = "size changed";
+			else if (!file->known)
+				why = "not in manifest";
+			else if (file->known_hash != file->hash)
+				why = "content changed";
+			else {
+				unchanged++;
+				continue;
+			}
+			printf("upload %s (%s)\n", file->name, why);
+			snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+			if (nxt_put_file_as(nxt, file->name, path) != 0) {
+				failed++;
+				/* old file might be gone already */
+				file->known = 0;
+				continue;
+			}
+			file->remote = 1;
+			file->known = 1;
+			file->known_hash = file->hash;
+			bytes += file->size;
+			uploaded++;
+		} else if (file->remote && delete) {
+			printf("delete %s\n", file->name);
+			if (nxt_delete_file(nxt, file->name) != 0) {
+				failed++;
+				continue;
+			}
+			file->remote = 0;
+			deleted++;
+		}
+	}
+
+	res = sync_save_manifest(&list, manifest, pattern);
+	free(list.files);
+
+	printf("sync: %d uploaded (%u bytes), %d unchanged, %d deleted, "
+		   "%d failed, %.2f s\n", uploaded, bytes, unchanged, deleted,
+		   failed, nxt_clock() - start);
+	return (failed || res) ? -1 : 0;
+}
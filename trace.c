@@ -0,0 +1,130 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nxtcmd.h"
+#include "trace.h"
+
+static TraceEvent trace_ring[TRACE_RING_SIZE];
+static unsigned int trace_head;
+
+/*
+ * Claim the next slot. Fleet workers record concurrently, so the head
+ * is advanced atomically.
+ */
+static TraceEvent* trace_next(void) {
+	struct timespec ts;
+	TraceEvent *ev;
+
+	ev = &trace_ring[__sync_fetch_and_add(&trace_head, 1) & (TRACE_RING_SIZE - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev->usec = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	return ev;
+}
+
+/*
+ * Position of the file handle in requests and replies of the file
+ * related system commands
+ */
+static int trace_handle_offset(int event, uint8_t opcode) {
+	switch (opcode) {
+	case NXT_CMD_READ:
+	case NXT_CMD_WRITE:
+	case NXT_CMD_CLOSE:
+	case NXT_CMD_FIND_NEXT_FILE:
+		return event == TRACE_REQUEST ? 2 : 3;
+	case NXT_CMD_OPEN_READ:
+	case NXT_CMD_OPEN_WRITE:
+	case NXT_CMD_FIND_FIRST_FILE:
+	case NXT_CMD_OPEN_WRITE_LINEAR:
+	case NXT_CMD_OPEN_WRITE_DATA:
+	case NXT_CMD_OPEN_APPEND_DATA:
+		return event == TRACE_REQUEST ? -1 : 3;
+	default:
+		return -1;
+	}
+}
+
+void trace_packet(int event, const unsigned char *data, size_t len, unsigned int seq) {
+	TraceEvent *ev = trace_next();
+	int off;
+
+	ev->event = event;
+	ev->seq = seq;
+	ev->len = len;
+	ev->type = len > 0 ? data[0] : 0;
+	ev->opcode = len > 1 ? data[1] : 0;
+	ev->status = (event == TRACE_REPLY && len > 2) ? data[2] : 0;
+	off = trace_handle_offset(event, ev->opcode);
+	ev->handle = (off >= 0 && len > off) ? data[off] : 0xff;
+}
+
+void trace_error(int error, unsigned int seq) {
+	TraceEvent *ev = trace_next();
+
+	ev->event = TRACE_FAILED;
+	ev->seq = seq;
+	ev->len = 0;
+	ev->type = 0;
+	ev->opcode = 0;
+	ev->status = error < 0 ? -error : error;
+	ev->handle = 0xff;
+}
+
+unsigned int trace_count(void) {
+	return trace_head < TRACE_RING_SIZE ? trace_head : TRACE_RING_SIZE;
+}
+
+/*
+ * Write the ring oldest event first. Only uses system calls, so it
+ * may be called from a signal handler.
+ */
+int trace_dump(const char *path) {
+	TraceHeader hdr;
+	unsigned int count, first;
+	size_t n;
+	int fd, res = 0;
+
+	count = trace_count();
+	first = trace_head - count;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.count = count;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		return -1;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		res = -1;
+	/* the ring wraps at most once between first and the end */
+	first &= TRACE_RING_SIZE - 1;
+	n = TRACE_RING_SIZE - first < count ? TRACE_RING_SIZE - first : count;
+	if (res == 0 && write(fd, trace_ring + first, n * sizeof(TraceEvent)) != n * sizeof(TraceEvent))
+		res = -1;
+	n = count - n;
+	if (res == 0 && n > 0 && write(fd, trace_ring, n * sizeof(TraceEvent)) != n * sizeof(TraceEvent))
+		res = -1;
+	if (close(fd) != 0)
+		res = -1;
+	return res;
+}
@@ -0,0 +1,74 @@
+/* -*- c-basic-offset: 4; tab-width: 4; indent-tabs-mode: t -*- */
+/*
+ * Copyright (c) 2009-2014 Ralf Horstmann <ralf@ackstorm.de>
+ * 
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fixed size in-memory ring of binary transport events. Recording an
+ * event costs a clock read and a 24 byte store, so tracing can stay
+ * enabled all the time. The ring is written out with trace_dump and
+ * turned into text by nxttrace. Build with -DNO_TRACE to compile the
+ * trace points out completely.
+ */
+
+#define TRACE_RING_SIZE 1024	/* events, power of two */
+#define TRACE_MAGIC "NXTTRACE"
+#define TRACE_VERSION 1
+
+enum {
+	TRACE_REQUEST = 1,	/* packet sent to the brick */
+	TRACE_REPLY,		/* packet received from the brick */
+	TRACE_FAILED,		/* transfer failed, status holds the error */
+};
+
+typedef struct {
+	uint64_t usec;		/* monotonic clock */
+	uint32_t seq;		/* pipe sequence number, 0 for lock-step */
+	uint16_t len;		/* packet length */
+	uint8_t event;
+	uint8_t type;		/* packet type byte */
+	uint8_t opcode;
+	uint8_t status;		/* reply status or transport error */
+	uint8_t handle;		/* file handle, 0xff if none */
+	uint8_t pad[5];
+} TraceEvent;
+
+/* dump file header, followed by count events oldest first */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+} TraceHeader;
+
+#ifndef NO_TRACE
+#define TRACE_PACKET(event, data, len, seq) trace_packet(event, data, len, seq)
+#define TRACE_ERROR(error, seq) trace_error(error, seq)
+#else
+#define TRACE_PACKET(event, data, len, seq) do { } while (0)
+#define TRACE_ERROR(error, seq) do { } while (0)
+#endif
+
+void trace_packet(int event, const unsigned char *data, size_t len, unsigned int seq);
+void trace_error(int error, unsigned int seq);
+unsigned int trace_count(void);
+int trace_dump(const char *path);
+
+#endif